@@ -0,0 +1,594 @@
+#include <algorithm> // std::stable_sort, std::transform, std::max_element, std::any_of
+#include <cerrno>
+#include <cstring> // std::memcmp, std::strncmp, std::strlen
+
+extern "C"
+{
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include "archive.h"
+#include "delta.h"
+
+static const char k_magic[8] = { 'D', 'E', 'S', 'H', 'A', 'D', 'E', '1' };
+static const uint64_t k_alignment = 16;
+
+// footers of archives whose index can have deltas, other archives end in k_magic and
+// their index is made of ArchiveEntryV1 so readers from before deltas can open them
+static const char k_delta_magic[8] = { 'D', 'E', 'S', 'H', 'A', 'D', 'E', '2' };
+
+struct ArchiveEntryV1
+{
+	Hash hash;
+	char suffix[16];
+	uint64_t offset;
+	uint64_t size;
+};
+
+static ArchiveEntry Convert(const ArchiveEntryV1& old)
+{
+	ArchiveEntry entry;
+	entry.hash = old.hash;
+	std::memcpy(entry.suffix, old.suffix, sizeof entry.suffix);
+	entry.offset = old.offset;
+	entry.size = old.size;
+	entry.stored = old.size;
+	entry.base = 0;
+	return entry;
+}
+
+static ArchiveEntryV1 ConvertV1(const ArchiveEntry& entry)
+{
+	ArchiveEntryV1 old;
+	old.hash = entry.hash;
+	std::memcpy(old.suffix, entry.suffix, sizeof old.suffix);
+	old.offset = entry.offset;
+	old.size = entry.size;
+	return old;
+}
+
+static uint64_t Align(uint64_t offset)
+{
+	return (offset + k_alignment - 1) & ~(k_alignment - 1);
+}
+
+static int Compare(const ArchiveEntry& entry, const Hash& hash, const char* suffix)
+{
+	const int order = std::memcmp(entry.hash.bytes, hash.bytes, sizeof hash.bytes);
+	return order ? order : std::strncmp(entry.suffix, suffix, sizeof entry.suffix);
+}
+
+static bool Less(const ArchiveEntry& lhs, const ArchiveEntry& rhs)
+{
+	return Compare(lhs, rhs.hash, rhs.suffix) < 0;
+}
+
+// checks the footer and index of an archive of size bytes, header only archives are
+// empty, returns the size of an index entry or zero when the footer is not valid
+static size_t ValidateFooter(const ArchiveFooter& footer, uint64_t size)
+{
+	size_t entry_size = 0;
+	if (!std::memcmp(footer.magic, k_delta_magic, sizeof k_delta_magic))
+	{
+		entry_size = sizeof(ArchiveEntry);
+	}
+	else if (!std::memcmp(footer.magic, k_magic, sizeof k_magic))
+	{
+		entry_size = sizeof(ArchiveEntryV1);
+	}
+	else
+	{
+		return 0;
+	}
+	const uint64_t index_size = size - sizeof footer - footer.index_offset;
+	const bool valid = footer.index_offset >= sizeof k_magic
+	    && footer.index_offset % k_alignment == 0
+	    && footer.index_offset <= size - sizeof footer
+	    && footer.count == index_size / entry_size
+	    && index_size % entry_size == 0;
+	return valid ? entry_size : 0;
+}
+
+// the footer of the last commit, an archive appended to by a process which never got
+// to commit again ends in records after it. the index starts aligned and its entries
+// are a multiple of the alignment so every footer ends at the same offset modulo the
+// alignment. returns where that footer ends, the magic alone when there is none
+static uint64_t FindCommit(const uint8_t* data, uint64_t size, ArchiveFooter& footer, size_t& entry_size)
+{
+	const uint64_t phase = sizeof footer % k_alignment;
+	if (size < sizeof k_magic + sizeof footer)
+	{
+		return sizeof k_magic;
+	}
+	for (uint64_t end = size - (size - phase) % k_alignment; end >= sizeof k_magic + sizeof footer; end -= k_alignment)
+	{
+		std::memcpy(&footer, data + end - sizeof footer, sizeof footer);
+		if ((entry_size = ValidateFooter(footer, end)))
+		{
+			return end;
+		}
+	}
+	return sizeof k_magic;
+}
+
+static bool ValidateEntry(const ArchiveEntry& entry, uint64_t index_offset)
+{
+	return std::memchr(entry.suffix, '\0', sizeof entry.suffix)
+	    && entry.offset >= sizeof k_magic
+	    && entry.offset <= index_offset
+	    && entry.stored <= index_offset - entry.offset
+	    && (entry.base ? entry.base >= sizeof k_magic && entry.base < index_offset : entry.stored == entry.size);
+}
+
+Archive::Archive()
+	: data_         { nullptr }
+	, size_         { 0 }
+	, entries_      { nullptr }
+	, count_        { 0 }
+	, index_offset_ { 0 }
+{
+}
+
+Archive::~Archive()
+{
+	if (data_)
+	{
+		munmap((void*)data_, size_);
+	}
+}
+
+bool Archive::Open(const char* file_name)
+{
+	const int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat info;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof k_magic)
+	{
+		data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	data_ = (const uint8_t*)data;
+	size_ = info.st_size;
+	if (std::memcmp(data_, k_magic, sizeof k_magic))
+	{
+		return false;
+	}
+
+	// created but never committed
+	ArchiveFooter footer;
+	size_t entry_size = 0;
+	if (FindCommit(data_, size_, footer, entry_size) == sizeof k_magic)
+	{
+		return true;
+	}
+
+	const ArchiveEntry* entries = (const ArchiveEntry*)(data_ + footer.index_offset);
+	if (entry_size == sizeof(ArchiveEntryV1))
+	{
+		const ArchiveEntryV1* old = (const ArchiveEntryV1*)(data_ + footer.index_offset);
+		converted_.resize(footer.count);
+		std::transform(old, old + footer.count, converted_.begin(), Convert);
+		entries = converted_.data();
+	}
+	for (uint64_t i = 0; i < footer.count; i++)
+	{
+		if (!ValidateEntry(entries[i], footer.index_offset))
+		{
+			return false;
+		}
+	}
+
+	entries_ = entries;
+	count_ = footer.count;
+	index_offset_ = footer.index_offset;
+	return true;
+}
+
+const ArchiveEntry* Archive::Find(const Hash& hash, const char* suffix) const
+{
+	size_t lo = 0;
+	size_t hi = count_;
+	while (lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+		const int order = Compare(entries_[mid], hash, suffix);
+		if (order == 0)
+		{
+			return &entries_[mid];
+		}
+		if (order < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return nullptr;
+}
+
+const void* Archive::Data(const ArchiveEntry& entry) const
+{
+	return data_ + entry.offset;
+}
+
+bool Archive::Read(const ArchiveEntry& entry, void* contents) const
+{
+	if (!entry.base)
+	{
+		std::memcpy(contents, data_ + entry.offset, entry.size);
+		return true;
+	}
+
+	// the base goes no further than the records
+	uint64_t base_size;
+	if (entry.stored < sizeof base_size)
+	{
+		return false;
+	}
+	std::memcpy(&base_size, data_ + entry.offset, sizeof base_size);
+	if (base_size > index_offset_ - entry.base)
+	{
+		return false;
+	}
+	return DecodeDelta(data_ + entry.base, base_size, data_ + entry.offset + sizeof base_size,
+		entry.stored - sizeof base_size, contents, entry.size);
+}
+
+const ArchiveEntry* Archive::begin() const
+{
+	return entries_;
+}
+
+const ArchiveEntry* Archive::end() const
+{
+	return entries_ + count_;
+}
+
+ArchiveWriter::ArchiveWriter()
+	: fd_      { -1 }
+	, offset_  { 0 }
+	, dirty_   { false }
+	, delta_   { false }
+	, indexed_ { false }
+{
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+	Close();
+}
+
+bool ArchiveWriter::Write(const void* data, size_t size)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	while (size)
+	{
+		const ssize_t count = pwrite(fd_, p, size, offset_);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			return false;
+		}
+		p += count;
+		size -= count;
+		offset_ += count;
+	}
+	return true;
+}
+
+bool ArchiveWriter::Open(const char* file_name)
+{
+	Close();
+	fd_ = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd_ == -1)
+	{
+		return false;
+	}
+
+	// a second writer would truncate the records the first appended and interleave
+	// its own with them, readers only ever see committed records
+	if (flock(fd_, LOCK_EX | LOCK_NB) != 0)
+	{
+		close(fd_);
+		fd_ = -1;
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd_, &info) != 0)
+	{
+		Close();
+		return false;
+	}
+
+	const uint64_t size = info.st_size;
+	if (size == 0)
+	{
+		return Write(k_magic, sizeof k_magic);
+	}
+
+	// never clobber something that is not an archive
+	char magic[sizeof k_magic];
+	if (size < sizeof magic || pread(fd_, magic, sizeof magic, 0) != (ssize_t)sizeof magic
+	 || std::memcmp(magic, k_magic, sizeof k_magic))
+	{
+		Close();
+		return false;
+	}
+
+	void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+	if (data == MAP_FAILED)
+	{
+		Close();
+		return false;
+	}
+
+	// records appended after the last commit are not indexed, they are dropped so
+	// new records and the next index go after that commit again
+	ArchiveFooter footer;
+	size_t entry_size = 0;
+	const uint64_t committed = FindCommit((const uint8_t*)data, size, footer, entry_size);
+	std::vector<uint8_t> index(entry_size ? footer.count * entry_size : 0);
+	std::memcpy(index.data(), (const uint8_t*)data + (entry_size ? footer.index_offset : 0), index.size());
+	munmap(data, size);
+	if (committed != size && ftruncate(fd_, committed) != 0)
+	{
+		Close();
+		return false;
+	}
+
+	offset_ = committed;
+	if (committed == sizeof k_magic)
+	{
+		return true;
+	}
+
+	entries_.resize(footer.count);
+	if (entry_size == sizeof(ArchiveEntryV1))
+	{
+		const ArchiveEntryV1* old = (const ArchiveEntryV1*)index.data();
+		std::transform(old, old + footer.count, entries_.begin(), Convert);
+	}
+	else
+	{
+		std::memcpy(entries_.data(), index.data(), index.size());
+	}
+	for (const ArchiveEntry& entry : entries_)
+	{
+		if (!ValidateEntry(entry, footer.index_offset))
+		{
+			Close();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void ArchiveWriter::Close()
+{
+	if (fd_ == -1)
+	{
+		return;
+	}
+	Commit();
+	close(fd_);
+	fd_ = -1;
+	offset_ = 0;
+	entries_.clear();
+	indexed_ = false;
+	bases_.clear();
+}
+
+void ArchiveWriter::EnableDelta()
+{
+	delta_ = true;
+}
+
+// a feature is only looked up among records with the same suffix
+static uint64_t FeatureKey(const char* suffix, uint64_t feature, size_t index)
+{
+	uint64_t key = feature + index;
+	for (; *suffix; suffix++)
+	{
+		key = (key ^ (uint8_t)*suffix) * 0x100000001B3ULL;
+	}
+	return key;
+}
+
+void ArchiveWriter::AddBase(const char* suffix, const void* data, size_t size, const Base& base)
+{
+	const DeltaSketch sketch = SketchDelta(data, size);
+	for (size_t i = 0; i < DeltaSketch::k_features; i++)
+	{
+		// the first record of a family stays its base
+		bases_.insert({ FeatureKey(suffix, sketch.features[i], i), base });
+	}
+}
+
+void ArchiveWriter::IndexBases()
+{
+	indexed_ = true;
+	std::vector<char> contents;
+	for (const ArchiveEntry& entry : entries_)
+	{
+		if (entry.suffix[0] != '_' || entry.base)
+		{
+			continue;
+		}
+		contents.resize(entry.size);
+		if (pread(fd_, contents.data(), entry.size, entry.offset) == (ssize_t)entry.size)
+		{
+			AddBase(entry.suffix, contents.data(), entry.size, Base { entry.offset, entry.size });
+		}
+	}
+}
+
+// the record sharing the most features with data, its contents are read into contents
+bool ArchiveWriter::FindBase(const char* suffix, const void* data, size_t size, Base& base, std::vector<char>& contents)
+{
+	const DeltaSketch sketch = SketchDelta(data, size);
+	Base candidates[DeltaSketch::k_features];
+	size_t votes[DeltaSketch::k_features] = { };
+	size_t count = 0;
+	for (size_t i = 0; i < DeltaSketch::k_features; i++)
+	{
+		const auto found = bases_.find(FeatureKey(suffix, sketch.features[i], i));
+		if (found == bases_.end())
+		{
+			continue;
+		}
+		size_t j = 0;
+		while (j < count && candidates[j].offset != found->second.offset)
+		{
+			j++;
+		}
+		candidates[j] = found->second;
+		votes[j]++;
+		count = std::max(count, j + 1);
+	}
+	if (!count)
+	{
+		return false;
+	}
+
+	base = candidates[std::max_element(votes, votes + count) - votes];
+	contents.resize(base.size);
+	return pread(fd_, contents.data(), base.size, base.offset) == (ssize_t)base.size;
+}
+
+bool ArchiveWriter::Append(const Hash& hash, const char* suffix, const void* data, size_t size)
+{
+	ArchiveEntry entry;
+	if (fd_ == -1 || std::strlen(suffix) >= sizeof entry.suffix)
+	{
+		return false;
+	}
+
+	static const uint8_t k_padding[k_alignment] = { };
+	if (!Write(k_padding, Align(offset_) - offset_))
+	{
+		return false;
+	}
+
+	entry.hash = hash;
+	std::memset(entry.suffix, 0, sizeof entry.suffix);
+	std::strcpy(entry.suffix, suffix);
+	entry.offset = offset_;
+	entry.size = size;
+	entry.stored = size;
+	entry.base = 0;
+
+	// only shaders come in families of variants, caches are stored whole
+	const bool shader = delta_ && suffix[0] == '_';
+	if (shader && !indexed_)
+	{
+		IndexBases();
+	}
+
+	Base base;
+	std::vector<char> base_contents;
+	if (shader && FindBase(suffix, data, size, base, base_contents))
+	{
+		const uint64_t base_size = base.size;
+		const std::vector<uint8_t> delta = EncodeDelta(base_contents.data(), base.size, data, size);
+		if (sizeof base_size + delta.size() <= size / 2)
+		{
+			if (!Write(&base_size, sizeof base_size) || !Write(delta.data(), delta.size()))
+			{
+				return false;
+			}
+			entry.stored = sizeof base_size + delta.size();
+			entry.base = base.offset;
+			entries_.push_back(entry);
+			dirty_ = true;
+			return true;
+		}
+	}
+
+	if (!Write(data, size))
+	{
+		return false;
+	}
+	if (shader)
+	{
+		AddBase(suffix, data, size, Base { entry.offset, size });
+	}
+
+	entries_.push_back(entry);
+	dirty_ = true;
+	return true;
+}
+
+bool ArchiveWriter::Commit()
+{
+	if (fd_ == -1 || !dirty_)
+	{
+		return fd_ != -1;
+	}
+
+	// sort, then keep only the last record appended for every hash and suffix
+	std::stable_sort(entries_.begin(), entries_.end(), Less);
+	std::vector<ArchiveEntry> index;
+	index.reserve(entries_.size());
+	for (size_t i = 0; i < entries_.size(); i++)
+	{
+		if (i + 1 < entries_.size() && !Less(entries_[i], entries_[i + 1]))
+		{
+			continue;
+		}
+		index.push_back(entries_[i]);
+	}
+	entries_.swap(index);
+
+	static const uint8_t k_padding[k_alignment] = { };
+	if (!Write(k_padding, Align(offset_) - offset_))
+	{
+		return false;
+	}
+
+	ArchiveFooter footer;
+	footer.index_offset = offset_;
+	footer.count = entries_.size();
+	const bool deltas = std::any_of(entries_.begin(), entries_.end(), [](const ArchiveEntry& entry) { return entry.base; });
+	bool written = false;
+	if (deltas)
+	{
+		std::memcpy(footer.magic, k_delta_magic, sizeof k_delta_magic);
+		written = Write(entries_.data(), entries_.size() * sizeof(ArchiveEntry));
+	}
+	else
+	{
+		std::vector<ArchiveEntryV1> old(entries_.size());
+		std::transform(entries_.begin(), entries_.end(), old.begin(), ConvertV1);
+		std::memcpy(footer.magic, k_magic, sizeof k_magic);
+		written = Write(old.data(), old.size() * sizeof(ArchiveEntryV1));
+	}
+	if (!written || !Write(&footer, sizeof footer))
+	{
+		return false;
+	}
+
+	fdatasync(fd_);
+	dirty_ = false;
+	return true;
+}
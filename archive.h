@@ -0,0 +1,120 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "hash.h"
+
+// single file alternative to one file per shader in shaders/
+//
+//   header   8 byte magic
+//   records  contents of every shader, each aligned to 16 bytes
+//   index    ArchiveEntry[count] sorted by hash then suffix
+//   footer   ArchiveFooter
+//
+// records are only ever appended, each commit writes a fresh index and footer after
+// them. readers use the last footer in the file, records appended by a process which
+// died before it could commit are ignored and the next writer truncates them
+//
+// a shader record can be a delta against another record stored whole, the size of
+// that base as a uint64_t followed by the delta of delta.h
+struct ArchiveEntry
+{
+	Hash hash;
+	char suffix[16]; // nul terminated
+	uint64_t offset;
+	uint64_t size; // of the contents
+	uint64_t stored; // bytes of the record, the size unless it is a delta
+	uint64_t base; // offset of the record a delta applies to, zero for whole records
+};
+
+struct ArchiveFooter
+{
+	uint64_t index_offset;
+	uint64_t count;
+	char magic[8];
+};
+
+// read only view of an archive mapped into memory, lookups are a binary search
+// over the mapped index and never make a system call
+struct Archive
+{
+	Archive();
+	~Archive();
+
+	bool Open(const char* file_name);
+
+	// nullptr when hash and suffix are not in the archive
+	const ArchiveEntry* Find(const Hash& hash, const char* suffix) const;
+
+	// the contents of a whole record in place, Read has to be used for deltas
+	const void* Data(const ArchiveEntry& entry) const;
+
+	// copies entry.size bytes of contents, deltas are reconstructed
+	bool Read(const ArchiveEntry& entry, void* contents) const;
+
+	const ArchiveEntry* begin() const;
+	const ArchiveEntry* end() const;
+
+private:
+	Archive(const Archive&) = delete;
+	Archive& operator=(const Archive&) = delete;
+
+	const uint8_t* data_;
+	size_t size_;
+	const ArchiveEntry* entries_;
+	size_t count_;
+	uint64_t index_offset_;
+
+	// the index of an archive written before records could be deltas
+	std::vector<ArchiveEntry> converted_;
+};
+
+// appends records to a new or existing archive, nothing appended is visible to
+// readers until Commit writes the index
+struct ArchiveWriter
+{
+	ArchiveWriter();
+	~ArchiveWriter();
+
+	// the archive stays locked until Close, false while another writer has it open
+	bool Open(const char* file_name);
+	void Close();
+
+	// store shaders as deltas against a similar record where that takes at most half
+	// the size, caches are always stored whole
+	void EnableDelta();
+
+	// a later record for the same hash and suffix replaces an earlier one
+	bool Append(const Hash& hash, const char* suffix, const void* data, size_t size);
+	bool Commit();
+
+private:
+	ArchiveWriter(const ArchiveWriter&) = delete;
+	ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+	struct Base
+	{
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	bool Write(const void* data, size_t size);
+	void IndexBases();
+	void AddBase(const char* suffix, const void* data, size_t size, const Base& base);
+	bool FindBase(const char* suffix, const void* data, size_t size, Base& base, std::vector<char>& contents);
+
+	int fd_;
+	uint64_t offset_;
+	bool dirty_;
+	std::vector<ArchiveEntry> entries_;
+
+	// whole shader records by the features of their sketch and suffix, records in the
+	// archive before Open are only indexed when the first shader is appended
+	bool delta_;
+	bool indexed_;
+	std::unordered_map<uint64_t, Base> bases_;
+};
+
+#endif
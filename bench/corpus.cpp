@@ -0,0 +1,508 @@
+#include <algorithm> // std::sort, std::min
+#include <chrono>
+#include <functional> // std::hash
+#include <string>
+#include <vector>
+
+#include <cstdio> // std::printf, std::fprintf, std::snprintf, popen
+#include <cstdlib> // std::atoi, std::strtoul, std::system, setenv, mkdtemp
+#include <cstring> // std::strcmp, std::strncmp, std::strchr, std::memcpy
+
+extern "C"
+{
+	#include <dirent.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include <GL/glx.h>
+
+#include "stubvk.h"
+
+// measures how dumping and replacing behaves as the number of shaders an application
+// loads grows, against stub drivers whose functions do no work
+//
+//   corpus [-s shaders,...] [-v variants] [-r percent,...] [-a] [-d] [-k]
+//
+// the shaders are generated in families of -v variants the way engines build them,
+// GLSL families share a body and differ in the #define header in front of it, SPIR-V
+// families share their code and differ in a few constants. Half the families go
+// through glShaderSource and half through vkCreateShaderModule
+//
+// every corpus size is loaded once into an empty shaders directory, which dumps all
+// of it, and once more for every -r percent of those dumps left in place as
+// replacements, the rest dumped again. For every launch and API the latency of a
+// call is reported as percentiles, along with how long dumps took to be written at
+// exit, how far the peak resident memory grew and what the shaders directory grew
+// to. With -k the directories are kept, the cold one is a corpus for deshade-replay
+//
+// -a dumps into an archive instead and -d stores deltas in it, an archive is always
+// kept whole so the only warm launch has all of it
+typedef GLuint (*GLCREATESHADERPROC)(GLenum);
+typedef void (*GLDELETESHADERPROC)(GLuint);
+typedef void (*GLSHADERSOURCEPROC)(GLuint, GLsizei, const GLchar**, const GLint*);
+
+static const size_t k_features = 8;
+
+// in the directory of a launch
+static const char* k_archive = "shaders.dsa";
+
+// splitmix64, the corpus is the same on every run
+static uint64_t Next(uint64_t& state)
+{
+	uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+// the body a GLSL family shares, between 8 and 40 functions with a block for every
+// feature a variant can switch on
+static std::string MakeBody(size_t family)
+{
+	uint64_t state = family;
+	const size_t functions = 8 + Next(state) % 33;
+	const bool vertex = (family / 2) % 2;
+
+	std::string body = vertex
+		? "in vec4 a_position;\nout vec2 v_uv;\nuniform vec4 u_params[8];\n"
+		: "in vec2 v_uv;\nout vec4 o_color;\nuniform vec4 u_params[8];\n";
+	char line[256];
+	for (size_t i = 0; i < functions; i++)
+	{
+		const size_t feature = Next(state) % k_features;
+		std::snprintf(line, sizeof line,
+			"vec4 f%zu(vec4 x)\n{\n"
+			"\tx = x * %.3f + u_params[%zu];\n"
+			"#ifdef FEATURE_%zu\n"
+			"\tx = sin(x * %.3f) * QUALITY;\n"
+			"#else\n"
+			"\tx = clamp(x, vec4(0.0), vec4(%.3f));\n"
+			"#endif\n"
+			"\treturn x;\n}\n",
+			i, (Next(state) % 1000) / 1000.0, i % 8, feature, (Next(state) % 1000) / 100.0, (Next(state) % 1000) / 500.0);
+		body += line;
+	}
+
+	body += vertex ? "void main()\n{\n\tvec4 c = a_position;\n" : "void main()\n{\n\tvec4 c = vec4(v_uv, 0.0, 1.0);\n";
+	for (size_t i = 0; i < functions; i++)
+	{
+		std::snprintf(line, sizeof line, "\tc = f%zu(c);\n", i);
+		body += line;
+	}
+	body += vertex ? "\tgl_Position = c;\n\tv_uv = c.xy;\n}\n" : "\to_color = c;\n}\n";
+	return body;
+}
+
+// the features of a variant are the bits of its index, variants past the last
+// combination raise the quality instead
+static void MakeSource(const std::string& body, size_t variant, std::string& source)
+{
+	source = "#version 330 core\n";
+	char line[64];
+	for (size_t feature = 0; feature < k_features; feature++)
+	{
+		if (variant & (1 << feature))
+		{
+			std::snprintf(line, sizeof line, "#define FEATURE_%zu\n", feature);
+			source += line;
+		}
+	}
+	std::snprintf(line, sizeof line, "#define QUALITY %zu.0\n", (variant >> k_features) + 1);
+	source += line;
+	source += body;
+}
+
+// a fragment shader declaring between 64 and 512 float constants, the first four
+// are the variant's own
+static void MakeFamilyModule(size_t family, size_t variant, std::vector<uint32_t>& code)
+{
+	uint64_t state = family;
+	const uint32_t constants = 64 + Next(state) % 449;
+	const uint32_t id_void = 1, id_function = 2, id_float = 3, id_main = 4, id_label = 5, id_constant = 6;
+	code = {
+		0x07230203, 0x00010000, 0, id_constant + constants, 0,
+		(2u << 16) | 17, 1, // OpCapability Shader
+		(3u << 16) | 14, 0, 1, // OpMemoryModel Logical GLSL450
+		(5u << 16) | 15, 4, id_main, 0x6e69616d, 0, // OpEntryPoint Fragment %main "main"
+		(3u << 16) | 16, id_main, 7, // OpExecutionMode %main OriginUpperLeft
+		(2u << 16) | 19, id_void, // OpTypeVoid
+		(3u << 16) | 33, id_function, id_void, // OpTypeFunction %void
+		(3u << 16) | 22, id_float, 32 // OpTypeFloat 32
+	};
+	for (uint32_t i = 0; i < constants; i++)
+	{
+		const float value = i < 4 ? (float)((variant >> (i * 8)) & 0xff) : (float)(Next(state) % 1000) / 100.0f;
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof bits);
+		code.insert(code.end(), { (4u << 16) | 43, id_float, id_constant + i, bits }); // OpConstant
+	}
+	code.insert(code.end(), {
+		(5u << 16) | 54, id_void, id_main, 0, id_function, // OpFunction
+		(2u << 16) | 248, id_label, // OpLabel
+		(1u << 16) | 253, // OpReturn
+		(1u << 16) | 56 // OpFunctionEnd
+	});
+}
+
+static size_t ReadStatus(const char* field)
+{
+	std::FILE* file = std::fopen("/proc/self/status", "r");
+	char line[256];
+	size_t kib = 0;
+	while (file && std::fgets(line, sizeof line, file))
+	{
+		if (!std::strncmp(line, field, std::strlen(field)))
+		{
+			kib = std::strtoul(line + std::strlen(field), nullptr, 10);
+			break;
+		}
+	}
+	if (file)
+	{
+		std::fclose(file);
+	}
+	return kib;
+}
+
+static uint64_t Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// prints the latency of calls through one API, sorts them
+static void PrintLatency(const char* api, std::vector<uint32_t>& latency)
+{
+	uint64_t total = 0;
+	for (uint32_t ns : latency)
+	{
+		total += ns;
+	}
+	std::sort(latency.begin(), latency.end());
+	const auto percentile = [&](size_t percent) -> uint32_t
+	{
+		return latency.empty() ? 0 : latency[std::min(latency.size() - 1, latency.size() * percent / 100)];
+	};
+	std::printf("%s %zu %llu %u %u %u\n", api, latency.size(), (unsigned long long)total,
+		percentile(50), percentile(99), latency.empty() ? 0 : latency.back());
+}
+
+// one launch, loads every shader once and prints what it measured
+static int Load(size_t shaders, size_t variants)
+{
+	GLCREATESHADERPROC create_shader = (GLCREATESHADERPROC)glXGetProcAddress((const GLubyte*)"glCreateShader");
+	GLDELETESHADERPROC delete_shader = (GLDELETESHADERPROC)glXGetProcAddress((const GLubyte*)"glDeleteShader");
+	GLSHADERSOURCEPROC shader_source = (GLSHADERSOURCEPROC)glXGetProcAddress((const GLubyte*)"glShaderSource");
+	StubDevice stub;
+	if (!CreateStubDevice(stub))
+	{
+		std::fprintf(stderr, "failed to create device\n");
+		return 1;
+	}
+	PFN_vkCreateShaderModule create_shader_module =
+		(PFN_vkCreateShaderModule)stub.get_device_proc_addr(stub.device, "vkCreateShaderModule");
+
+	// touched up front so they do not count towards the memory deshade takes
+	std::vector<uint32_t> gl_latency(shaders);
+	std::vector<uint32_t> vk_latency(shaders);
+	size_t gl_calls = 0;
+	size_t vk_calls = 0;
+	const size_t resident = ReadStatus("VmRSS:");
+
+	std::string body;
+	std::string source;
+	std::vector<uint32_t> code;
+	for (size_t i = 0; i < shaders; i++)
+	{
+		const size_t family = i / variants;
+		const size_t variant = i % variants;
+		if (family % 2 == 0)
+		{
+			if (!variant)
+			{
+				body = MakeBody(family);
+			}
+			MakeSource(body, variant, source);
+			const GLchar* string = source.data();
+			const GLint length = source.size();
+			const GLuint shader = create_shader((family / 2) % 2 ? GL_VERTEX_SHADER : GL_FRAGMENT_SHADER);
+			const uint64_t start = Now();
+			shader_source(shader, 1, &string, &length);
+			gl_latency[gl_calls++] = Now() - start;
+			delete_shader(shader);
+		}
+		else
+		{
+			MakeFamilyModule(family, variant, code);
+			VkShaderModuleCreateInfo create_info = { };
+			create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+			create_info.codeSize = code.size() * sizeof(uint32_t);
+			create_info.pCode = code.data();
+			VkShaderModule module;
+			const uint64_t start = Now();
+			create_shader_module(stub.device, &create_info, nullptr, &module);
+			vk_latency[vk_calls++] = Now() - start;
+		}
+	}
+
+	gl_latency.resize(gl_calls);
+	vk_latency.resize(vk_calls);
+	PrintLatency("gl", gl_latency);
+	PrintLatency("vk", vk_latency);
+	DestroyStubDevice(stub);
+
+	// the parent times from here until the process is gone, which is how long the
+	// dumps still pending take to be written
+	std::printf("process %zu %zu %llu\n", resident, ReadStatus("VmHWM:"), (unsigned long long)Now());
+	return 0;
+}
+
+struct Latency
+{
+	char api[8] = "";
+	size_t calls = 0;
+	unsigned long long total_ns = 0;
+	unsigned p50_ns = 0;
+	unsigned p99_ns = 0;
+	unsigned max_ns = 0;
+};
+
+struct Launched
+{
+	Latency latency[2];
+	size_t resident_kib = 0;
+	size_t peak_kib = 0;
+	double exit_ms = 0.0;
+	size_t files = 0;
+	size_t disk_bytes = 0;
+};
+
+// files and allocated bytes of a directory or an archive
+static void Measure(const std::string& path, Launched& launched)
+{
+	struct stat info;
+	if (!stat(path.c_str(), &info) && S_ISREG(info.st_mode))
+	{
+		launched.files = 1;
+		launched.disk_bytes = info.st_blocks * 512;
+		return;
+	}
+
+	DIR* dir = opendir(path.c_str());
+	while (struct dirent* entry = dir ? readdir(dir) : nullptr)
+	{
+		struct stat info;
+		if (entry->d_name[0] != '.' && !stat((path + "/" + entry->d_name).c_str(), &info) && S_ISREG(info.st_mode))
+		{
+			launched.files++;
+			launched.disk_bytes += info.st_blocks * 512;
+		}
+	}
+	if (dir)
+	{
+		closedir(dir);
+	}
+}
+
+static bool Launch(const char* self, const std::string& directory, const std::string& environment, size_t shaders, size_t variants, Launched& launched)
+{
+	const std::string command = "cd " + directory + " && " + environment + self + " --load " + std::to_string(shaders) + " " + std::to_string(variants);
+	std::FILE* pipe = popen(command.c_str(), "r");
+	if (!pipe)
+	{
+		return false;
+	}
+	size_t apis = 0;
+	unsigned long long end = 0;
+	char line[256];
+	while (std::fgets(line, sizeof line, pipe))
+	{
+		Latency& latency = launched.latency[std::min<size_t>(apis, 1)];
+		if (std::sscanf(line, "process %zu %zu %llu", &launched.resident_kib, &launched.peak_kib, &end) == 3)
+		{
+			continue;
+		}
+		if (std::sscanf(line, "%7s %zu %llu %u %u %u", latency.api, &latency.calls, &latency.total_ns, &latency.p50_ns, &latency.p99_ns, &latency.max_ns) == 6)
+		{
+			apis++;
+		}
+	}
+	if (pclose(pipe) != 0 || apis != 2 || !end)
+	{
+		return false;
+	}
+	launched.exit_ms = (Now() - end) / 1e6;
+	Measure(directory + "/" + (environment.empty() ? "shaders" : k_archive), launched);
+	return true;
+}
+
+// links every dump of the cold launch kept as a replacement, which ones is decided by
+// name so that every run keeps the same
+static void Link(const std::string& from, const std::string& to, size_t percent)
+{
+	DIR* dir = opendir(from.c_str());
+	while (struct dirent* entry = dir ? readdir(dir) : nullptr)
+	{
+		if (entry->d_name[0] != '.' && std::hash<std::string>()(entry->d_name) % 100 < percent)
+		{
+			link((from + "/" + entry->d_name).c_str(), (to + "/" + entry->d_name).c_str());
+		}
+	}
+	if (dir)
+	{
+		closedir(dir);
+	}
+}
+
+static std::vector<size_t> ParseList(const char* list)
+{
+	std::vector<size_t> values;
+	for (const char* value = list; value; value = std::strchr(value, ','))
+	{
+		value += *value == ',';
+		values.push_back(std::strtoul(value, nullptr, 10));
+	}
+	return values;
+}
+
+static void Print(size_t shaders, const std::string& name, const Launched& launched)
+{
+	for (const Latency& latency : launched.latency)
+	{
+		std::printf("%8zu %-10s %4s %8zu %9.1f %8.2f %8.2f %9.1f %8.1f %8.1f %8zu %9.1f\n",
+			shaders, name.c_str(), latency.api, latency.calls, latency.total_ns / 1e6,
+			latency.p50_ns / 1e3, latency.p99_ns / 1e3, latency.max_ns / 1e3,
+			launched.exit_ms, (launched.peak_kib - launched.resident_kib) / 1024.0,
+			launched.files, launched.disk_bytes / (1024.0 * 1024.0));
+	}
+}
+
+int main(int argc, char** argv)
+{
+	// Dumpped and Replaced lines would otherwise be most of the work
+	setenv("DESHADE_LOG", "error", 0);
+	if (argc > 3 && !std::strcmp(argv[1], "--load"))
+	{
+		return Load(std::strtoul(argv[2], nullptr, 10), std::strtoul(argv[3], nullptr, 10));
+	}
+
+	std::vector<size_t> sizes = { 10000, 100000 };
+	size_t variants = 32;
+	std::vector<size_t> percents = { 10, 100 };
+	bool archive = false;
+	bool delta = false;
+	bool keep = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:v:r:adk")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			sizes = ParseList(optarg);
+			break;
+		case 'v':
+			variants = std::atoi(optarg);
+			break;
+		case 'r':
+			percents = ParseList(optarg);
+			break;
+		case 'a':
+			archive = true;
+			break;
+		case 'd':
+			archive = true;
+			delta = true;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		default:
+			variants = 0;
+			break;
+		}
+	}
+	const bool valid = std::find(sizes.begin(), sizes.end(), 0) == sizes.end()
+		&& std::find_if(percents.begin(), percents.end(), [](size_t percent) { return percent > 100; }) == percents.end();
+	if (!variants || !valid || optind != argc)
+	{
+		std::fprintf(stderr, "usage: %s [-s shaders,...] [-v variants] [-r percent,...] [-a] [-d] [-k]\n", argv[0]);
+		return 1;
+	}
+
+	std::string environment;
+	if (archive)
+	{
+		environment = std::string("DESHADE_ARCHIVE=") + k_archive + (delta ? " DESHADE_DELTA=1 " : " ");
+		percents = { 100 };
+	}
+
+	char self[4096];
+	const ssize_t length = readlink("/proc/self/exe", self, sizeof self - 1);
+	char directory[] = "/tmp/deshade-bench-XXXXXX";
+	if (length <= 0 || !mkdtemp(directory))
+	{
+		std::fprintf(stderr, "failed to create a directory to run in\n");
+		return 1;
+	}
+	self[length] = '\0';
+
+	std::printf("%zu variants per family%s\n", variants, delta ? ", dumped as deltas into an archive" : archive ? ", dumped into an archive" : "");
+	std::printf("%8s %-10s %4s %8s %9s %8s %8s %9s %8s %8s %8s %9s\n",
+		"shaders", "launch", "api", "calls", "load ms", "p50 us", "p99 us", "max us", "exit ms", "rss MiB", "files", "disk MiB");
+	int status = 0;
+	for (size_t shaders : sizes)
+	{
+		const std::string corpus = std::string(directory) + "/" + std::to_string(shaders);
+		const std::string cold = corpus + "/cold";
+		for (const std::string& path : { corpus, cold, cold + "/shaders" })
+		{
+			mkdir(path.c_str(), 0755);
+		}
+
+		Launched launched;
+		if (!Launch(self, cold, environment, shaders, variants, launched))
+		{
+			std::fprintf(stderr, "the cold launch of %zu shaders failed\n", shaders);
+			status = 1;
+			continue;
+		}
+		Print(shaders, "cold", launched);
+
+		for (size_t percent : percents)
+		{
+			const std::string name = "warm " + std::to_string(percent) + "%";
+			const std::string warm = corpus + "/warm-" + std::to_string(percent);
+			mkdir(warm.c_str(), 0755);
+			mkdir((warm + "/shaders").c_str(), 0755);
+			if (archive)
+			{
+				// nothing is appended when everything is found
+				link((cold + "/" + k_archive).c_str(), (warm + "/" + k_archive).c_str());
+			}
+			else
+			{
+				Link(cold + "/shaders", warm + "/shaders", percent);
+			}
+
+			Launched warm_launched;
+			if (!Launch(self, warm, environment, shaders, variants, warm_launched))
+			{
+				std::fprintf(stderr, "the %s launch of %zu shaders failed\n", name.c_str(), shaders);
+				status = 1;
+				continue;
+			}
+			Print(shaders, name, warm_launched);
+		}
+	}
+
+	// a million shaders take gigabytes
+	if (keep)
+	{
+		std::printf("the shaders directories are kept in %s\n", directory);
+	}
+	else
+	{
+		std::system(("rm -rf " + std::string(directory)).c_str());
+	}
+	return status;
+}
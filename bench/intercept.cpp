@@ -0,0 +1,521 @@
+#include <algorithm> // std::find_if
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cerrno> // ENOMEM
+#include <cstdio> // std::printf, std::fprintf, std::snprintf, popen
+#include <cstdlib> // std::atoi, std::atof, setenv, mkdtemp
+
+extern "C"
+{
+	#include <dlfcn.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include <GL/glx.h>
+
+#include "stubvk.h"
+
+// measures the paths through deshade an application calls most one at a time, in
+// front of stub drivers whose functions do no work, on one thread and on many
+//
+//   intercept [-t threads] [-n operations] [-b baseline.csv] [-r percent]
+//
+// prints name,threads,ns_per_op,allocs_per_op as CSV, where ns_per_op is the wall
+// time of one operation on one thread, so it stays flat as long as threads scale,
+// and allocs_per_op counts the allocations made on the calling thread. With -b the
+// results are compared against an earlier run saved from stdout, the exit status
+// is non-zero when an operation got more than percent slower or allocates more
+//
+// the first launch dumps the shaders the hit cases use into a fresh directory, the
+// second finds them there and measures
+typedef GLuint (*GLCREATESHADERPROC)(GLenum);
+typedef void (*GLDELETESHADERPROC)(GLuint);
+typedef void (*GLSHADERSOURCEPROC)(GLuint, GLsizei, const GLchar**, const GLint*);
+
+static const size_t k_sources_per_thread = 16;
+static const size_t k_source_size = 1024;
+static const size_t k_runs = 5;
+
+// every source and module is made from a seed, the hit seed is dumped by the first
+// launch and the miss seed never is
+static const size_t k_hit = 1;
+static const size_t k_miss = 2;
+
+// allocations are counted on the threads being measured only, the counters are
+// trivial thread locals of the executable so counting is safe from the first malloc
+static thread_local bool t_counting;
+static thread_local size_t t_allocations;
+
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void* __libc_memalign(size_t, size_t);
+
+static void Count()
+{
+	if (t_counting)
+	{
+		t_allocations++;
+	}
+}
+
+extern "C" void* malloc(size_t size)
+{
+	Count();
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	Count();
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size)
+{
+	Count();
+	return __libc_realloc(pointer, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+	Count();
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+	Count();
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** pointer, size_t alignment, size_t size)
+{
+	Count();
+	*pointer = __libc_memalign(alignment, size);
+	return *pointer ? 0 : ENOMEM;
+}
+
+template<typename T>
+static T GetProc(const char* name)
+{
+	return (T)glXGetProcAddress((const GLubyte*)name);
+}
+
+static std::string MakeSource(size_t seed, size_t thread, size_t index)
+{
+	char header[128];
+	std::snprintf(header, sizeof header, "#version 330 core\n// seed %zu thread %zu source %zu\n", seed, thread, index);
+	std::string source = header;
+	while (source.size() < k_source_size)
+	{
+		source += "out vec4 color; void main() { color = vec4(0.25, 0.5, 0.75, 1.0); }\n";
+	}
+	source.resize(k_source_size);
+	return source;
+}
+
+// a case prepares what one thread needs and hands back the loop to time
+typedef std::function<void(size_t)> Loop;
+typedef std::function<Loop(size_t)> Prepare;
+
+struct Case
+{
+	std::string name;
+	Prepare prepare;
+};
+
+struct Result
+{
+	double ns_per_op = 0.0;
+	double allocs_per_op = 0.0;
+};
+
+static Result Run(const Prepare& prepare, size_t thread_count, size_t operations)
+{
+	std::atomic<size_t> ready { 0 };
+	std::atomic<bool> go { false };
+	std::atomic<size_t> allocations { 0 };
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_count; t++)
+	{
+		threads.emplace_back([&, t]
+		{
+			const Loop loop = prepare(t);
+
+			ready++;
+			while (!go.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+
+			t_allocations = 0;
+			t_counting = true;
+			loop(operations);
+			t_counting = false;
+			allocations += t_allocations;
+		});
+	}
+
+	while (ready.load() != thread_count)
+	{
+		std::this_thread::yield();
+	}
+	const auto start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	Result result;
+	result.ns_per_op = elapsed.count() / operations;
+	result.allocs_per_op = (double)allocations.load() / (thread_count * operations);
+	return result;
+}
+
+static std::vector<Case> MakeCases(StubDevice& stub)
+{
+	GLCREATESHADERPROC create_shader = GetProc<GLCREATESHADERPROC>("glCreateShader");
+	GLDELETESHADERPROC delete_shader = GetProc<GLDELETESHADERPROC>("glDeleteShader");
+	GLSHADERSOURCEPROC shader_source = GetProc<GLSHADERSOURCEPROC>("glShaderSource");
+	PFN_vkGetDeviceProcAddr get_device_proc_addr = stub.get_device_proc_addr;
+	PFN_vkCreateShaderModule create_shader_module =
+		(PFN_vkCreateShaderModule)get_device_proc_addr(stub.device, "vkCreateShaderModule");
+	VkDevice device = stub.device;
+
+	const auto shader_source_case = [=](size_t seed)
+	{
+		return [=](size_t thread) -> Loop
+		{
+			auto sources = std::make_shared<std::vector<std::string>>();
+			auto shaders = std::make_shared<std::vector<GLuint>>();
+			for (size_t i = 0; i < k_sources_per_thread; i++)
+			{
+				sources->push_back(MakeSource(seed, thread, i));
+				shaders->push_back(create_shader(GL_FRAGMENT_SHADER));
+			}
+			return [=](size_t operations)
+			{
+				for (size_t i = 0; i < operations; i++)
+				{
+					const std::string& source = (*sources)[i % k_sources_per_thread];
+					const GLchar* string = source.data();
+					const GLint length = source.size();
+					shader_source((*shaders)[i % k_sources_per_thread], 1, &string, &length);
+				}
+			};
+		};
+	};
+
+	const auto create_shader_module_case = [=](size_t seed)
+	{
+		return [=](size_t thread) -> Loop
+		{
+			auto modules = std::make_shared<std::vector<std::vector<uint32_t>>>();
+			for (size_t i = 0; i < k_sources_per_thread; i++)
+			{
+				modules->push_back(MakeModule(seed, thread, i, k_source_size));
+			}
+			return [=](size_t operations)
+			{
+				for (size_t i = 0; i < operations; i++)
+				{
+					const std::vector<uint32_t>& code = (*modules)[i % k_sources_per_thread];
+					VkShaderModuleCreateInfo create_info = { };
+					create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+					create_info.codeSize = code.size() * sizeof(uint32_t);
+					create_info.pCode = code.data();
+					VkShaderModule module;
+					create_shader_module(device, &create_info, nullptr, &module);
+				}
+			};
+		};
+	};
+
+	return {
+		// a name deshade does not intercept, forwarded to the dynamic linker
+		{ "dlsym", [](size_t) -> Loop
+		{
+			return [](size_t operations)
+			{
+				for (size_t i = 0; i < operations; i++)
+				{
+					dlsym(RTLD_DEFAULT, "glFinish");
+				}
+			};
+		} },
+		{ "glXGetProcAddress", [](size_t) -> Loop
+		{
+			return [](size_t operations)
+			{
+				for (size_t i = 0; i < operations; i++)
+				{
+					glXGetProcAddress((const GLubyte*)"glShaderSource");
+				}
+			};
+		} },
+		// the stub driver reuses deleted names, so every operation is a create and a delete
+		{ "glCreateShader+glDeleteShader", [=](size_t) -> Loop
+		{
+			return [=](size_t operations)
+			{
+				for (size_t i = 0; i < operations; i++)
+				{
+					delete_shader(create_shader(GL_FRAGMENT_SHADER));
+				}
+			};
+		} },
+		{ "glShaderSource/miss", shader_source_case(k_miss) },
+		{ "glShaderSource/hit", shader_source_case(k_hit) },
+		{ "vkGetDeviceProcAddr/hooked", [=](size_t) -> Loop
+		{
+			return [=](size_t operations)
+			{
+				for (size_t i = 0; i < operations; i++)
+				{
+					get_device_proc_addr(device, "vkCreateShaderModule");
+				}
+			};
+		} },
+		{ "vkGetDeviceProcAddr/forwarded", [=](size_t) -> Loop
+		{
+			return [=](size_t operations)
+			{
+				for (size_t i = 0; i < operations; i++)
+				{
+					get_device_proc_addr(device, "vkDestroyShaderModule");
+				}
+			};
+		} },
+		{ "vkCreateShaderModule/miss", create_shader_module_case(k_miss) },
+		{ "vkCreateShaderModule/hit", create_shader_module_case(k_hit) },
+	};
+}
+
+// the first launch, runs every hit source and module through deshade once so they
+// are dumped by the time it exits
+static int Dump(size_t max_threads)
+{
+	StubDevice stub;
+	if (!CreateStubDevice(stub))
+	{
+		std::fprintf(stderr, "failed to create device\n");
+		return 1;
+	}
+	for (const Case& entry : MakeCases(stub))
+	{
+		if (entry.name == "glShaderSource/hit" || entry.name == "vkCreateShaderModule/hit")
+		{
+			for (size_t t = 0; t < max_threads; t++)
+			{
+				entry.prepare(t)(k_sources_per_thread);
+			}
+		}
+	}
+	DestroyStubDevice(stub);
+	return 0;
+}
+
+// the second launch, prints a line of CSV for every case and thread count
+static int Measure(const std::vector<size_t>& thread_counts, size_t operations)
+{
+	StubDevice stub;
+	if (!CreateStubDevice(stub))
+	{
+		std::fprintf(stderr, "failed to create device\n");
+		return 1;
+	}
+	for (const Case& entry : MakeCases(stub))
+	{
+		for (size_t threads : thread_counts)
+		{
+			// the first pass dumps the misses and maps the hits, later ones are timed
+			Run(entry.prepare, threads, k_sources_per_thread);
+			Result best;
+			for (size_t run = 0; run < k_runs; run++)
+			{
+				const Result result = Run(entry.prepare, threads, operations);
+				if (!run || result.ns_per_op < best.ns_per_op)
+				{
+					best = result;
+				}
+			}
+			std::printf("%s,%zu,%.1f,%.2f\n", entry.name.c_str(), threads, best.ns_per_op, best.allocs_per_op);
+		}
+	}
+	DestroyStubDevice(stub);
+	return 0;
+}
+
+// name and thread count, kept in the order the cases ran
+typedef std::pair<std::string, size_t> Key;
+typedef std::vector<std::pair<Key, Result>> Results;
+
+// reads name,threads,ns_per_op,allocs_per_op lines, the header and anything else
+// is skipped
+static Results ReadResults(std::FILE* file)
+{
+	Results results;
+	char line[512];
+	while (std::fgets(line, sizeof line, file))
+	{
+		char name[256];
+		size_t threads = 0;
+		Result result;
+		if (std::sscanf(line, "%255[^,],%zu,%lf,%lf", name, &threads, &result.ns_per_op, &result.allocs_per_op) == 4)
+		{
+			results.push_back({ { name, threads }, result });
+		}
+	}
+	return results;
+}
+
+static bool Launch(const char* self, const std::string& directory, const std::string& arguments, Results* results)
+{
+	const std::string command = "cd " + directory + " && " + self + " " + arguments;
+	std::FILE* pipe = popen(command.c_str(), "r");
+	if (!pipe)
+	{
+		return false;
+	}
+	if (results)
+	{
+		*results = ReadResults(pipe);
+	}
+	return pclose(pipe) == 0;
+}
+
+int main(int argc, char** argv)
+{
+	// Dumpped and Replaced lines would otherwise be most of the work
+	setenv("DESHADE_LOG", "error", 0);
+
+	size_t max_threads = std::thread::hardware_concurrency();
+	size_t operations = 100000;
+	const char* baseline_path = nullptr;
+	double percent = 20.0;
+	bool dump = false;
+	bool measure = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:b:r:dm")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			max_threads = std::atoi(optarg);
+			break;
+		case 'n':
+			operations = std::atoi(optarg);
+			break;
+		case 'b':
+			baseline_path = optarg;
+			break;
+		case 'r':
+			percent = std::atof(optarg);
+			break;
+		case 'd':
+			dump = true;
+			break;
+		case 'm':
+			measure = true;
+			break;
+		default:
+			max_threads = 0;
+			break;
+		}
+	}
+	if (!max_threads || !operations || percent < 0.0 || optind != argc)
+	{
+		std::fprintf(stderr, "usage: %s [-t threads] [-n operations] [-b baseline.csv] [-r percent]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<size_t> thread_counts = { 1 };
+	if (max_threads > 1)
+	{
+		thread_counts.push_back(max_threads);
+	}
+
+	// the two launches
+	if (dump)
+	{
+		return Dump(max_threads);
+	}
+	if (measure)
+	{
+		return Measure(thread_counts, operations);
+	}
+
+	Results baseline;
+	if (baseline_path)
+	{
+		std::FILE* file = std::fopen(baseline_path, "r");
+		if (!file)
+		{
+			std::fprintf(stderr, "failed to open %s\n", baseline_path);
+			return 1;
+		}
+		baseline = ReadResults(file);
+		std::fclose(file);
+	}
+
+	char self[4096];
+	const ssize_t length = readlink("/proc/self/exe", self, sizeof self - 1);
+	char directory[] = "/tmp/deshade-bench-XXXXXX";
+	if (length <= 0 || !mkdtemp(directory))
+	{
+		std::fprintf(stderr, "failed to create a directory to run in\n");
+		return 1;
+	}
+	self[length] = '\0';
+	mkdir((std::string(directory) + "/shaders").c_str(), 0755);
+
+	const std::string threads_argument = "-t " + std::to_string(max_threads);
+	Results results;
+	if (!Launch(self, directory, threads_argument + " -d", nullptr)
+	 || !Launch(self, directory, threads_argument + " -n " + std::to_string(operations) + " -m", &results)
+	 || results.empty())
+	{
+		std::fprintf(stderr, "a launch failed, the directory is left in %s\n", directory);
+		return 1;
+	}
+
+	int status = 0;
+	std::printf("name,threads,ns_per_op,allocs_per_op\n");
+	for (const auto& [key, result] : results)
+	{
+		std::printf("%s,%zu,%.1f,%.2f\n", key.first.c_str(), key.second, result.ns_per_op, result.allocs_per_op);
+		const auto found = std::find_if(baseline.begin(), baseline.end(), [&](const std::pair<Key, Result>& entry)
+		{
+			return entry.first == key;
+		});
+		if (found == baseline.end())
+		{
+			continue;
+		}
+		const Result& before = found->second;
+		if (result.ns_per_op > before.ns_per_op * (1.0 + percent / 100.0))
+		{
+			std::fprintf(stderr, "regression: %s on %zu threads takes %.1f ns, %.1f before\n",
+				key.first.c_str(), key.second, result.ns_per_op, before.ns_per_op);
+			status = 1;
+		}
+		if (result.allocs_per_op > before.allocs_per_op + 0.005)
+		{
+			std::fprintf(stderr, "regression: %s on %zu threads allocates %.2f times, %.2f before\n",
+				key.first.c_str(), key.second, result.allocs_per_op, before.allocs_per_op);
+			status = 1;
+		}
+	}
+	return status;
+}
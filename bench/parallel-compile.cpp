@@ -0,0 +1,168 @@
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <cstdio> // std::printf, std::fprintf, popen
+#include <cstdlib> // std::atoi, std::atof, setenv, mkdtemp
+#include <cstring> // std::strcmp
+
+extern "C"
+{
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include <GL/glx.h>
+
+// measures how long an application which asks for the status right after every
+// compile and links every program right after takes to load its programs, with and
+// without DESHADE_PARALLEL=1, against a stub driver where every compile takes a fixed
+// time and a link waits for the compiles of its shaders
+//
+//   parallel-compile [programs] [compile microseconds]
+//
+// every mode runs in a process of its own in a fresh directory with a shaders
+// directory, so the later launch finds what the first one learnt
+typedef GLuint (*GLCREATESHADERPROC)(GLenum);
+typedef void (*GLSHADERSOURCEPROC)(GLuint, GLsizei, const GLchar**, const GLint*);
+typedef void (*GLCOMPILESHADERPROC)(GLuint);
+typedef void (*GLGETSHADERIVPROC)(GLuint, GLenum, GLint*);
+typedef GLuint (*GLCREATEPROGRAMPROC)();
+typedef void (*GLATTACHSHADERPROC)(GLuint, GLuint);
+typedef void (*GLLINKPROGRAMPROC)(GLuint);
+typedef void (*GLGETPROGRAMIVPROC)(GLuint, GLenum, GLint*);
+typedef void (*GLFINISHPROC)();
+typedef void (*GLXSWAPBUFFERSPROC)(Display*, GLXDrawable);
+
+template<typename T>
+static T GetProc(const char* name)
+{
+	return (T)glXGetProcAddress((const GLubyte*)name);
+}
+
+// one launch, prints the seconds until every program linked
+static int Load(size_t programs)
+{
+	GLCREATESHADERPROC create_shader = GetProc<GLCREATESHADERPROC>("glCreateShader");
+	GLSHADERSOURCEPROC shader_source = GetProc<GLSHADERSOURCEPROC>("glShaderSource");
+	GLCOMPILESHADERPROC compile_shader = GetProc<GLCOMPILESHADERPROC>("glCompileShader");
+	GLGETSHADERIVPROC get_shaderiv = GetProc<GLGETSHADERIVPROC>("glGetShaderiv");
+	GLCREATEPROGRAMPROC create_program = GetProc<GLCREATEPROGRAMPROC>("glCreateProgram");
+	GLATTACHSHADERPROC attach_shader = GetProc<GLATTACHSHADERPROC>("glAttachShader");
+	GLLINKPROGRAMPROC link_program = GetProc<GLLINKPROGRAMPROC>("glLinkProgram");
+	GLGETPROGRAMIVPROC get_programiv = GetProc<GLGETPROGRAMIVPROC>("glGetProgramiv");
+	GLFINISHPROC finish = GetProc<GLFINISHPROC>("glFinish");
+	GLXSWAPBUFFERSPROC swap_buffers = GetProc<GLXSWAPBUFFERSPROC>("glXSwapBuffers");
+
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<GLuint> linked(programs);
+	for (size_t i = 0; i < programs; i++)
+	{
+		const GLuint program = create_program();
+		for (GLenum type : { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER })
+		{
+			const std::string source = "#version 330 core\n// program " + std::to_string(i) + "\nvoid main() { }\n";
+			const GLchar* string = source.data();
+			const GLint length = source.size();
+			const GLuint shader = create_shader(type);
+			shader_source(shader, 1, &string, &length);
+			compile_shader(shader);
+			GLint status = GL_FALSE;
+			get_shaderiv(shader, GL_COMPILE_STATUS, &status);
+			if (status != GL_TRUE)
+			{
+				std::fprintf(stderr, "a shader of program %zu failed to compile\n", i);
+				return 1;
+			}
+			attach_shader(program, shader);
+		}
+		link_program(program);
+		linked[i] = program;
+	}
+	for (size_t i = 0; i < programs; i++)
+	{
+		GLint status = GL_FALSE;
+		get_programiv(linked[i], GL_LINK_STATUS, &status);
+		if (status != GL_TRUE)
+		{
+			std::fprintf(stderr, "program %zu failed to link\n", i);
+			return 1;
+		}
+	}
+	finish();
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	// the first frame, deshade stores what it learnt
+	swap_buffers(nullptr, 0);
+	std::printf("%f\n", elapsed.count());
+	return 0;
+}
+
+static double Launch(const char* self, const std::string& directory, const char* parallel, size_t programs)
+{
+	const std::string command = "cd " + directory + " && DESHADE_PARALLEL=" + parallel + " " + self + " --load " + std::to_string(programs);
+	std::FILE* pipe = popen(command.c_str(), "r");
+	double seconds = 0.0;
+	if (!pipe || std::fscanf(pipe, "%lf", &seconds) != 1)
+	{
+		seconds = 0.0;
+	}
+	if (pipe)
+	{
+		pclose(pipe);
+	}
+	return seconds;
+}
+
+int main(int argc, char** argv)
+{
+	setenv("DESHADE_LOG", "error", 0);
+	if (argc > 2 && !std::strcmp(argv[1], "--load"))
+	{
+		return Load(std::atoi(argv[2]));
+	}
+
+	const size_t programs = argc > 1 ? std::atoi(argv[1]) : 128;
+	const char* compile_us = argc > 2 ? argv[2] : "2000";
+	if (!programs || std::atoi(compile_us) <= 0)
+	{
+		std::fprintf(stderr, "usage: %s [programs] [compile microseconds]\n", argv[0]);
+		return 1;
+	}
+	setenv("BENCHGL_COMPILE_US", compile_us, 1);
+
+	char self[4096];
+	const ssize_t length = readlink("/proc/self/exe", self, sizeof self - 1);
+	char directory[] = "/tmp/deshade-bench-XXXXXX";
+	if (length <= 0 || !mkdtemp(directory))
+	{
+		std::fprintf(stderr, "failed to create a directory to run in\n");
+		return 1;
+	}
+	self[length] = '\0';
+
+	// the serial launch gets a directory of its own so that the parallel ones do
+	// not find the shaders it dumps
+	const std::string serial_directory = std::string(directory) + "/serial";
+	const std::string parallel_directory = std::string(directory) + "/parallel";
+	for (const std::string& path : { serial_directory, serial_directory + "/shaders", parallel_directory, parallel_directory + "/shaders" })
+	{
+		mkdir(path.c_str(), 0755);
+	}
+
+	const double serial = Launch(self, serial_directory, "0", programs);
+	const double first = Launch(self, parallel_directory, "1", programs);
+	const double later = Launch(self, parallel_directory, "1", programs);
+	if (!serial || !first || !later)
+	{
+		std::fprintf(stderr, "a launch failed, the directory is left in %s\n", directory);
+		return 1;
+	}
+
+	std::printf("%zu programs of 2 shaders, %s us per compile, run in %s\n", programs, compile_us, directory);
+	std::printf("%-24s %10s %8s\n", "launch", "seconds", "speedup");
+	std::printf("%-24s %10.3f %7.2fx\n", "serial", serial, 1.0);
+	std::printf("%-24s %10.3f %7.2fx\n", "parallel, first", first, serial / first);
+	std::printf("%-24s %10.3f %7.2fx\n", "parallel, later", later, serial / later);
+	return 0;
+}
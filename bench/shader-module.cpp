@@ -0,0 +1,115 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <cstdio> // std::printf, std::fprintf
+#include <cstdlib> // std::atoi, setenv
+
+#include "stubvk.h"
+
+// measures vkCreateShaderModule calls per second through the deshade layer as the
+// number of threads grows, the benchmark plays the loader and a stub driver below
+// the layer whose functions do no work so only deshade is measured
+//
+//   shader-module [max threads] [calls per thread] [module size]
+//
+// run it where there is no shaders directory to measure hashing and forwarding
+// without dumps
+static const size_t k_modules_per_thread = 16;
+
+static double Run(VkDevice device, PFN_vkCreateShaderModule create_shader_module, size_t thread_count, size_t calls, size_t size)
+{
+	std::atomic<size_t> ready { 0 };
+	std::atomic<bool> go { false };
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_count; t++)
+	{
+		threads.emplace_back([&, t]
+		{
+			std::vector<std::vector<uint32_t>> modules;
+			for (size_t i = 0; i < k_modules_per_thread; i++)
+			{
+				modules.push_back(MakeModule(0, t, i, size));
+			}
+
+			ready++;
+			while (!go.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+
+			for (size_t i = 0; i < calls; i++)
+			{
+				const std::vector<uint32_t>& code = modules[i % k_modules_per_thread];
+				VkShaderModuleCreateInfo create_info = { };
+				create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+				create_info.codeSize = code.size() * sizeof(uint32_t);
+				create_info.pCode = code.data();
+				VkShaderModule module;
+				create_shader_module(device, &create_info, nullptr, &module);
+			}
+		});
+	}
+
+	while (ready.load() != thread_count)
+	{
+		std::this_thread::yield();
+	}
+	const auto start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+int main(int argc, char** argv)
+{
+	// Dumpped lines would otherwise be most of the work
+	setenv("DESHADE_LOG", "error", 0);
+
+	const size_t max_threads = argc > 1 ? std::atoi(argv[1]) : std::thread::hardware_concurrency();
+	const size_t calls = argc > 2 ? std::atoi(argv[2]) : 20000;
+	const size_t size = argc > 3 ? std::atoi(argv[3]) : 4096;
+	if (!max_threads || !calls || !size)
+	{
+		std::fprintf(stderr, "usage: %s [max threads] [calls per thread] [module size]\n", argv[0]);
+		return 1;
+	}
+
+	StubDevice stub;
+	if (!CreateStubDevice(stub))
+	{
+		std::fprintf(stderr, "failed to create device\n");
+		return 1;
+	}
+	PFN_vkCreateShaderModule create_shader_module =
+		(PFN_vkCreateShaderModule)stub.get_device_proc_addr(stub.device, "vkCreateShaderModule");
+
+	// powers of two up to the maximum
+	std::vector<size_t> thread_counts;
+	for (size_t threads = 1; threads < max_threads; threads *= 2)
+	{
+		thread_counts.push_back(threads);
+	}
+	thread_counts.push_back(max_threads);
+
+	std::printf("%8s %14s %12s %8s\n", "threads", "calls/s", "MB/s", "scaling");
+	double single = 0.0;
+	for (size_t threads : thread_counts)
+	{
+		const double seconds = Run(stub.device, create_shader_module, threads, calls, size);
+		const double rate = threads * calls / seconds;
+		if (!single)
+		{
+			single = rate;
+		}
+		std::printf("%8zu %14.0f %12.1f %7.2fx\n", threads, rate, rate * size / (1 << 20), rate / single);
+	}
+
+	DestroyStubDevice(stub);
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio> // std::printf, std::fprintf
+#include <cstdlib> // std::atoi, setenv
+
+#include <GL/glx.h>
+
+// measures glShaderSource calls per second through deshade as the number of
+// threads grows, deshade.so is linked in front of libbenchgl.so so every lookup
+// below goes through deshade first
+//
+//   shader-source [max threads] [calls per thread] [source size]
+//
+// run it where there is no shaders directory to measure hashing and forwarding
+// without dumps
+typedef GLuint (*GLCREATESHADERPROC)(GLenum);
+typedef void (*GLSHADERSOURCEPROC)(GLuint, GLsizei, const GLchar**, const GLint*);
+
+static const size_t k_sources_per_thread = 16;
+
+static std::string MakeSource(size_t thread, size_t index, size_t size)
+{
+	char header[128];
+	std::snprintf(header, sizeof header, "#version 330 core\n// thread %zu source %zu\n", thread, index);
+	std::string source = header;
+	while (source.size() < size)
+	{
+		source += "out vec4 color; void main() { color = vec4(0.25, 0.5, 0.75, 1.0); }\r\n";
+	}
+	source.resize(size);
+	return source;
+}
+
+static double Run(size_t thread_count, size_t calls, size_t size)
+{
+	GLCREATESHADERPROC create_shader = (GLCREATESHADERPROC)glXGetProcAddress((const GLubyte*)"glCreateShader");
+	GLSHADERSOURCEPROC shader_source = (GLSHADERSOURCEPROC)glXGetProcAddress((const GLubyte*)"glShaderSource");
+
+	std::atomic<size_t> ready { 0 };
+	std::atomic<bool> go { false };
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < thread_count; t++)
+	{
+		threads.emplace_back([&, t]
+		{
+			std::vector<std::string> sources;
+			std::vector<GLuint> shaders;
+			for (size_t i = 0; i < k_sources_per_thread; i++)
+			{
+				sources.push_back(MakeSource(t, i, size));
+				shaders.push_back(create_shader(GL_FRAGMENT_SHADER));
+			}
+
+			ready++;
+			while (!go.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+
+			for (size_t i = 0; i < calls; i++)
+			{
+				const std::string& source = sources[i % k_sources_per_thread];
+				const GLchar* string = source.data();
+				const GLint length = source.size();
+				shader_source(shaders[i % k_sources_per_thread], 1, &string, &length);
+			}
+		});
+	}
+
+	while (ready.load() != thread_count)
+	{
+		std::this_thread::yield();
+	}
+	const auto start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+int main(int argc, char** argv)
+{
+	// Source and Created lines would otherwise be most of the work
+	setenv("DESHADE_LOG", "error", 0);
+
+	const size_t max_threads = argc > 1 ? std::atoi(argv[1]) : std::thread::hardware_concurrency();
+	const size_t calls = argc > 2 ? std::atoi(argv[2]) : 20000;
+	const size_t size = argc > 3 ? std::atoi(argv[3]) : 4096;
+	if (!max_threads || !calls || !size)
+	{
+		std::fprintf(stderr, "usage: %s [max threads] [calls per thread] [source size]\n", argv[0]);
+		return 1;
+	}
+
+	// powers of two up to the maximum
+	std::vector<size_t> thread_counts;
+	for (size_t threads = 1; threads < max_threads; threads *= 2)
+	{
+		thread_counts.push_back(threads);
+	}
+	thread_counts.push_back(max_threads);
+
+	std::printf("%8s %14s %12s %8s\n", "threads", "calls/s", "MB/s", "scaling");
+	double single = 0.0;
+	for (size_t threads : thread_counts)
+	{
+		const double seconds = Run(threads, calls, size);
+		const double rate = threads * calls / seconds;
+		if (!single)
+		{
+			single = rate;
+		}
+		std::printf("%8zu %14.0f %12.1f %7.2fx\n", threads, rate, rate * size / (1 << 20), rate / single);
+	}
+	return 0;
+}
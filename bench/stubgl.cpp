@@ -0,0 +1,261 @@
+#include <algorithm> // std::min, std::remove
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cstdlib> // std::getenv, std::atoi
+#include <cstring> // std::strcmp, std::memcpy
+
+#include <GL/glx.h>
+#include <GL/glext.h>
+
+// the smallest GL driver deshade can sit in front of, shader functions do no
+// work so a benchmark measures deshade only
+//
+// the exception is glCompileShader which takes BENCHGL_COMPILE_US microseconds,
+// on the calling thread or, once glMaxShaderCompilerThreadsKHR was called, on up
+// to that many but at most 16 background threads like a driver with
+// KHR_parallel_shader_compile
+//
+// programs have no work of their own, a link is done once every shader attached to
+// it compiled and asking for the link status waits for that
+static std::atomic<GLuint> s_next_shader { 1 };
+static std::atomic<GLuint> s_next_program { 1 };
+
+// deleted names are reused like a driver would, per thread so that creating and
+// deleting does not contend
+static thread_local std::vector<GLuint> t_free_shaders;
+
+// protected by s_mutex, leaked so that compile threads still waiting at exit do not
+// keep static destructors from finishing
+static std::mutex& s_mutex = *new std::mutex;
+static std::condition_variable& s_changed = *new std::condition_variable;
+static std::deque<GLuint>& s_queue = *new std::deque<GLuint>;
+static std::unordered_set<GLuint>& s_compiling = *new std::unordered_set<GLuint>;
+static size_t s_threads;
+// shaders attached to programs and those they were last linked with
+static std::unordered_map<GLuint, std::vector<GLuint>>& s_attached = *new std::unordered_map<GLuint, std::vector<GLuint>>;
+static std::unordered_map<GLuint, std::vector<GLuint>>& s_linked = *new std::unordered_map<GLuint, std::vector<GLuint>>;
+
+static const char k_binary[] = "benchgl program";
+
+static void Compile()
+{
+	static const int k_compile_us = std::getenv("BENCHGL_COMPILE_US") ? std::atoi(std::getenv("BENCHGL_COMPILE_US")) : 0;
+	std::this_thread::sleep_for(std::chrono::microseconds(k_compile_us));
+}
+
+static void CompileThread()
+{
+	std::unique_lock<std::mutex> lock(s_mutex);
+	for (;;)
+	{
+		s_changed.wait(lock, [] { return !s_queue.empty(); });
+		const GLuint shader = s_queue.front();
+		s_queue.pop_front();
+		lock.unlock();
+		Compile();
+		lock.lock();
+		s_compiling.erase(shader);
+		s_changed.notify_all();
+	}
+}
+
+extern "C" GLuint glCreateShader(GLenum)
+{
+	if (!t_free_shaders.empty())
+	{
+		const GLuint shader = t_free_shaders.back();
+		t_free_shaders.pop_back();
+		return shader;
+	}
+	return s_next_shader.fetch_add(1, std::memory_order_relaxed);
+}
+
+extern "C" void glDeleteShader(GLuint shader)
+{
+	t_free_shaders.push_back(shader);
+}
+
+extern "C" void glShaderSource(GLuint, GLsizei, const GLchar* const*, const GLint*)
+{
+}
+
+extern "C" void glCompileShader(GLuint shader)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	if (!s_threads)
+	{
+		Compile();
+		return;
+	}
+	s_compiling.insert(shader);
+	s_queue.push_back(shader);
+	s_changed.notify_all();
+}
+
+extern "C" void glGetShaderiv(GLuint shader, GLenum pname, GLint* params)
+{
+	std::unique_lock<std::mutex> lock(s_mutex);
+	if (pname == GL_COMPLETION_STATUS_KHR)
+	{
+		*params = !s_compiling.count(shader);
+		return;
+	}
+	s_changed.wait(lock, [&] { return !s_compiling.count(shader); });
+	*params = pname == GL_COMPILE_STATUS ? GL_TRUE : 0;
+}
+
+static bool IsLinked(GLuint program)
+{
+	for (GLuint shader : s_linked[program])
+	{
+		if (s_compiling.count(shader))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+extern "C" GLuint glCreateProgram()
+{
+	return s_next_program.fetch_add(1, std::memory_order_relaxed);
+}
+
+extern "C" void glDeleteProgram(GLuint program)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_attached.erase(program);
+	s_linked.erase(program);
+}
+
+extern "C" void glAttachShader(GLuint program, GLuint shader)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_attached[program].push_back(shader);
+}
+
+extern "C" void glDetachShader(GLuint program, GLuint shader)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	std::vector<GLuint>& attached = s_attached[program];
+	attached.erase(std::remove(attached.begin(), attached.end(), shader), attached.end());
+}
+
+extern "C" void glLinkProgram(GLuint program)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_linked[program] = s_attached[program];
+}
+
+extern "C" void glProgramParameteri(GLuint, GLenum, GLint)
+{
+}
+
+extern "C" void glGetProgramiv(GLuint program, GLenum pname, GLint* params)
+{
+	std::unique_lock<std::mutex> lock(s_mutex);
+	if (pname == GL_COMPLETION_STATUS_KHR)
+	{
+		*params = IsLinked(program);
+		return;
+	}
+	s_changed.wait(lock, [&] { return IsLinked(program); });
+	*params = pname == GL_LINK_STATUS ? GL_TRUE : pname == GL_PROGRAM_BINARY_LENGTH ? sizeof k_binary : 0;
+}
+
+extern "C" void glGetProgramBinary(GLuint program, GLsizei size, GLsizei* length, GLenum* format, void* binary)
+{
+	std::unique_lock<std::mutex> lock(s_mutex);
+	s_changed.wait(lock, [&] { return IsLinked(program); });
+	*length = std::min<GLsizei>(size, sizeof k_binary);
+	*format = 1;
+	std::memcpy(binary, k_binary, *length);
+}
+
+// any binary loads, the program is linked with nothing attached
+extern "C" void glProgramBinary(GLuint program, GLenum, const void*, GLsizei)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_linked[program].clear();
+}
+
+extern "C" void glMaxShaderCompilerThreadsKHR(GLuint count)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	for (; s_threads < std::min<size_t>(count, 16); s_threads++)
+	{
+		std::thread(CompileThread).detach();
+	}
+}
+
+extern "C" const GLubyte* glGetString(GLenum name)
+{
+	return (const GLubyte*)(name == GL_EXTENSIONS ? "GL_KHR_parallel_shader_compile" : "benchgl");
+}
+
+extern "C" const GLubyte* glGetStringi(GLenum name, GLuint index)
+{
+	return name == GL_EXTENSIONS && index == 0 ? (const GLubyte*)"GL_KHR_parallel_shader_compile" : nullptr;
+}
+
+extern "C" void glGetIntegerv(GLenum pname, GLint* params)
+{
+	*params = pname == GL_NUM_EXTENSIONS ? 1 : 0;
+}
+
+// waits for every compile like a draw would
+extern "C" void glFinish()
+{
+	std::unique_lock<std::mutex> lock(s_mutex);
+	s_changed.wait(lock, [] { return s_compiling.empty(); });
+}
+
+// deshade exports glXSwapBuffers as well, so the address handed out is of a function
+// which cannot be interposed
+static void SwapBuffers(Display*, GLXDrawable)
+{
+}
+
+extern "C" void glXSwapBuffers(Display* display, GLXDrawable drawable)
+{
+	SwapBuffers(display, drawable);
+}
+
+extern "C" void (*glXGetProcAddress(const GLubyte* symbol))()
+{
+	const char* name = (const char*)symbol;
+	if (!std::strcmp(name, "glCreateShader")) return (void (*)())&glCreateShader;
+	if (!std::strcmp(name, "glDeleteShader")) return (void (*)())&glDeleteShader;
+	if (!std::strcmp(name, "glShaderSource")) return (void (*)())&glShaderSource;
+	if (!std::strcmp(name, "glCompileShader")) return (void (*)())&glCompileShader;
+	if (!std::strcmp(name, "glGetShaderiv")) return (void (*)())&glGetShaderiv;
+	if (!std::strcmp(name, "glCreateProgram")) return (void (*)())&glCreateProgram;
+	if (!std::strcmp(name, "glDeleteProgram")) return (void (*)())&glDeleteProgram;
+	if (!std::strcmp(name, "glAttachShader")) return (void (*)())&glAttachShader;
+	if (!std::strcmp(name, "glDetachShader")) return (void (*)())&glDetachShader;
+	if (!std::strcmp(name, "glLinkProgram")) return (void (*)())&glLinkProgram;
+	if (!std::strcmp(name, "glProgramParameteri")) return (void (*)())&glProgramParameteri;
+	if (!std::strcmp(name, "glGetProgramiv")) return (void (*)())&glGetProgramiv;
+	if (!std::strcmp(name, "glGetProgramBinary")) return (void (*)())&glGetProgramBinary;
+	if (!std::strcmp(name, "glProgramBinary")) return (void (*)())&glProgramBinary;
+	if (!std::strcmp(name, "glMaxShaderCompilerThreadsKHR")) return (void (*)())&glMaxShaderCompilerThreadsKHR;
+	if (!std::strcmp(name, "glGetString")) return (void (*)())&glGetString;
+	if (!std::strcmp(name, "glGetStringi")) return (void (*)())&glGetStringi;
+	if (!std::strcmp(name, "glGetIntegerv")) return (void (*)())&glGetIntegerv;
+	if (!std::strcmp(name, "glFinish")) return (void (*)())&glFinish;
+	if (!std::strcmp(name, "glXSwapBuffers")) return (void (*)())&SwapBuffers;
+	return nullptr;
+}
+
+extern "C" void (*glXGetProcAddressARB(const GLubyte* symbol))()
+{
+	return glXGetProcAddress(symbol);
+}
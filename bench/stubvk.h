@@ -0,0 +1,149 @@
+#ifndef STUBVK_H
+#define STUBVK_H
+#include <atomic>
+#include <initializer_list>
+#include <vector>
+
+#include <cstdint>
+#include <cstring> // std::strcmp
+
+#include <vulkan/vk_layer.h>
+
+// the smallest Vulkan driver deshade can sit in front of, played in process together
+// with the loader so no ICD has to be installed, its functions do no work so a
+// benchmark measures the layer only
+extern "C" PFN_vkVoidFunction VKAPI_CALL deshade_vkGetInstanceProcAddr(VkInstance, const char*);
+
+// dispatchable handles start with the loader's dispatch pointer
+struct StubObject
+{
+	void* dispatch;
+};
+
+static StubObject s_instance_dispatch;
+static StubObject s_device_dispatch;
+static std::atomic<uint64_t> s_next_module { 1 };
+
+static VkResult VKAPI_CALL StubCreateInstance(const VkInstanceCreateInfo*, const VkAllocationCallbacks*, VkInstance* pInstance)
+{
+	*pInstance = (VkInstance)new StubObject { &s_instance_dispatch };
+	return VK_SUCCESS;
+}
+
+static void VKAPI_CALL StubDestroyInstance(VkInstance instance, const VkAllocationCallbacks*)
+{
+	delete (StubObject*)instance;
+}
+
+static VkResult VKAPI_CALL StubCreateDevice(VkPhysicalDevice, const VkDeviceCreateInfo*, const VkAllocationCallbacks*, VkDevice* pDevice)
+{
+	*pDevice = (VkDevice)new StubObject { &s_device_dispatch };
+	return VK_SUCCESS;
+}
+
+static void VKAPI_CALL StubDestroyDevice(VkDevice device, const VkAllocationCallbacks*)
+{
+	delete (StubObject*)device;
+}
+
+static VkResult VKAPI_CALL StubCreateShaderModule(VkDevice, const VkShaderModuleCreateInfo*, const VkAllocationCallbacks*, VkShaderModule* pShaderModule)
+{
+	*pShaderModule = (VkShaderModule)s_next_module.fetch_add(1, std::memory_order_relaxed);
+	return VK_SUCCESS;
+}
+
+static PFN_vkVoidFunction VKAPI_CALL StubGetDeviceProcAddr(VkDevice, const char* name)
+{
+	if (!std::strcmp(name, "vkGetDeviceProcAddr")) return (PFN_vkVoidFunction)&StubGetDeviceProcAddr;
+	if (!std::strcmp(name, "vkDestroyDevice")) return (PFN_vkVoidFunction)&StubDestroyDevice;
+	if (!std::strcmp(name, "vkCreateShaderModule")) return (PFN_vkVoidFunction)&StubCreateShaderModule;
+	return nullptr;
+}
+
+static PFN_vkVoidFunction VKAPI_CALL StubGetInstanceProcAddr(VkInstance, const char* name)
+{
+	if (!std::strcmp(name, "vkGetInstanceProcAddr")) return (PFN_vkVoidFunction)&StubGetInstanceProcAddr;
+	if (!std::strcmp(name, "vkCreateInstance")) return (PFN_vkVoidFunction)&StubCreateInstance;
+	if (!std::strcmp(name, "vkDestroyInstance")) return (PFN_vkVoidFunction)&StubDestroyInstance;
+	if (!std::strcmp(name, "vkCreateDevice")) return (PFN_vkVoidFunction)&StubCreateDevice;
+	return nullptr;
+}
+
+// an instance and a device created through the layer the way the loader does
+struct StubDevice
+{
+	VkInstance instance = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	PFN_vkGetDeviceProcAddr get_device_proc_addr = nullptr;
+};
+
+static bool CreateStubDevice(StubDevice& stub)
+{
+	VkLayerInstanceLink instance_link = { };
+	instance_link.pfnNextGetInstanceProcAddr = StubGetInstanceProcAddr;
+	VkLayerInstanceCreateInfo instance_layer_info = { };
+	instance_layer_info.sType = VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO;
+	instance_layer_info.function = VK_LAYER_LINK_INFO;
+	instance_layer_info.u.pLayerInfo = &instance_link;
+	VkInstanceCreateInfo instance_info = { };
+	instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instance_info.pNext = &instance_layer_info;
+
+	PFN_vkCreateInstance create_instance =
+		(PFN_vkCreateInstance)deshade_vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkCreateInstance");
+	if (create_instance(&instance_info, nullptr, &stub.instance) != VK_SUCCESS)
+	{
+		return false;
+	}
+
+	VkLayerDeviceLink device_link = { };
+	device_link.pfnNextGetInstanceProcAddr = StubGetInstanceProcAddr;
+	device_link.pfnNextGetDeviceProcAddr = StubGetDeviceProcAddr;
+	VkLayerDeviceCreateInfo device_layer_info = { };
+	device_layer_info.sType = VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO;
+	device_layer_info.function = VK_LAYER_LINK_INFO;
+	device_layer_info.u.pLayerInfo = &device_link;
+	VkDeviceCreateInfo device_info = { };
+	device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	device_info.pNext = &device_layer_info;
+
+	StubObject physical_device = { &s_instance_dispatch };
+	PFN_vkCreateDevice create_device =
+		(PFN_vkCreateDevice)deshade_vkGetInstanceProcAddr(stub.instance, "vkCreateDevice");
+	if (create_device((VkPhysicalDevice)&physical_device, &device_info, nullptr, &stub.device) != VK_SUCCESS)
+	{
+		return false;
+	}
+
+	stub.get_device_proc_addr =
+		(PFN_vkGetDeviceProcAddr)deshade_vkGetInstanceProcAddr(stub.instance, "vkGetDeviceProcAddr");
+	return true;
+}
+
+static void DestroyStubDevice(StubDevice& stub)
+{
+	((PFN_vkDestroyDevice)stub.get_device_proc_addr(stub.device, "vkDestroyDevice"))(stub.device, nullptr);
+	((PFN_vkDestroyInstance)deshade_vkGetInstanceProcAddr(stub.instance, "vkDestroyInstance"))(stub.instance, nullptr);
+}
+
+// a fragment shader module padded with OpNop up to size bytes, distinct per seed,
+// thread and index so every module hashes differently
+inline std::vector<uint32_t> MakeModule(size_t seed, size_t thread, size_t index, size_t size)
+{
+	// word counts follow from the operands, a wrong one makes the module invalid
+	std::vector<uint32_t> code = { 0x07230203, 0x00010000, 0, 16, 0 };
+	const auto instruction = [&](uint32_t opcode, std::initializer_list<uint32_t> operands)
+	{
+		code.push_back((uint32_t)(operands.size() + 1) << 16 | opcode);
+		code.insert(code.end(), operands);
+	};
+	instruction(15, { 4, 1, 0x6e69616d, 0 }); // OpEntryPoint Fragment %1 "main"
+	instruction(0, { (uint32_t)seed, (uint32_t)thread, (uint32_t)index }); // unknown opcode zero, skipped
+	while (code.size() * sizeof(uint32_t) < size)
+	{
+		code.push_back((1u << 16) | 0);
+	}
+	return code;
+}
+
+#endif
@@ -0,0 +1,250 @@
+#include <algorithm> // std::min
+#include <cstring> // std::memcpy
+
+#include "delta.h"
+
+// chunks are cut where the rolling hash has its low bits clear, 80 bytes on average
+static const size_t k_min_chunk = 16;
+static const size_t k_max_chunk = 256;
+static const uint64_t k_chunk_mask = 63;
+
+// copies shorter than this are stored as literals, they would take about as much
+static const size_t k_min_match = 8;
+
+static const uint64_t k_prime64 = 0x9E3779B185EBCA87ULL;
+
+// the splitmix64 finalizer
+static uint64_t Mix(uint64_t value)
+{
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	return value ^ (value >> 31);
+}
+
+// a random value for every byte, shifted through the rolling hash
+static const uint64_t* GearTable()
+{
+	static const struct Table
+	{
+		Table()
+		{
+			for (uint64_t i = 0; i < 256; i++)
+			{
+				values[i] = Mix((i + 1) * k_prime64);
+			}
+		}
+		uint64_t values[256];
+	} table;
+	return table.values;
+}
+
+DeltaSketch SketchDelta(const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	const uint64_t* gear = GearTable();
+
+	DeltaSketch sketch;
+	for (uint64_t& feature : sketch.features)
+	{
+		feature = ~0ULL;
+	}
+
+	size_t start = 0;
+	uint64_t rolling = 0;
+	uint64_t chunk = 0xCBF29CE484222325ULL; // FNV-1a
+	for (size_t i = 0; i < size; i++)
+	{
+		rolling = (rolling << 1) + gear[bytes[i]];
+		chunk = (chunk ^ bytes[i]) * 0x100000001B3ULL;
+		const size_t length = i + 1 - start;
+		if ((length >= k_min_chunk && (rolling & k_chunk_mask) == 0) || length >= k_max_chunk || i + 1 == size)
+		{
+			for (size_t k = 0; k < DeltaSketch::k_features; k++)
+			{
+				sketch.features[k] = std::min(sketch.features[k], Mix(chunk + k * k_prime64));
+			}
+			start = i + 1;
+			chunk = 0xCBF29CE484222325ULL;
+		}
+	}
+	return sketch;
+}
+
+static void PutVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((uint8_t)value | 0x80);
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+static bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value)
+{
+	value = 0;
+	for (unsigned shift = 0; shift < 64 && p < end; shift += 7)
+	{
+		const uint8_t byte = *p++;
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// copies address the base followed by the target as one buffer, their source is
+// stored relative to where the previous copy ended so runs of copies from the base
+// interrupted by a few changed bytes take a byte or two each
+//
+//   literals  varint(length << 1), bytes
+//   copy      varint((length - k_min_match) << 1 | 1), varint(zigzag(source - previous end))
+std::vector<uint8_t> EncodeDelta(const void* base_data, size_t base_size, const void* target_data, size_t target_size)
+{
+	const uint8_t* base = (const uint8_t*)base_data;
+	const uint8_t* target = (const uint8_t*)target_data;
+	const auto at = [&](size_t position)
+	{
+		return position < base_size ? base[position] : target[position - base_size];
+	};
+
+	// the last position every 8 byte string was seen at plus one, zero when never
+	unsigned bits = 10;
+	while (bits < 20 && ((size_t)1 << bits) < base_size + target_size)
+	{
+		bits++;
+	}
+	std::vector<uint32_t> table((size_t)1 << bits, 0);
+	const auto slot = [&](const uint8_t* p) -> uint32_t&
+	{
+		uint64_t word;
+		std::memcpy(&word, p, sizeof word);
+		return table[(word * k_prime64) >> (64 - bits)];
+	};
+	for (size_t i = 0; i + k_min_match <= base_size; i++)
+	{
+		slot(base + i) = (uint32_t)(i + 1);
+	}
+
+	std::vector<uint8_t> delta;
+	uint64_t previous_end = 0;
+	size_t literals = 0;
+	const auto flush_literals = [&](size_t end)
+	{
+		if (end > literals)
+		{
+			PutVarint(delta, (uint64_t)(end - literals) << 1);
+			delta.insert(delta.end(), target + literals, target + end);
+		}
+	};
+
+	size_t i = 0;
+	while (i + k_min_match <= target_size)
+	{
+		uint32_t& entry = slot(target + i);
+		const size_t candidate = entry;
+		entry = (uint32_t)(base_size + i + 1);
+
+		size_t source = candidate - 1;
+		size_t length = 0;
+		if (candidate)
+		{
+			while (i + length < target_size && at(source + length) == target[i + length])
+			{
+				length++;
+			}
+		}
+		if (length < k_min_match)
+		{
+			i++;
+			continue;
+		}
+
+		// the bytes in front may match as well
+		while (i > literals && source > 0 && at(source - 1) == target[i - 1])
+		{
+			i--;
+			source--;
+			length++;
+		}
+
+		flush_literals(i);
+		const int64_t offset = (int64_t)(source - previous_end);
+		PutVarint(delta, (uint64_t)(length - k_min_match) << 1 | 1);
+		PutVarint(delta, ((uint64_t)offset << 1) ^ (uint64_t)(offset >> 63));
+		previous_end = source + length;
+
+		for (size_t j = i + 1; j < i + length && j + k_min_match <= target_size; j++)
+		{
+			slot(target + j) = (uint32_t)(base_size + j + 1);
+		}
+		i += length;
+		literals = i;
+	}
+	flush_literals(target_size);
+	return delta;
+}
+
+bool DecodeDelta(const void* base_data, size_t base_size, const void* delta, size_t delta_size, void* target_data, size_t target_size)
+{
+	const uint8_t* base = (const uint8_t*)base_data;
+	uint8_t* target = (uint8_t*)target_data;
+	const uint8_t* p = (const uint8_t*)delta;
+	const uint8_t* end = p + delta_size;
+
+	size_t produced = 0;
+	uint64_t previous_end = 0;
+	while (p < end)
+	{
+		uint64_t op;
+		if (!GetVarint(p, end, op))
+		{
+			return false;
+		}
+
+		if (!(op & 1))
+		{
+			const uint64_t length = op >> 1;
+			if (length > (uint64_t)(end - p) || length > target_size - produced)
+			{
+				return false;
+			}
+			std::memcpy(target + produced, p, length);
+			p += length;
+			produced += length;
+			continue;
+		}
+
+		uint64_t zigzag;
+		if (!GetVarint(p, end, zigzag))
+		{
+			return false;
+		}
+		const uint64_t length = (op >> 1) + k_min_match;
+		const uint64_t source = previous_end + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+		if (length > target_size - produced || source >= base_size + produced)
+		{
+			return false;
+		}
+		previous_end = source + length;
+
+		// from the base, then from the target where a copy may overlap what it writes
+		uint64_t from = source;
+		uint64_t left = length;
+		if (from < base_size)
+		{
+			const uint64_t count = std::min<uint64_t>(left, base_size - from);
+			std::memcpy(target + produced, base + from, count);
+			produced += count;
+			from += count;
+			left -= count;
+		}
+		for (; left; left--)
+		{
+			target[produced++] = target[from++ - base_size];
+		}
+	}
+	return produced == target_size;
+}
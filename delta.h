@@ -0,0 +1,28 @@
+#ifndef DELTA_H
+#define DELTA_H
+#include <vector>
+
+#include <cstdint>
+#include <cstddef>
+
+// features of a buffer used to find a similar one to encode it against, buffers which
+// share most of their contents share most of their features
+//
+// the buffer is cut into content defined chunks so that an insertion only changes the
+// chunks around it, every feature is the smallest chunk hash under another permutation
+struct DeltaSketch
+{
+	static const size_t k_features = 4;
+	uint64_t features[k_features];
+};
+
+DeltaSketch SketchDelta(const void* data, size_t size);
+
+// LZ77 style encoding of target against base, copies come from the base or from the
+// part of the target decoded before them and everything else is stored as literals
+std::vector<uint8_t> EncodeDelta(const void* base, size_t base_size, const void* target, size_t target_size);
+
+// false when delta is corrupt or does not decode to exactly target_size bytes
+bool DecodeDelta(const void* base, size_t base_size, const void* delta, size_t delta_size, void* target, size_t target_size);
+
+#endif
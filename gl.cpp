@@ -1,35 +1,365 @@
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <mutex>
 #include <string>
 #include <vector>
-#include <algorithm>
 #include <unordered_map>
-#include <streambuf>
+#include <unordered_set>
 
-#include <cstring> // std::memcpy, std::strlen
+#include <cstdlib> // std::getenv
+#include <cstring> // std::memcpy, std::memchr, std::strlen
 
 #include "log.h"
 #include "hash.h"
+#include "names.h"
+#include "store.h"
+#include "glsl.h"
+#include "profile.h"
 
 extern "C"
 {
 	#include <dlfcn.h>
+	#include <link.h>
+	#include <unistd.h>
 }
 
 #include <GL/glx.h>
 
 typedef Bool (*GLXMAINPROC)(uint32_t, const void*, void*, void*); // glvnd
 typedef void (*(*GLXGETPROCADDRESSPROC)(const GLubyte*))(); // glx
+typedef void (*GLXSWAPBUFFERSPROC)(Display*, GLXDrawable); // glx
+typedef GLXContext (*GLXCREATECONTEXTPROC)(Display*, XVisualInfo*, GLXContext, Bool); // glx
+typedef GLXContext (*GLXCREATENEWCONTEXTPROC)(Display*, GLXFBConfig, int, GLXContext, Bool); // glx
+typedef GLXContext (*GLXCREATECONTEXTATTRIBSARBPROC)(Display*, GLXFBConfig, GLXContext, Bool, const int*); // glx
+typedef Bool (*GLXMAKECURRENTPROC)(Display*, GLXDrawable, GLXContext); // glx
+typedef Bool (*GLXMAKECONTEXTCURRENTPROC)(Display*, GLXDrawable, GLXDrawable, GLXContext); // glx
+typedef void (*GLXDESTROYCONTEXTPROC)(Display*, GLXContext); // glx
 
 typedef GLuint (*GLCREATESHADERPROC)(GLenum); // gl
 typedef void (*GLDELETESHADERPROC)(GLuint); // gl
 typedef void (*GLSHADERSOURCEPROC)(GLuint, GLsizei, const GLchar**, const GLint*); // gl
+typedef void (*GLCOMPILESHADERPROC)(GLuint); // gl
+typedef void (*GLGETSHADERIVPROC)(GLuint, GLenum, GLint*); // gl
+typedef void (*GLATTACHSHADERPROC)(GLuint, GLuint); // gl
+typedef void (*GLDETACHSHADERPROC)(GLuint, GLuint); // gl
+typedef void (*GLLINKPROGRAMPROC)(GLuint); // gl
+typedef void (*GLDELETEPROGRAMPROC)(GLuint); // gl
+typedef void (*GLGETPROGRAMIVPROC)(GLuint, GLenum, GLint*); // gl
+typedef void (*GLPROGRAMPARAMETERIPROC)(GLuint, GLenum, GLint); // gl
+typedef void (*GLBINDATTRIBLOCATIONPROC)(GLuint, GLuint, const GLchar*); // gl
+typedef void (*GLBINDFRAGDATALOCATIONPROC)(GLuint, GLuint, const GLchar*); // gl
+typedef void (*GLBINDFRAGDATALOCATIONINDEXEDPROC)(GLuint, GLuint, GLuint, const GLchar*); // gl
+typedef void (*GLTRANSFORMFEEDBACKVARYINGSPROC)(GLuint, GLsizei, const GLchar* const*, GLenum); // gl
+typedef const GLubyte* (*GLGETSTRINGPROC)(GLenum); // gl
+typedef void (*GLGETINTEGERVPROC)(GLenum, GLint*); // gl
+
+// every GL function deshade wraps as X(name, type, replacement, aliased), aliased
+// ones are also hooked under their ARB, EXT and OES names, the others have an
+// unrelated function under one of those
+#define GL_HOOKS(X) \
+	X(glCreateShader, GLCREATESHADERPROC, CreateShader, true) \
+	X(glDeleteShader, GLDELETESHADERPROC, DeleteShader, true) \
+	X(glShaderSource, GLSHADERSOURCEPROC, ShaderSource, true) \
+	X(glCompileShader, GLCOMPILESHADERPROC, CompileShader, true) \
+	X(glGetShaderiv, GLGETSHADERIVPROC, GetShaderiv, false) \
+	X(glAttachShader, GLATTACHSHADERPROC, AttachShader, true) \
+	X(glDetachShader, GLDETACHSHADERPROC, DetachShader, true) \
+	X(glLinkProgram, GLLINKPROGRAMPROC, LinkProgram, true) \
+	X(glDeleteProgram, GLDELETEPROGRAMPROC, DeleteProgram, false) \
+	X(glGetProgramiv, GLGETPROGRAMIVPROC, GetProgramiv, false) \
+	X(glProgramParameteri, GLPROGRAMPARAMETERIPROC, ProgramParameteri, true) \
+	X(glBindAttribLocation, GLBINDATTRIBLOCATIONPROC, BindAttribLocation, true) \
+	X(glBindFragDataLocation, GLBINDFRAGDATALOCATIONPROC, BindFragDataLocation, true) \
+	X(glBindFragDataLocationIndexed, GLBINDFRAGDATALOCATIONINDEXEDPROC, BindFragDataLocationIndexed, true) \
+	X(glTransformFeedbackVaryings, GLTRANSFORMFEEDBACKVARYINGSPROC, TransformFeedbackVaryings, true)
+
+// GLX functions deshade wraps in the same form, they are not tied to a context
+#define GLX_HOOKS(X) \
+	X(glXSwapBuffers, GLXSWAPBUFFERSPROC, SwapBuffers, false) \
+	X(glXCreateContext, GLXCREATECONTEXTPROC, CreateContext, false) \
+	X(glXCreateNewContext, GLXCREATENEWCONTEXTPROC, CreateNewContext, false) \
+	X(glXCreateContextAttribsARB, GLXCREATECONTEXTATTRIBSARBPROC, CreateContextAttribs, false) \
+	X(glXMakeCurrent, GLXMAKECURRENTPROC, MakeCurrent, false) \
+	X(glXMakeContextCurrent, GLXMAKECONTEXTCURRENTPROC, MakeContextCurrent, false) \
+	X(glXDestroyContext, GLXDESTROYCONTEXTPROC, DestroyContext, false)
+
+// functions deshade calls itself without wrapping them
+#define GL_FUNCTIONS(X) \
+	X(glGetString, GLGETSTRINGPROC) \
+	X(glGetStringi, PFNGLGETSTRINGIPROC) \
+	X(glGetIntegerv, GLGETINTEGERVPROC) \
+	X(glGetProgramBinary, PFNGLGETPROGRAMBINARYPROC) \
+	X(glMaxShaderCompilerThreadsKHR, PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) \
+	X(glProgramBinary, PFNGLPROGRAMBINARYPROC) \
+	X(glGetShaderInfoLog, PFNGLGETSHADERINFOLOGPROC) \
+	X(glGetProgramInfoLog, PFNGLGETPROGRAMINFOLOGPROC) \
+	X(glCreateProgram, PFNGLCREATEPROGRAMPROC) \
+	X(glGetActiveUniform, PFNGLGETACTIVEUNIFORMPROC) \
+	X(glGetUniformLocation, PFNGLGETUNIFORMLOCATIONPROC) \
+	X(glGetUniformfv, PFNGLGETUNIFORMFVPROC) \
+	X(glGetUniformiv, PFNGLGETUNIFORMIVPROC) \
+	X(glGetUniformuiv, PFNGLGETUNIFORMUIVPROC) \
+	X(glGetActiveUniformBlockiv, PFNGLGETACTIVEUNIFORMBLOCKIVPROC) \
+	X(glGetActiveUniformBlockName, PFNGLGETACTIVEUNIFORMBLOCKNAMEPROC) \
+	X(glGetUniformBlockIndex, PFNGLGETUNIFORMBLOCKINDEXPROC) \
+	X(glUniformBlockBinding, PFNGLUNIFORMBLOCKBINDINGPROC) \
+	X(glProgramUniform1fv, PFNGLPROGRAMUNIFORM1FVPROC) \
+	X(glProgramUniform2fv, PFNGLPROGRAMUNIFORM2FVPROC) \
+	X(glProgramUniform3fv, PFNGLPROGRAMUNIFORM3FVPROC) \
+	X(glProgramUniform4fv, PFNGLPROGRAMUNIFORM4FVPROC) \
+	X(glProgramUniform1iv, PFNGLPROGRAMUNIFORM1IVPROC) \
+	X(glProgramUniform2iv, PFNGLPROGRAMUNIFORM2IVPROC) \
+	X(glProgramUniform3iv, PFNGLPROGRAMUNIFORM3IVPROC) \
+	X(glProgramUniform4iv, PFNGLPROGRAMUNIFORM4IVPROC) \
+	X(glProgramUniform1uiv, PFNGLPROGRAMUNIFORM1UIVPROC) \
+	X(glProgramUniform2uiv, PFNGLPROGRAMUNIFORM2UIVPROC) \
+	X(glProgramUniform3uiv, PFNGLPROGRAMUNIFORM3UIVPROC) \
+	X(glProgramUniform4uiv, PFNGLPROGRAMUNIFORM4UIVPROC) \
+	X(glProgramUniformMatrix2fv, PFNGLPROGRAMUNIFORMMATRIX2FVPROC) \
+	X(glProgramUniformMatrix3fv, PFNGLPROGRAMUNIFORMMATRIX3FVPROC) \
+	X(glProgramUniformMatrix4fv, PFNGLPROGRAMUNIFORMMATRIX4FVPROC) \
+	X(glProgramUniformMatrix2x3fv, PFNGLPROGRAMUNIFORMMATRIX2X3FVPROC) \
+	X(glProgramUniformMatrix3x2fv, PFNGLPROGRAMUNIFORMMATRIX3X2FVPROC) \
+	X(glProgramUniformMatrix2x4fv, PFNGLPROGRAMUNIFORMMATRIX2X4FVPROC) \
+	X(glProgramUniformMatrix4x2fv, PFNGLPROGRAMUNIFORMMATRIX4X2FVPROC) \
+	X(glProgramUniformMatrix3x4fv, PFNGLPROGRAMUNIFORMMATRIX3X4FVPROC) \
+	X(glProgramUniformMatrix4x3fv, PFNGLPROGRAMUNIFORMMATRIX4X3FVPROC)
+
+enum class HookGL : uint8_t
+{
+	#define X(name, type, replacement, aliased) name,
+	GL_HOOKS(X)
+	GLX_HOOKS(X)
+	#undef X
+};
+
+#define GL_HOOK_NAMES_true(name) #name, #name "ARB", #name "EXT", #name "OES",
+#define GL_HOOK_NAMES_false(name) #name,
+#define GL_HOOK_IDS_true(name) HookGL::name, HookGL::name, HookGL::name, HookGL::name,
+#define GL_HOOK_IDS_false(name) HookGL::name,
+
+// every name each hook is found under, ARB, EXT and OES included
+static constexpr const char* k_hook_names[] =
+{
+	#define X(name, type, replacement, aliased) GL_HOOK_NAMES_##aliased(name)
+	GL_HOOKS(X)
+	GLX_HOOKS(X)
+	#undef X
+};
+
+static constexpr HookGL k_hook_ids[] =
+{
+	#define X(name, type, replacement, aliased) GL_HOOK_IDS_##aliased(name)
+	GL_HOOKS(X)
+	GLX_HOOKS(X)
+	#undef X
+};
+
+static constexpr NameTable<sizeof k_hook_names / sizeof *k_hook_names> k_hook_table { k_hook_names };
+
+// gone from glibc 2.34 onwards, where dlsym, dlopen and dlclose moved into libc
+extern "C" void * __libc_dlopen_mode(const char* filename, int flag) __attribute__((weak));
+extern "C" void * __libc_dlsym(void* handle, const char* symbol) __attribute__((weak));
+
+// shader types by name, GL hands out small names so they index a two level table
+// whose pages are allocated on first use, names past the table go in a locked map
+struct ShaderTypes
+{
+	ShaderTypes();
+
+	GLenum Find(GLuint shader);
+
+	// stores type for shader, 0 forgets it, returns the previous type
+	GLenum Exchange(GLuint shader, GLenum type);
+
+private:
+	static const size_t k_page_size = 1024;
+	static const size_t k_page_count = 4096;
+
+	std::atomic<GLenum>* Page(GLuint shader, bool create);
+
+	std::atomic<std::atomic<GLenum>*> pages_[k_page_count];
+
+	std::mutex overflow_mutex_;
+	std::unordered_map<GLuint, GLenum> overflow_;
+};
+
+// dlopen handle to name, sharded so unrelated dlsym calls do not contend
+struct HandleNames
+{
+	// "<unknown>" when handle was not opened through us
+	std::string Find(void* handle);
+	void Insert(void* handle, const char* name);
+	std::string Erase(void* handle);
+
+private:
+	static const size_t k_shard_count = 16;
+
+	struct alignas(64) Shard
+	{
+		std::mutex mutex_;
+		std::unordered_map<void*, std::string> names_;
+	};
+
+	Shard& Select(void* handle);
 
-extern "C" void * __libc_dlopen_mode(const char* filename, int flag);
-extern "C" void * __libc_dlsym(void* handle, const char* symbol);
+	Shard shards_[k_shard_count];
+};
+
+// GL names to T, sharded like HandleNames so that unrelated objects do not contend
+template<typename T>
+struct NameMap
+{
+	bool Find(GLuint name, T& value);
+	void Insert(GLuint name, const T& value);
+	void Erase(GLuint name);
+
+	// calls f with the value for name, default constructed when there is none yet
+	template<typename F>
+	void Update(GLuint name, F&& f);
+
+	// calls f(name, value) for every entry, one shard at a time
+	template<typename F>
+	void ForEach(F&& f);
+
+private:
+	static const size_t k_shard_count = 16;
+
+	struct alignas(64) Shard
+	{
+		std::mutex mutex_;
+		std::unordered_map<GLuint, T> values_;
+	};
+
+	Shard& Select(GLuint name);
+
+	Shard shards_[k_shard_count];
+};
+
+struct ShaderGL
+{
+	// hash the shader is named by in shaders/
+	Hash name;
+	// hash of the source the driver was given, the replacement with its includes
+	// when there is one
+	Hash source;
+	size_t size = 0;
+	bool replaced = false;
+	// compiled since the source was set and not waited for since, only tracked while
+	// profiling or compiling in parallel
+	bool compiling = false;
+};
+
+// what a link depends on besides the driver
+struct ProgramGL
+{
+	std::vector<GLuint> shaders;
+	GLint separable = GL_FALSE;
+	// attribute, output and varying bindings the next link uses, sorted by what they
+	// bind so equal bindings hash the same whatever order they were made in
+	std::vector<std::pair<std::string, std::string>> bindings;
+	// as set by the application, deshade always asks for retrievable binaries
+	GLint retrievable = GL_FALSE;
+	// while profiling, hash of the names of the shaders it was last linked with and
+	// whether the status was asked for since
+	Hash name = { };
+	bool linking = false;
+	// linked since and its binary still to be saved under this key, asking for the
+	// status right after the link would wait for the driver
+	bool saving = false;
+	Hash binary = { };
+};
+
+// sources known to compile with one driver
+struct CompiledGL
+{
+	std::unordered_set<Hash> compiled;
+	bool changed = false;
+};
+
+// a shader answered without waiting, the source is trusted with the driver it was
+// compiled by until its real status is known
+struct UnverifiedGL
+{
+	GLuint shader;
+	Hash driver;
+	Hash compiled;
+};
+
+// DESHADE_PARALLEL=1 lets the driver compile on its own threads and answers the
+// compile status of sources which compiled with this driver before without waiting,
+// so applications which ask right after every compile stop serializing the driver
+struct ParallelGL
+{
+	std::atomic<bool> enabled_ { false };
+
+	// everything below protected by mutex_, by the key of the driver's vendor,
+	// renderer and version, loaded when a context of the driver first compiles
+	std::mutex mutex_;
+	std::unordered_map<Hash, CompiledGL> drivers_;
+};
+
+// objects contexts created with a share list have in common, every other context
+// has a group of its own
+struct ShareGroupGL
+{
+	ShaderTypes shader_handle_to_type;
+
+	NameMap<ShaderGL> shader_handle_to_source;
+	NameMap<ProgramGL> program_handle_to_state;
+
+	// everything below protected by mutex_
+	std::mutex mutex_;
+	// compiled in parallel and answered without waiting, their real status is
+	// checked between frames or before the context goes
+	std::vector<UnverifiedGL> unverified_;
+	// programs with saving set, checked between frames
+	std::vector<GLuint> unsaved_;
+	// edited replacements the group did not reload yet, one of its contexts does
+	// when it swaps
+	std::vector<Replacement> changes_;
+};
 
+// a GLX context, the one current on the calling thread is found with GetContext
 struct ContextGL
 {
-	ContextGL();
+	explicit ContextGL(std::shared_ptr<ShareGroupGL> group);
+
+	std::shared_ptr<ShareGroupGL> group_;
+	ShaderTypes& shader_handle_to_type;
+	NameMap<ShaderGL>& shader_handle_to_source;
+	NameMap<ProgramGL>& program_handle_to_state;
+
+	// protected by the contexts mutex, threads the context is current on and whether
+	// the application destroyed it, it is freed once both say it is unused
+	size_t current_ = 0;
+	bool destroyed_ = false;
+
+	// KHR_parallel_shader_compile or ARB_parallel_shader_compile, -1 until asked for
+	// the first time, only used on the thread the context is current on
+	int parallel_compile_ = -1;
+
+	// DESHADE_PARALLEL=1, -1 until the context first compiles and 0 when its driver
+	// cannot compile in parallel, the driver's key is known once it is 1, both only
+	// used on the thread the context is current on
+	int parallel_ = -1;
+	Hash driver_ = { };
+
+	// published whenever the application looks them up, read without locking
+	#define X(name, type, replacement, aliased) std::atomic<type> name##_ { nullptr };
+	GL_HOOKS(X)
+	#undef X
+
+	// looked up on first use
+	#define X(name, type) std::atomic<type> name##_ { nullptr };
+	GL_FUNCTIONS(X)
+	#undef X
+};
+
+struct ProcessGL
+{
+	ProcessGL();
 
 	// dynamic linker functions are replaced, these are the original
 	// needed to forward from the replacement
@@ -37,206 +367,1758 @@ struct ContextGL
 	void* (*dlopen_)(const char*, int);
 	int (*dlclose_)(void*);
 
-	// everything below protected by mutex_
-	std::recursive_mutex mutex_;
-	std::unordered_map<void*, std::string> object_handle_to_name;
-	std::unordered_map<GLuint, GLenum> shader_handle_to_type;
-	GLXMAINPROC glx_Main_;
-	GLXGETPROCADDRESSPROC glXGetProcAddress_;
-	GLXGETPROCADDRESSPROC glXGetProcAddressARB_;
-	GLCREATESHADERPROC glCreateShader_;
-	GLDELETESHADERPROC glDeleteShader_;
-	GLSHADERSOURCEPROC glShaderSource_;
+	HandleNames object_handle_to_name;
+
+	ParallelGL parallel_;
+
+	// published whenever the application looks them up, read without locking
+	std::atomic<GLXMAINPROC> glx_Main_;
+	std::atomic<GLXGETPROCADDRESSPROC> glXGetProcAddress_;
+	std::atomic<GLXGETPROCADDRESSPROC> glXGetProcAddressARB_;
+
+	#define X(name, type, replacement, aliased) std::atomic<type> name##_ { nullptr };
+	GLX_HOOKS(X)
+	#undef X
+
+	// current while no context created through deshade is, shared by every context
+	// deshade did not see created
+	ContextGL* default_;
+
+	// only taken when contexts are created, made current or destroyed and when the
+	// application looks up a function
+	std::mutex contexts_mutex_;
+	std::unordered_map<GLXContext, ContextGL*> contexts_;
 };
 
-ContextGL::ContextGL()
+ShaderTypes::ShaderTypes()
+{
+	for (auto& page : pages_)
+	{
+		page.store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+std::atomic<GLenum>* ShaderTypes::Page(GLuint shader, bool create)
+{
+	std::atomic<std::atomic<GLenum>*>& slot = pages_[shader / k_page_size];
+	std::atomic<GLenum>* page = slot.load(std::memory_order_acquire);
+	if (page || !create)
+	{
+		return page;
+	}
+
+	// pages are never freed, whoever loses the race frees theirs
+	std::atomic<GLenum>* fresh = new std::atomic<GLenum>[k_page_size]();
+	if (slot.compare_exchange_strong(page, fresh, std::memory_order_acq_rel))
+	{
+		return fresh;
+	}
+	delete[] fresh;
+	return page;
+}
+
+GLenum ShaderTypes::Find(GLuint shader)
+{
+	if (shader / k_page_size < k_page_count)
+	{
+		std::atomic<GLenum>* page = Page(shader, false);
+		return page ? page[shader % k_page_size].load(std::memory_order_acquire) : 0;
+	}
+
+	std::lock_guard<std::mutex> lock(overflow_mutex_);
+	auto find = overflow_.find(shader);
+	return find != overflow_.end() ? find->second : 0;
+}
+
+GLenum ShaderTypes::Exchange(GLuint shader, GLenum type)
+{
+	if (shader / k_page_size < k_page_count)
+	{
+		std::atomic<GLenum>* page = Page(shader, type != 0);
+		return page ? page[shader % k_page_size].exchange(type, std::memory_order_acq_rel) : 0;
+	}
+
+	std::lock_guard<std::mutex> lock(overflow_mutex_);
+	auto find = overflow_.find(shader);
+	const GLenum previous = find != overflow_.end() ? find->second : 0;
+	if (type)
+	{
+		overflow_[shader] = type;
+	}
+	else if (find != overflow_.end())
+	{
+		overflow_.erase(find);
+	}
+	return previous;
+}
+
+HandleNames::Shard& HandleNames::Select(void* handle)
+{
+	// handles are heap allocated link maps, the low bits carry nothing
+	return shards_[((uintptr_t)handle >> 4) % k_shard_count];
+}
+
+std::string HandleNames::Find(void* handle)
+{
+	Shard& shard = Select(handle);
+	std::lock_guard<std::mutex> lock(shard.mutex_);
+	auto find = shard.names_.find(handle);
+	return find != shard.names_.end() ? find->second : "<unknown>";
+}
+
+void HandleNames::Insert(void* handle, const char* name)
+{
+	Shard& shard = Select(handle);
+	std::lock_guard<std::mutex> lock(shard.mutex_);
+	shard.names_[handle] = name;
+}
+
+std::string HandleNames::Erase(void* handle)
+{
+	Shard& shard = Select(handle);
+	std::lock_guard<std::mutex> lock(shard.mutex_);
+	auto find = shard.names_.find(handle);
+	if (find == shard.names_.end())
+	{
+		return "<unknown>";
+	}
+	std::string name = std::move(find->second);
+	shard.names_.erase(find);
+	return name;
+}
+
+template<typename T>
+typename NameMap<T>::Shard& NameMap<T>::Select(GLuint name)
+{
+	return shards_[name % k_shard_count];
+}
+
+template<typename T>
+bool NameMap<T>::Find(GLuint name, T& value)
+{
+	Shard& shard = Select(name);
+	std::lock_guard<std::mutex> lock(shard.mutex_);
+	auto find = shard.values_.find(name);
+	if (find == shard.values_.end())
+	{
+		return false;
+	}
+	value = find->second;
+	return true;
+}
+
+template<typename T>
+void NameMap<T>::Insert(GLuint name, const T& value)
+{
+	Shard& shard = Select(name);
+	std::lock_guard<std::mutex> lock(shard.mutex_);
+	shard.values_[name] = value;
+}
+
+template<typename T>
+void NameMap<T>::Erase(GLuint name)
+{
+	Shard& shard = Select(name);
+	std::lock_guard<std::mutex> lock(shard.mutex_);
+	shard.values_.erase(name);
+}
+
+template<typename T>
+template<typename F>
+void NameMap<T>::Update(GLuint name, F&& f)
+{
+	Shard& shard = Select(name);
+	std::lock_guard<std::mutex> lock(shard.mutex_);
+	f(shard.values_[name]);
+}
+
+template<typename T>
+template<typename F>
+void NameMap<T>::ForEach(F&& f)
+{
+	for (Shard& shard : shards_)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex_);
+		for (auto& value : shard.values_)
+		{
+			f(value.first, value.second);
+		}
+	}
+}
+
+ContextGL::ContextGL(std::shared_ptr<ShareGroupGL> group)
+	: group_                  { std::move(group) }
+	, shader_handle_to_type   { group_->shader_handle_to_type }
+	, shader_handle_to_source { group_->shader_handle_to_source }
+	, program_handle_to_state { group_->program_handle_to_state }
+{
+}
+
+ProcessGL::ProcessGL()
 	: dlsym_                { nullptr }
 	, dlopen_               { nullptr }
 	, dlclose_              { nullptr }
 	, glx_Main_             { nullptr }
 	, glXGetProcAddress_    { nullptr }
 	, glXGetProcAddressARB_ { nullptr }
-	, glCreateShader_       { nullptr }
-	, glDeleteShader_       { nullptr }
-	, glShaderSource_       { nullptr }
+	, default_              { new ContextGL(std::make_shared<ShareGroupGL>()) }
 {
+	const char* parallel = std::getenv("DESHADE_PARALLEL");
+	parallel_.enabled_ = parallel && *parallel == '1';
+
+	if (!__libc_dlopen_mode || !__libc_dlsym)
+	{
+		// dlvsym is not replaced and only finds the versioned definitions in libc
+		*(void **)&dlsym_   = dlvsym(RTLD_NEXT, "dlsym", "GLIBC_2.34");
+		*(void **)&dlopen_  = dlvsym(RTLD_NEXT, "dlopen", "GLIBC_2.34");
+		*(void **)&dlclose_ = dlvsym(RTLD_NEXT, "dlclose", "GLIBC_2.34");
+		return;
+	}
+
 	void* libdl = __libc_dlopen_mode("libdl.so.2", RTLD_LOCAL | RTLD_NOW);
 	if (libdl)
 	{
-		*(void **)&dlsym_   = __libc_dlsym(libdl, "dlsym");
-		*(void **)&dlopen_  = __libc_dlsym(libdl, "dlopen");
-		*(void **)&dlclose_ = __libc_dlsym(libdl, "dlclose");
-		dlclose_(libdl);
+		*(void **)&dlsym_   = __libc_dlsym(libdl, "dlsym");
+		*(void **)&dlopen_  = __libc_dlsym(libdl, "dlopen");
+		*(void **)&dlclose_ = __libc_dlsym(libdl, "dlclose");
+		dlclose_(libdl);
+	}
+}
+
+static ProcessGL& GetProcess()
+{
+	// process has to leak on exit, _dl_fini will want to call our dlclose
+	// which depends on the process existing, after the first call this is
+	// a single load as it runs on every dlsym
+	static ProcessGL* process_ = new ProcessGL;
+	return *process_;
+}
+
+// set by glXMakeCurrent and glXMakeContextCurrent, nullptr while the thread has no
+// context or one deshade did not see created
+static thread_local ContextGL* t_context = nullptr;
+
+static ContextGL& GetContext()
+{
+	// runs on every GL call, a single thread local load once the thread has a context
+	ContextGL* context = t_context;
+	return context ? *context : *GetProcess().default_;
+}
+
+static const char* GetShaderExtensionString(GLenum shader_type)
+{
+	switch (shader_type)
+	{
+	case GL_VERTEX_SHADER:
+		return "_vs.glsl";
+	case GL_FRAGMENT_SHADER:
+		return "_fs.glsl";
+	case GL_COMPUTE_SHADER:
+		return "_cs.glsl";
+	case GL_GEOMETRY_SHADER:
+		return "_gs.glsl";
+	case GL_TESS_CONTROL_SHADER:
+		return "_tcs.glsl";
+	case GL_TESS_EVALUATION_SHADER:
+		return "_tes.glsl";
+	}
+	return "<unknown>";
+}
+
+static const char* GetShaderTypeString(GLenum shader_type)
+{
+	switch (shader_type)
+	{
+	case GL_VERTEX_SHADER:
+		return "vertex";
+	case GL_FRAGMENT_SHADER:
+		return "fragment";
+	case GL_COMPUTE_SHADER:
+		return "compute";
+	case GL_GEOMETRY_SHADER:
+		return "geometry";
+	case GL_TESS_CONTROL_SHADER:
+		return "tessellation control";
+	case GL_TESS_EVALUATION_SHADER:
+		return "tessellation evaluation";
+	}
+	return "<unknown>";
+}
+
+// Replacement OpenGL shader functions
+static GLuint CreateShader(GLenum shader_type)
+{
+	ContextGL& context = GetContext();
+	GLuint result = context.glCreateShader_.load(std::memory_order_acquire)(shader_type);
+	if (result)
+	{
+		Log("Created % shader \"%\"\n", GetShaderTypeString(shader_type), result);
+		context.shader_handle_to_type.Exchange(result, shader_type);
+		// names are reused, a link must not see the hash of a deleted shader
+		context.shader_handle_to_source.Erase(result);
+		return result;
+	}
+	return 0;
+}
+
+static void DeleteShader(GLuint shader)
+{
+	ContextGL& context = GetContext();
+	if (const GLenum shader_type = context.shader_handle_to_type.Exchange(shader, 0))
+	{
+		Log("Deleted % shader \"%\"\n", GetShaderTypeString(shader_type), shader);
+	}
+	if (GetProcess().parallel_.enabled_.load(std::memory_order_relaxed))
+	{
+		// the name may be reused before the next frame
+		std::lock_guard<std::mutex> lock(context.group_->mutex_);
+		std::vector<UnverifiedGL>& unverified = context.group_->unverified_;
+		unverified.erase(std::remove_if(unverified.begin(), unverified.end(), [&](const UnverifiedGL& entry)
+		{
+			return entry.shader == shader;
+		}), unverified.end());
+	}
+	context.glDeleteShader_.load(std::memory_order_acquire)(shader);
+}
+
+// calls f(run, size) for every run of shader source between \r characters, a negative
+// or absent length means the segment is nul terminated
+template<typename F>
+static void ForEachSourceRun(GLsizei count, const GLchar** string, const GLint* length, F&& f)
+{
+	for (GLsizei i = 0; i < count; i++)
+	{
+		const char* run = string[i];
+		const char* end = run + (length && length[i] >= 0 ? length[i] : std::strlen(run));
+		while (run < end)
+		{
+			const char* cr = (const char*)std::memchr(run, '\r', end - run);
+			const char* run_end = cr ? cr : end;
+			if (run_end != run)
+			{
+				f(run, (size_t)(run_end - run));
+			}
+			run = cr ? cr + 1 : end;
+		}
+	}
+}
+
+static void ShaderSource(GLuint shader, GLsizei count, const GLchar** string, const GLint* length)
+{
+	ContextGL& context = GetContext();
+	const GLSHADERSOURCEPROC glShaderSource_ = context.glShaderSource_.load(std::memory_order_acquire);
+	const GLenum shader_type = context.shader_handle_to_type.Find(shader);
+	const char* shader_type_string = GetShaderTypeString(shader_type);
+
+	Store& store = Store::Get();
+
+	// hash the source segments in place, \r is skipped so that line endings do not matter
+	Hasher hasher;
+	HasherDJB hasher_djb;
+	size_t source_size = 0;
+	ForEachSourceRun(count, string, length, [&](const char* run, size_t size)
+	{
+		hasher.Update(run, size);
+		source_size += size;
+		if (store.LegacyHash())
+		{
+			hasher_djb.Update(run, size);
+		}
+	});
+	const Hash hash = hasher.Final();
+	const char* suffix = GetShaderExtensionString(shader_type);
+
+	// check if a shader replacement exists
+	Hash name = hash;
+	std::shared_ptr<const Mapping> replacement = store.Find(hash, suffix);
+	if (!replacement && store.LegacyHash())
+	{
+		const Hash legacy_hash = hasher_djb.Final();
+		replacement = store.Find(legacy_hash, suffix);
+		if (replacement)
+		{
+			Log("Found legacy % shader \"%\" for \"%\"\n", shader_type_string, legacy_hash, hash);
+			name = legacy_hash;
+		}
+	}
+
+	if (replacement)
+	{
+		Log("Replaced % shader \"%\"\n", shader_type_string, hash);
+
+		// place the actual call with the replacement, includes resolved
+		const GLSLSource source = Preprocessor::Get().Process(replacement->Data(), replacement->Size());
+		const GLchar* shader_data = source.text ? source.text->data() : (const GLchar*)replacement->Data();
+		const GLint shader_size = source.text ? source.text->size() : replacement->Size();
+		glShaderSource_(shader, 1, &shader_data, &shader_size);
+		context.shader_handle_to_source.Insert(shader, ShaderGL { name, source.hash, (size_t)shader_size, true });
+	}
+	else
+	{
+		// only a dump needs the normalized source, the file is written on the writer thread
+		if (store.Insert(hash, suffix))
+		{
+			std::vector<char> source;
+			source.reserve(source_size);
+			ForEachSourceRun(count, string, length, [&](const char* run, size_t size)
+			{
+				source.insert(source.end(), run, run + size);
+			});
+			store.Dump(hash, suffix, std::move(source));
+			Log("Dumpped % shader \"%\"\n", shader_type_string, hash);
+		}
+
+		// nothing replaced, forward the original segments untouched
+		glShaderSource_(shader, count, string, length);
+		context.shader_handle_to_source.Insert(shader, ShaderGL { name, hash, source_size, false });
+	}
+	Log("Source % shader \"%\"\n", shader_type_string, hash);
+}
+
+// linked programs are stored with the shaders so that later launches load them with
+// glProgramBinary instead of linking
+static const char* k_program_suffix = ".glprogram";
+
+// resolves a function deshade calls on its own through the driver's glXGetProcAddress
+template<typename T>
+static T GetFunction(std::atomic<T>& function, const char* name)
+{
+	T result = function.load(std::memory_order_acquire);
+	if (result)
+	{
+		return result;
+	}
+	ProcessGL& process = GetProcess();
+	GLXGETPROCADDRESSPROC get_proc_address = process.glXGetProcAddress_.load(std::memory_order_acquire);
+	if (!get_proc_address)
+	{
+		get_proc_address = process.glXGetProcAddressARB_.load(std::memory_order_acquire);
+	}
+	if (get_proc_address)
+	{
+		result = (T)get_proc_address((const GLubyte*)name);
+		function.store(result, std::memory_order_release);
+	}
+	return result;
+}
+
+// compiling in parallel, the sources known to compile are stored with the shaders by
+// the driver they compiled with
+static const char* k_compiled_suffix = ".glcompiled";
+
+// the thread count is state of the context, every context asks for threads of its own
+// and finds the sources known to compile with its driver, false when it cannot
+static bool StartParallel(ContextGL& context)
+{
+	if (context.parallel_ >= 0)
+	{
+		return context.parallel_;
+	}
+	context.parallel_ = 0;
+
+	PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR_ =
+		GetFunction(context.glMaxShaderCompilerThreadsKHR_, "glMaxShaderCompilerThreadsKHR");
+	if (!glMaxShaderCompilerThreadsKHR_)
+	{
+		glMaxShaderCompilerThreadsKHR_ = GetFunction(context.glMaxShaderCompilerThreadsKHR_, "glMaxShaderCompilerThreadsARB");
+	}
+	const GLGETSTRINGPROC glGetString_ = GetFunction(context.glGetString_, "glGetString");
+	if (!glMaxShaderCompilerThreadsKHR_ || !glGetString_)
+	{
+		LogError("No KHR_parallel_shader_compile, shaders of the context compile as before\n");
+		return false;
+	}
+
+	// as many threads as the driver sees fit
+	glMaxShaderCompilerThreadsKHR_(0xFFFFFFFF);
+
+	Hasher hasher;
+	for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+	{
+		const char* string = (const char*)glGetString_(name);
+		hasher.Update(string ? string : "", string ? std::strlen(string) + 1 : 1);
+	}
+	context.driver_ = hasher.Final();
+	context.parallel_ = 1;
+
+	ParallelGL& parallel = GetProcess().parallel_;
+	std::lock_guard<std::mutex> lock(parallel.mutex_);
+	auto insert = parallel.drivers_.insert({ context.driver_, CompiledGL { } });
+	if (!insert.second)
+	{
+		return true;
+	}
+	std::unordered_set<Hash>& compiled = insert.first->second.compiled;
+	if (std::shared_ptr<const Mapping> mapping = Store::Get().Find(context.driver_, k_compiled_suffix))
+	{
+		const Hash* hashes = (const Hash*)mapping->Data();
+		compiled.insert(hashes, hashes + mapping->Size() / sizeof(Hash));
+	}
+	Log("Compiling in parallel, % sources known to compile with \"%\"\n", compiled.size(), context.driver_);
+	return true;
+}
+
+static bool IsKnownCompiled(ContextGL& context, GLuint shader, const Hash& compiled)
+{
+	ParallelGL& parallel = GetProcess().parallel_;
+	{
+		std::lock_guard<std::mutex> lock(parallel.mutex_);
+		if (!parallel.drivers_[context.driver_].compiled.count(compiled))
+		{
+			return false;
+		}
+	}
+	std::lock_guard<std::mutex> lock(context.group_->mutex_);
+	context.group_->unverified_.push_back({ shader, context.driver_, compiled });
+	return true;
+}
+
+static void RememberCompiled(ContextGL& context, const Hash& compiled)
+{
+	ParallelGL& parallel = GetProcess().parallel_;
+	std::lock_guard<std::mutex> lock(parallel.mutex_);
+	CompiledGL& driver = parallel.drivers_[context.driver_];
+	driver.changed |= driver.compiled.insert(compiled).second;
+}
+
+// dumps the sources known to compile with every driver when they changed since the
+// last dump
+static void SaveCompiled()
+{
+	ParallelGL& parallel = GetProcess().parallel_;
+	std::lock_guard<std::mutex> lock(parallel.mutex_);
+	if (!Store::Get().Enabled())
+	{
+		return;
+	}
+	for (auto& driver : parallel.drivers_)
+	{
+		if (!driver.second.changed)
+		{
+			continue;
+		}
+		driver.second.changed = false;
+		std::vector<Hash> hashes(driver.second.compiled.begin(), driver.second.compiled.end());
+		std::sort(hashes.begin(), hashes.end());
+		const char* data = (const char*)hashes.data();
+		Store::Get().Dump(driver.first, k_compiled_suffix, std::vector<char>(data, data + hashes.size() * sizeof(Hash)));
+	}
+}
+
+// runs on dlclose and at exit, an application which never swaps learns as well
+__attribute__((destructor)) static void SaveParallel()
+{
+	if (GetProcess().parallel_.enabled_.load(std::memory_order_relaxed))
+	{
+		SaveCompiled();
+	}
+}
+
+// between two frames or before the context goes, shaders of the current share group
+// answered without waiting which are done by now are checked, a source which fails
+// to compile after all is not trusted again
+static void VerifyParallel(ContextGL& context)
+{
+	ParallelGL& parallel = GetProcess().parallel_;
+	const GLGETSHADERIVPROC glGetShaderiv_ = context.glGetShaderiv_.load(std::memory_order_acquire);
+	std::vector<UnverifiedGL> failed;
+	if (glGetShaderiv_)
+	{
+		std::lock_guard<std::mutex> lock(context.group_->mutex_);
+		std::vector<UnverifiedGL> pending;
+		for (const UnverifiedGL& entry : context.group_->unverified_)
+		{
+			GLint status = GL_FALSE;
+			glGetShaderiv_(entry.shader, GL_COMPLETION_STATUS_KHR, &status);
+			if (status != GL_TRUE)
+			{
+				pending.push_back(entry);
+				continue;
+			}
+			glGetShaderiv_(entry.shader, GL_COMPILE_STATUS, &status);
+			if (status != GL_TRUE)
+			{
+				LogError("Shader \"%\" failed to compile after it was reported compiled\n", entry.shader);
+				failed.push_back(entry);
+			}
+		}
+		context.group_->unverified_.swap(pending);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(parallel.mutex_);
+		for (const UnverifiedGL& entry : failed)
+		{
+			CompiledGL& driver = parallel.drivers_[entry.driver];
+			driver.changed |= driver.compiled.erase(entry.compiled) != 0;
+		}
+	}
+	SaveCompiled();
+}
+
+// profiling, times are reported by the hashes shaders are named by in shaders/
+
+static uint64_t Elapsed(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the status and the info log are only known once the driver is done
+static bool WaitsForCompletion(GLenum pname)
+{
+	return pname == GL_COMPILE_STATUS || pname == GL_LINK_STATUS || pname == GL_INFO_LOG_LENGTH;
+}
+
+static void CompileShader(GLuint shader)
+{
+	ContextGL& context = GetContext();
+	const GLCOMPILESHADERPROC glCompileShader_ = context.glCompileShader_.load(std::memory_order_acquire);
+	Profile& profile = Profile::Get();
+	const bool parallel = GetProcess().parallel_.enabled_.load(std::memory_order_relaxed);
+	ShaderGL info;
+	if ((!profile.Enabled() && !parallel) || !context.shader_handle_to_source.Find(shader, info))
+	{
+		glCompileShader_(shader);
+		return;
+	}
+
+	if (parallel)
+	{
+		StartParallel(context);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	glCompileShader_(shader);
+	if (profile.Enabled())
+	{
+		const GLenum shader_type = context.shader_handle_to_type.Find(shader);
+		profile.Compiled(info.name, GetShaderTypeString(shader_type), info.size, info.replaced, Elapsed(start));
+	}
+	context.shader_handle_to_source.Update(shader, [](ShaderGL& state) { state.compiling = true; });
+}
+
+static void GetShaderiv(GLuint shader, GLenum pname, GLint* params)
+{
+	ContextGL& context = GetContext();
+	const GLGETSHADERIVPROC glGetShaderiv_ = context.glGetShaderiv_.load(std::memory_order_acquire);
+	Profile& profile = Profile::Get();
+	const bool parallel = GetProcess().parallel_.enabled_.load(std::memory_order_relaxed) && context.parallel_ == 1;
+	ShaderGL info;
+	if (!WaitsForCompletion(pname) || (!profile.Enabled() && !parallel)
+	 || !context.shader_handle_to_source.Find(shader, info) || !info.compiling)
+	{
+		glGetShaderiv_(shader, pname, params);
+		return;
+	}
+
+	// the driver keeps compiling, whatever waits for the shader later waits for it then
+	const Hash compiled = parallel ? GetCompiledKey(info.source, context.shader_handle_to_type.Find(shader)) : Hash { };
+	context.shader_handle_to_source.Update(shader, [](ShaderGL& state) { state.compiling = false; });
+	if (parallel && pname == GL_COMPILE_STATUS && IsKnownCompiled(context, shader, compiled))
+	{
+		*params = GL_TRUE;
+		return;
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	glGetShaderiv_(shader, pname, params);
+	if (profile.Enabled())
+	{
+		profile.Waited(info.name, Elapsed(start));
+	}
+	if (parallel && pname == GL_COMPILE_STATUS && *params == GL_TRUE)
+	{
+		RememberCompiled(context, compiled);
+	}
+}
+
+static void AttachShader(GLuint program, GLuint shader)
+{
+	ContextGL& context = GetContext();
+	context.program_handle_to_state.Update(program, [&](ProgramGL& state)
+	{
+		if (std::find(state.shaders.begin(), state.shaders.end(), shader) == state.shaders.end())
+		{
+			state.shaders.push_back(shader);
+		}
+	});
+	context.glAttachShader_.load(std::memory_order_acquire)(program, shader);
+}
+
+static void DetachShader(GLuint program, GLuint shader)
+{
+	ContextGL& context = GetContext();
+	context.program_handle_to_state.Update(program, [&](ProgramGL& state)
+	{
+		state.shaders.erase(std::remove(state.shaders.begin(), state.shaders.end(), shader), state.shaders.end());
+	});
+	context.glDetachShader_.load(std::memory_order_acquire)(program, shader);
+}
+
+static void DeleteProgram(GLuint program)
+{
+	ContextGL& context = GetContext();
+	context.program_handle_to_state.Erase(program);
+	context.glDeleteProgram_.load(std::memory_order_acquire)(program);
+}
+
+static void ProgramParameteri(GLuint program, GLenum pname, GLint value)
+{
+	ContextGL& context = GetContext();
+	if (pname == GL_PROGRAM_SEPARABLE || pname == GL_PROGRAM_BINARY_RETRIEVABLE_HINT)
+	{
+		context.program_handle_to_state.Update(program, [&](ProgramGL& state)
+		{
+			(pname == GL_PROGRAM_SEPARABLE ? state.separable : state.retrievable) = value;
+		});
+	}
+	context.glProgramParameteri_.load(std::memory_order_acquire)(program, pname, value);
+}
+
+// a later binding of the same attribute, output or varyings replaces the earlier one
+static void Bind(ContextGL& context, GLuint program, std::string what, std::string value)
+{
+	context.program_handle_to_state.Update(program, [&](ProgramGL& state)
+	{
+		const auto find = std::lower_bound(state.bindings.begin(), state.bindings.end(), what,
+			[](const std::pair<std::string, std::string>& binding, const std::string& name) { return binding.first < name; });
+		if (find != state.bindings.end() && find->first == what)
+		{
+			find->second = std::move(value);
+		}
+		else
+		{
+			state.bindings.emplace(find, std::move(what), std::move(value));
+		}
+	});
+}
+
+static void BindAttribLocation(GLuint program, GLuint index, const GLchar* name)
+{
+	ContextGL& context = GetContext();
+	if (name)
+	{
+		Bind(context, program, std::string("attribute ") + name, std::to_string(index));
+	}
+	context.glBindAttribLocation_.load(std::memory_order_acquire)(program, index, name);
+}
+
+static void BindFragDataLocation(GLuint program, GLuint color, const GLchar* name)
+{
+	ContextGL& context = GetContext();
+	if (name)
+	{
+		Bind(context, program, std::string("output ") + name, std::to_string(color) + " 0");
+	}
+	context.glBindFragDataLocation_.load(std::memory_order_acquire)(program, color, name);
+}
+
+static void BindFragDataLocationIndexed(GLuint program, GLuint color, GLuint index, const GLchar* name)
+{
+	ContextGL& context = GetContext();
+	if (name)
+	{
+		Bind(context, program, std::string("output ") + name, std::to_string(color) + " " + std::to_string(index));
+	}
+	context.glBindFragDataLocationIndexed_.load(std::memory_order_acquire)(program, color, index, name);
+}
+
+static void TransformFeedbackVaryings(GLuint program, GLsizei count, const GLchar* const* varyings, GLenum mode)
+{
+	ContextGL& context = GetContext();
+	std::string value = std::to_string(mode);
+	for (GLsizei i = 0; varyings && i < count; ++i)
+	{
+		value += '\0';
+		value += varyings[i] ? varyings[i] : "";
+	}
+	Bind(context, program, "varyings", std::move(value));
+	context.glTransformFeedbackVaryings_.load(std::memory_order_acquire)(program, count, varyings, mode);
+}
+
+static void SaveProgram(ContextGL& context, GLuint program, GLint status);
+
+static void GetProgramiv(GLuint program, GLenum pname, GLint* params)
+{
+	ContextGL& context = GetContext();
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = context.glGetProgramiv_.load(std::memory_order_acquire);
+	ProgramGL state;
+	const bool found = (WaitsForCompletion(pname) || pname == GL_PROGRAM_BINARY_RETRIEVABLE_HINT)
+		&& context.program_handle_to_state.Find(program, state);
+	if (found && state.linking && WaitsForCompletion(pname) && Profile::Get().Enabled())
+	{
+		context.program_handle_to_state.Update(program, [](ProgramGL& current) { current.linking = false; });
+		const auto start = std::chrono::steady_clock::now();
+		glGetProgramiv_(program, pname, params);
+		Profile::Get().Waited(state.name, Elapsed(start));
+	}
+	else
+	{
+		glGetProgramiv_(program, pname, params);
+	}
+
+	// the application waited for the link already, the binary is ready
+	if (found && state.saving && pname == GL_LINK_STATUS)
+	{
+		SaveProgram(context, program, *params);
+	}
+
+	// the hint deshade set is not the application's business
+	if (found && pname == GL_PROGRAM_BINARY_RETRIEVABLE_HINT)
+	{
+		*params = state.retrievable;
+	}
+}
+
+// a binary only loads into the driver that produced it, attachment order does not
+// change the program so the shaders are sorted, the bindings set before the link
+// do, false when a shader was never seen
+static bool GetProgramKey(ContextGL& context, const ProgramGL& state, Hash& key)
+{
+	std::vector<Hash> hashes;
+	for (GLuint shader : state.shaders)
+	{
+		ShaderGL info;
+		if (!context.shader_handle_to_source.Find(shader, info))
+		{
+			return false;
+		}
+		hashes.push_back(info.source);
+	}
+	std::sort(hashes.begin(), hashes.end());
+
+	const GLGETSTRINGPROC glGetString_ = GetFunction(context.glGetString_, "glGetString");
+	if (hashes.empty() || !glGetString_)
+	{
+		return false;
+	}
+
+	Hasher hasher;
+	for (const Hash& hash : hashes)
+	{
+		hasher.Update(hash.bytes, sizeof hash.bytes);
+	}
+	hasher.Update(&state.separable, sizeof state.separable);
+	for (const auto& binding : state.bindings)
+	{
+		hasher.Update(binding.first.data(), binding.first.size() + 1);
+		hasher.Update(binding.second.data(), binding.second.size() + 1);
+	}
+	for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+	{
+		const char* string = (const char*)glGetString_(name);
+		if (!string)
+		{
+			return false;
+		}
+		hasher.Update(string, std::strlen(string) + 1);
+	}
+	key = hasher.Final();
+	return true;
+}
+
+static void LinkOrLoadProgram(GLuint program)
+{
+	ContextGL& context = GetContext();
+	const GLLINKPROGRAMPROC glLinkProgram_ = context.glLinkProgram_.load(std::memory_order_acquire);
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = GetFunction(context.glGetProgramiv_, "glGetProgramiv");
+	const GLPROGRAMPARAMETERIPROC glProgramParameteri_ = GetFunction(context.glProgramParameteri_, "glProgramParameteri");
+	const PFNGLGETPROGRAMBINARYPROC glGetProgramBinary_ = GetFunction(context.glGetProgramBinary_, "glGetProgramBinary");
+	const PFNGLPROGRAMBINARYPROC glProgramBinary_ = GetFunction(context.glProgramBinary_, "glProgramBinary");
+
+	Store& store = Store::Get();
+	ProgramGL state;
+	Hash key;
+	if (!store.Enabled()
+	 || !glGetProgramiv_ || !glProgramParameteri_ || !glGetProgramBinary_ || !glProgramBinary_
+	 || !context.program_handle_to_state.Find(program, state)
+	 || !GetProgramKey(context, state, key))
+	{
+		glLinkProgram_(program);
+		return;
+	}
+
+	// a rejected binary leaves the program unlinked with its shaders still attached
+	bool rejected = false;
+	std::shared_ptr<const Mapping> binary = store.Find(key, k_program_suffix);
+	if (binary && binary->Size() > sizeof(GLenum))
+	{
+		GLenum format;
+		std::memcpy(&format, binary->Data(), sizeof format);
+		glProgramBinary_(program, format, (const char*)binary->Data() + sizeof format, binary->Size() - sizeof format);
+
+		GLint status = GL_FALSE;
+		glGetProgramiv_(program, GL_LINK_STATUS, &status);
+		if (status == GL_TRUE)
+		{
+			Log("Loaded program \"%\" from \"%\"\n", program, key);
+			return;
+		}
+		Log("Rejected program binary \"%\", linking program \"%\"\n", key, program);
+		rejected = true;
+	}
+
+	// some drivers only keep the binary around when asked for it before linking
+	glProgramParameteri_(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram_(program);
+	if (!rejected && !store.Insert(key, k_program_suffix))
+	{
+		return;
+	}
+
+	// the status would wait for the link and every compile it depends on, so the binary
+	// is saved once the application asks for it or the driver is done between frames
+	context.program_handle_to_state.Update(program, [&](ProgramGL& current)
+	{
+		current.saving = true;
+		current.binary = key;
+	});
+	std::lock_guard<std::mutex> lock(context.group_->mutex_);
+	context.group_->unsaved_.push_back(program);
+}
+
+// the binary of a program linked by LinkOrLoadProgram, once status is known
+static void SaveProgram(ContextGL& context, GLuint program, GLint status)
+{
+	ProgramGL state;
+	if (!context.program_handle_to_state.Find(program, state) || !state.saving)
+	{
+		return;
+	}
+	context.program_handle_to_state.Update(program, [](ProgramGL& current) { current.saving = false; });
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = GetFunction(context.glGetProgramiv_, "glGetProgramiv");
+	const PFNGLGETPROGRAMBINARYPROC glGetProgramBinary_ = GetFunction(context.glGetProgramBinary_, "glGetProgramBinary");
+	if (status != GL_TRUE)
+	{
+		return;
+	}
+
+	// <binary format><binary>
+	const Hash& key = state.binary;
+	GLint length = 0;
+	glGetProgramiv_(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	std::vector<char> contents(sizeof(GLenum) + (length > 0 ? length : 0));
+	GLenum format = 0;
+	GLsizei written = 0;
+	if (length > 0)
+	{
+		glGetProgramBinary_(program, length, &written, &format, contents.data() + sizeof format);
+	}
+	if (written <= 0)
+	{
+		LogError("Failed to get binary of program \"%\"\n", program);
+		return;
+	}
+	std::memcpy(contents.data(), &format, sizeof format);
+	contents.resize(sizeof format + written);
+	Store::Get().Dump(key, k_program_suffix, std::move(contents));
+	Log("Saved program \"%\" as \"%\" with % bytes\n", program, key, written);
+}
+
+static bool HasExtension(ContextGL& context, const char* name)
+{
+	const GLGETINTEGERVPROC glGetIntegerv_ = GetFunction(context.glGetIntegerv_, "glGetIntegerv");
+	const PFNGLGETSTRINGIPROC glGetStringi_ = GetFunction(context.glGetStringi_, "glGetStringi");
+	GLint count = 0;
+	if (glGetIntegerv_ && glGetStringi_)
+	{
+		glGetIntegerv_(GL_NUM_EXTENSIONS, &count);
+	}
+	for (GLint i = 0; i < count; i++)
+	{
+		const char* extension = (const char*)glGetStringi_(GL_EXTENSIONS, i);
+		if (extension && !strcmp(extension, name))
+		{
+			return true;
+		}
+	}
+
+	// contexts before 3.0 only have the one string
+	const GLGETSTRINGPROC glGetString_ = GetFunction(context.glGetString_, "glGetString");
+	const char* extensions = count || !glGetString_ ? nullptr : (const char*)glGetString_(GL_EXTENSIONS);
+	const size_t length = std::strlen(name);
+	for (const char* find = extensions; find && (find = strstr(find, name)); find += length)
+	{
+		if ((find == extensions || find[-1] == ' ') && (find[length] == ' ' || find[length] == '\0'))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// whether GL_COMPLETION_STATUS_KHR can be asked for without an error
+static bool HasParallelCompile(ContextGL& context)
+{
+	if (context.parallel_compile_ < 0)
+	{
+		context.parallel_compile_ = HasExtension(context, "GL_KHR_parallel_shader_compile")
+			|| HasExtension(context, "GL_ARB_parallel_shader_compile");
+	}
+	return context.parallel_compile_;
+}
+
+// between two frames, programs linked since are saved once the driver is done with
+// them, without KHR_parallel_shader_compile the link finished long before
+static void SavePrograms(ContextGL& context)
+{
+	std::vector<GLuint> unsaved;
+	{
+		std::lock_guard<std::mutex> lock(context.group_->mutex_);
+		unsaved.swap(context.group_->unsaved_);
+	}
+	if (unsaved.empty())
+	{
+		return;
+	}
+
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = GetFunction(context.glGetProgramiv_, "glGetProgramiv");
+	const bool completion = HasParallelCompile(context);
+	std::vector<GLuint> pending;
+	for (GLuint program : unsaved)
+	{
+		GLint done = GL_TRUE;
+		if (completion)
+		{
+			glGetProgramiv_(program, GL_COMPLETION_STATUS_KHR, &done);
+		}
+		if (done != GL_TRUE)
+		{
+			pending.push_back(program);
+			continue;
+		}
+		GLint status = GL_FALSE;
+		glGetProgramiv_(program, GL_LINK_STATUS, &status);
+		SaveProgram(context, program, status);
+	}
+
+	std::lock_guard<std::mutex> lock(context.group_->mutex_);
+	context.group_->unsaved_.insert(context.group_->unsaved_.end(), pending.begin(), pending.end());
+}
+
+static void LinkProgram(GLuint program)
+{
+	Profile& profile = Profile::Get();
+	if (!profile.Enabled())
+	{
+		LinkOrLoadProgram(program);
+		return;
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	LinkOrLoadProgram(program);
+	const uint64_t nanoseconds = Elapsed(start);
+
+	// attachment order does not change the program
+	ContextGL& context = GetContext();
+	ProgramGL state;
+	if (!context.program_handle_to_state.Find(program, state))
+	{
+		return;
+	}
+	std::vector<Hash> names;
+	size_t size = 0;
+	bool replaced = false;
+	for (GLuint shader : state.shaders)
+	{
+		ShaderGL info;
+		if (context.shader_handle_to_source.Find(shader, info))
+		{
+			names.push_back(info.name);
+			size += info.size;
+			replaced |= info.replaced;
+		}
+	}
+	std::sort(names.begin(), names.end());
+	const Hash name = Hash128(names.data(), names.size() * sizeof(Hash));
+
+	profile.Linked(name, size, replaced, nanoseconds);
+	context.program_handle_to_state.Update(program, [&](ProgramGL& current)
+	{
+		current.name = name;
+		current.linking = true;
+	});
+}
+
+// hot reload, replacements edited while the application runs are compiled and linked
+// into the programs using them between two frames
+
+static std::string GetShaderInfoLog(ContextGL& context, GLuint shader)
+{
+	const GLGETSHADERIVPROC glGetShaderiv_ = GetFunction(context.glGetShaderiv_, "glGetShaderiv");
+	const PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog_ = GetFunction(context.glGetShaderInfoLog_, "glGetShaderInfoLog");
+	GLint length = 0;
+	glGetShaderiv_(shader, GL_INFO_LOG_LENGTH, &length);
+	std::string log(length > 0 ? length : 0, '\0');
+	if (length > 0)
+	{
+		glGetShaderInfoLog_(shader, length, &length, &log[0]);
+		log.resize(length);
+	}
+	return log;
+}
+
+static std::string GetProgramInfoLog(ContextGL& context, GLuint program)
+{
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = GetFunction(context.glGetProgramiv_, "glGetProgramiv");
+	const PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog_ = GetFunction(context.glGetProgramInfoLog_, "glGetProgramInfoLog");
+	GLint length = 0;
+	glGetProgramiv_(program, GL_INFO_LOG_LENGTH, &length);
+	std::string log(length > 0 ? length : 0, '\0');
+	if (length > 0)
+	{
+		glGetProgramInfoLog_(program, length, &length, &log[0]);
+		log.resize(length);
+	}
+	return log;
+}
+
+// default block uniform values by name, read back into the program after it is linked
+// again since linking resets every uniform to its initializer
+struct UniformGL
+{
+	std::string name;
+	GLenum type;
+	GLint value[16];
+};
+
+enum class UniformKind
+{
+	Unsupported,
+	Float,
+	Int,
+	Uint
+};
+
+static UniformKind GetUniformKind(GLenum type)
+{
+	switch (type)
+	{
+	case GL_FLOAT: case GL_FLOAT_VEC2: case GL_FLOAT_VEC3: case GL_FLOAT_VEC4:
+	case GL_FLOAT_MAT2: case GL_FLOAT_MAT3: case GL_FLOAT_MAT4:
+	case GL_FLOAT_MAT2x3: case GL_FLOAT_MAT3x2: case GL_FLOAT_MAT2x4:
+	case GL_FLOAT_MAT4x2: case GL_FLOAT_MAT3x4: case GL_FLOAT_MAT4x3:
+		return UniformKind::Float;
+	case GL_UNSIGNED_INT: case GL_UNSIGNED_INT_VEC2: case GL_UNSIGNED_INT_VEC3: case GL_UNSIGNED_INT_VEC4:
+		return UniformKind::Uint;
+	case GL_DOUBLE: case GL_DOUBLE_VEC2: case GL_DOUBLE_VEC3: case GL_DOUBLE_VEC4:
+	case GL_DOUBLE_MAT2: case GL_DOUBLE_MAT3: case GL_DOUBLE_MAT4:
+	case GL_DOUBLE_MAT2x3: case GL_DOUBLE_MAT3x2: case GL_DOUBLE_MAT2x4:
+	case GL_DOUBLE_MAT4x2: case GL_DOUBLE_MAT3x4: case GL_DOUBLE_MAT4x3:
+	case GL_UNSIGNED_INT_ATOMIC_COUNTER:
+		return UniformKind::Unsupported;
+	}
+	// integers, booleans and every sampler and image type
+	return UniformKind::Int;
+}
+
+// calls f(name, type, location) for every element of every default block uniform
+template<typename F>
+static void ForEachUniform(ContextGL& context, GLuint program, F&& f)
+{
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = GetFunction(context.glGetProgramiv_, "glGetProgramiv");
+	const PFNGLGETACTIVEUNIFORMPROC glGetActiveUniform_ = GetFunction(context.glGetActiveUniform_, "glGetActiveUniform");
+	const PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation_ = GetFunction(context.glGetUniformLocation_, "glGetUniformLocation");
+	if (!glGetActiveUniform_ || !glGetUniformLocation_)
+	{
+		return;
+	}
+
+	GLint count = 0;
+	GLint max_length = 0;
+	glGetProgramiv_(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv_(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+	std::vector<GLchar> buffer(max_length + 1);
+	for (GLint i = 0; i < count; i++)
+	{
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform_(program, i, buffer.size(), &length, &size, &type, buffer.data());
+
+		// arrays are reported once as name[0], every element has a location of its own
+		std::string name(buffer.data(), length);
+		if (name.size() > 3 && !name.compare(name.size() - 3, 3, "[0]"))
+		{
+			name.resize(name.size() - 3);
+		}
+		for (GLint element = 0; element < size; element++)
+		{
+			const std::string element_name = size > 1 ? name + "[" + std::to_string(element) + "]" : name;
+			const GLint location = glGetUniformLocation_(program, element_name.c_str());
+			// uniforms in blocks have no location
+			if (location != -1)
+			{
+				f(element_name, type, location);
+			}
+		}
+	}
+}
+
+static std::vector<UniformGL> GetUniforms(ContextGL& context, GLuint program)
+{
+	const PFNGLGETUNIFORMFVPROC glGetUniformfv_ = GetFunction(context.glGetUniformfv_, "glGetUniformfv");
+	const PFNGLGETUNIFORMIVPROC glGetUniformiv_ = GetFunction(context.glGetUniformiv_, "glGetUniformiv");
+	const PFNGLGETUNIFORMUIVPROC glGetUniformuiv_ = GetFunction(context.glGetUniformuiv_, "glGetUniformuiv");
+
+	std::vector<UniformGL> uniforms;
+	ForEachUniform(context, program, [&](const std::string& name, GLenum type, GLint location)
+	{
+		UniformGL uniform { name, type, { } };
+		switch (GetUniformKind(type))
+		{
+		case UniformKind::Float:
+			glGetUniformfv_(program, location, (GLfloat*)uniform.value);
+			break;
+		case UniformKind::Int:
+			glGetUniformiv_(program, location, uniform.value);
+			break;
+		case UniformKind::Uint:
+			if (!glGetUniformuiv_)
+			{
+				return;
+			}
+			glGetUniformuiv_(program, location, (GLuint*)uniform.value);
+			break;
+		case UniformKind::Unsupported:
+			return;
+		}
+		uniforms.push_back(std::move(uniform));
+	});
+	return uniforms;
+}
+
+static void SetUniform(ContextGL& context, GLuint program, GLint location, const UniformGL& uniform)
+{
+	const GLfloat* f = (const GLfloat*)uniform.value;
+	const GLint* i = uniform.value;
+	const GLuint* u = (const GLuint*)uniform.value;
+	switch (uniform.type)
+	{
+	#define VECTOR(type, function, value) \
+	case type: \
+		if (auto function##_ = GetFunction(context.function##_, #function)) \
+			function##_(program, location, 1, value); \
+		break;
+	#define MATRIX(type, function) \
+	case type: \
+		if (auto function##_ = GetFunction(context.function##_, #function)) \
+			function##_(program, location, 1, GL_FALSE, f); \
+		break;
+	VECTOR(GL_FLOAT, glProgramUniform1fv, f)
+	VECTOR(GL_FLOAT_VEC2, glProgramUniform2fv, f)
+	VECTOR(GL_FLOAT_VEC3, glProgramUniform3fv, f)
+	VECTOR(GL_FLOAT_VEC4, glProgramUniform4fv, f)
+	VECTOR(GL_INT_VEC2, glProgramUniform2iv, i)
+	VECTOR(GL_INT_VEC3, glProgramUniform3iv, i)
+	VECTOR(GL_INT_VEC4, glProgramUniform4iv, i)
+	VECTOR(GL_BOOL_VEC2, glProgramUniform2iv, i)
+	VECTOR(GL_BOOL_VEC3, glProgramUniform3iv, i)
+	VECTOR(GL_BOOL_VEC4, glProgramUniform4iv, i)
+	VECTOR(GL_UNSIGNED_INT, glProgramUniform1uiv, u)
+	VECTOR(GL_UNSIGNED_INT_VEC2, glProgramUniform2uiv, u)
+	VECTOR(GL_UNSIGNED_INT_VEC3, glProgramUniform3uiv, u)
+	VECTOR(GL_UNSIGNED_INT_VEC4, glProgramUniform4uiv, u)
+	MATRIX(GL_FLOAT_MAT2, glProgramUniformMatrix2fv)
+	MATRIX(GL_FLOAT_MAT3, glProgramUniformMatrix3fv)
+	MATRIX(GL_FLOAT_MAT4, glProgramUniformMatrix4fv)
+	MATRIX(GL_FLOAT_MAT2x3, glProgramUniformMatrix2x3fv)
+	MATRIX(GL_FLOAT_MAT3x2, glProgramUniformMatrix3x2fv)
+	MATRIX(GL_FLOAT_MAT2x4, glProgramUniformMatrix2x4fv)
+	MATRIX(GL_FLOAT_MAT4x2, glProgramUniformMatrix4x2fv)
+	MATRIX(GL_FLOAT_MAT3x4, glProgramUniformMatrix3x4fv)
+	MATRIX(GL_FLOAT_MAT4x3, glProgramUniformMatrix4x3fv)
+	#undef VECTOR
+	#undef MATRIX
+	default:
+		// int, bool and every sampler and image type
+		if (GetUniformKind(uniform.type) == UniformKind::Int)
+		{
+			if (auto glProgramUniform1iv_ = GetFunction(context.glProgramUniform1iv_, "glProgramUniform1iv"))
+			{
+				glProgramUniform1iv_(program, location, 1, i);
+			}
+		}
+		break;
+	}
+}
+
+static void SetUniforms(ContextGL& context, GLuint program, const std::vector<UniformGL>& uniforms)
+{
+	// only uniforms which kept their name and type after the edit
+	ForEachUniform(context, program, [&](const std::string& name, GLenum type, GLint location)
+	{
+		for (const UniformGL& uniform : uniforms)
+		{
+			if (uniform.type == type && uniform.name == name)
+			{
+				SetUniform(context, program, location, uniform);
+				break;
+			}
+		}
+	});
+}
+
+// uniform block bindings by block name
+static std::vector<std::pair<std::string, GLint>> GetUniformBlockBindings(ContextGL& context, GLuint program)
+{
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = GetFunction(context.glGetProgramiv_, "glGetProgramiv");
+	const PFNGLGETACTIVEUNIFORMBLOCKIVPROC glGetActiveUniformBlockiv_ = GetFunction(context.glGetActiveUniformBlockiv_, "glGetActiveUniformBlockiv");
+	const PFNGLGETACTIVEUNIFORMBLOCKNAMEPROC glGetActiveUniformBlockName_ = GetFunction(context.glGetActiveUniformBlockName_, "glGetActiveUniformBlockName");
+
+	std::vector<std::pair<std::string, GLint>> bindings;
+	if (!glGetActiveUniformBlockiv_ || !glGetActiveUniformBlockName_)
+	{
+		return bindings;
+	}
+
+	GLint count = 0;
+	GLint max_length = 0;
+	glGetProgramiv_(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+	glGetProgramiv_(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_length);
+	std::vector<GLchar> buffer(max_length + 1);
+	for (GLint i = 0; i < count; i++)
+	{
+		GLsizei length = 0;
+		GLint binding = 0;
+		glGetActiveUniformBlockName_(program, i, buffer.size(), &length, buffer.data());
+		glGetActiveUniformBlockiv_(program, i, GL_UNIFORM_BLOCK_BINDING, &binding);
+		bindings.emplace_back(std::string(buffer.data(), length), binding);
+	}
+	return bindings;
+}
+
+static void SetUniformBlockBindings(ContextGL& context, GLuint program, const std::vector<std::pair<std::string, GLint>>& bindings)
+{
+	const PFNGLGETUNIFORMBLOCKINDEXPROC glGetUniformBlockIndex_ = GetFunction(context.glGetUniformBlockIndex_, "glGetUniformBlockIndex");
+	const PFNGLUNIFORMBLOCKBINDINGPROC glUniformBlockBinding_ = GetFunction(context.glUniformBlockBinding_, "glUniformBlockBinding");
+	if (!glGetUniformBlockIndex_ || !glUniformBlockBinding_)
+	{
+		return;
+	}
+	for (const auto& binding : bindings)
+	{
+		const GLuint index = glGetUniformBlockIndex_(program, binding.first.c_str());
+		if (index != GL_INVALID_INDEX)
+		{
+			glUniformBlockBinding_(program, index, binding.second);
+		}
+	}
+}
+
+// false when the new source does not compile, the shader and the programs using it
+// keep what they were compiled and linked with
+static bool ReloadShader(ContextGL& context, GLuint shader, const Mapping& contents, const GLSLSource& source)
+{
+	const GLSHADERSOURCEPROC glShaderSource_ = context.glShaderSource_.load(std::memory_order_acquire);
+	const GLCOMPILESHADERPROC glCompileShader_ = GetFunction(context.glCompileShader_, "glCompileShader");
+	const GLGETSHADERIVPROC glGetShaderiv_ = GetFunction(context.glGetShaderiv_, "glGetShaderiv");
+	const GLenum shader_type = context.shader_handle_to_type.Find(shader);
+	const char* shader_type_string = GetShaderTypeString(shader_type);
+
+	// a failed compile leaves the shader with the broken source, so the source is
+	// compiled into a scratch shader first
+	const GLchar* shader_data = source.text ? source.text->data() : (const GLchar*)contents.Data();
+	const GLint shader_size = source.text ? source.text->size() : contents.Size();
+	const GLuint scratch = context.glCreateShader_.load(std::memory_order_acquire)(shader_type);
+	glShaderSource_(scratch, 1, &shader_data, &shader_size);
+	glCompileShader_(scratch);
+	GLint status = GL_FALSE;
+	glGetShaderiv_(scratch, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE)
+	{
+		LogError("Failed to compile % shader \"%\", keeping the previous one\n%\n",
+			shader_type_string, shader, GetShaderInfoLog(context, scratch));
+		context.glDeleteShader_.load(std::memory_order_acquire)(scratch);
+		return false;
 	}
+	context.glDeleteShader_.load(std::memory_order_acquire)(scratch);
+
+	glShaderSource_(shader, 1, &shader_data, &shader_size);
+	glCompileShader_(shader);
+	Log("Reloaded % shader \"%\"\n", shader_type_string, shader);
+	return true;
 }
 
-static ContextGL& GetContext()
+static void RelinkProgram(ContextGL& context, GLuint program, const ProgramGL& state)
 {
-	// context has to leak on exit, _dl_fini will want to call our dlclose
-	// which depends on the context existing
-	static ContextGL* context_ = nullptr;
-	static std::once_flag once;
-	std::call_once(once, [](){ context_ = new ContextGL; });
-	return *context_;
+	const PFNGLCREATEPROGRAMPROC glCreateProgram_ = GetFunction(context.glCreateProgram_, "glCreateProgram");
+	const GLATTACHSHADERPROC glAttachShader_ = GetFunction(context.glAttachShader_, "glAttachShader");
+	const GLDELETEPROGRAMPROC glDeleteProgram_ = GetFunction(context.glDeleteProgram_, "glDeleteProgram");
+	const GLPROGRAMPARAMETERIPROC glProgramParameteri_ = GetFunction(context.glProgramParameteri_, "glProgramParameteri");
+	const GLGETPROGRAMIVPROC glGetProgramiv_ = GetFunction(context.glGetProgramiv_, "glGetProgramiv");
+	const GLLINKPROGRAMPROC glLinkProgram_ = context.glLinkProgram_.load(std::memory_order_acquire);
+
+	// a failed link loses what the program was linked with before, so the shaders are
+	// linked into a scratch program first
+	const GLuint scratch = glCreateProgram_();
+	for (GLuint shader : state.shaders)
+	{
+		glAttachShader_(scratch, shader);
+	}
+	if (state.separable && glProgramParameteri_)
+	{
+		glProgramParameteri_(scratch, GL_PROGRAM_SEPARABLE, GL_TRUE);
+	}
+	glLinkProgram_(scratch);
+	GLint status = GL_FALSE;
+	glGetProgramiv_(scratch, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE)
+	{
+		LogError("Failed to link program \"%\", keeping the previous one\n%\n", program, GetProgramInfoLog(context, scratch));
+		glDeleteProgram_(scratch);
+		return;
+	}
+	glDeleteProgram_(scratch);
+
+	const std::vector<UniformGL> uniforms = GetUniforms(context, program);
+	const auto bindings = GetUniformBlockBindings(context, program);
+	glLinkProgram_(program);
+	SetUniforms(context, program, uniforms);
+	SetUniformBlockBindings(context, program, bindings);
+	Log("Reloaded program \"%\"\n", program);
 }
 
-static const char* GetShaderExtensionString(GLenum shader_type)
+// hands edited replacements to every share group, each reloads them when one of its
+// contexts is current at a swap
+static void ShareChanges(ProcessGL& process)
 {
-	switch (shader_type)
+	std::vector<Replacement> changes = Store::Get().Changes();
+	std::lock_guard<std::mutex> lock(process.contexts_mutex_);
+	std::unordered_set<ShareGroupGL*> groups { process.default_->group_.get() };
+	for (const auto& context : process.contexts_)
 	{
-	case GL_VERTEX_SHADER:
-		return "_vs.glsl";
-	case GL_FRAGMENT_SHADER:
-		return "_fs.glsl";
-	case GL_COMPUTE_SHADER:
-		return "_cs.glsl";
-	case GL_GEOMETRY_SHADER:
-		return "_gs.glsl";
-	case GL_TESS_CONTROL_SHADER:
-		return "_tcs.glsl";
-	case GL_TESS_EVALUATION_SHADER:
-		return "_tes.glsl";
+		groups.insert(context.second->group_.get());
+	}
+	for (ShareGroupGL* group : groups)
+	{
+		// a file edited twice before the group reloads it is only reloaded once
+		std::lock_guard<std::mutex> group_lock(group->mutex_);
+		for (const Replacement& change : changes)
+		{
+			group->changes_.erase(std::remove_if(group->changes_.begin(), group->changes_.end(), [&](const Replacement& pending)
+			{
+				return pending.hash == change.hash && pending.suffix == change.suffix;
+			}), group->changes_.end());
+			group->changes_.push_back(change);
+		}
 	}
-	return "<unknown>";
 }
 
-static const char* GetShaderTypeString(GLenum shader_type)
+static void ApplyChanges(ContextGL& context)
 {
-	switch (shader_type)
+	std::vector<Replacement> changes;
 	{
-	case GL_VERTEX_SHADER:
-		return "vertex";
-	case GL_FRAGMENT_SHADER:
-		return "fragment";
-	case GL_COMPUTE_SHADER:
-		return "compute";
-	case GL_GEOMETRY_SHADER:
-		return "geometry";
-	case GL_TESS_CONTROL_SHADER:
-		return "tessellation control";
-	case GL_TESS_EVALUATION_SHADER:
-		return "tessellation evaluation";
+		std::lock_guard<std::mutex> lock(context.group_->mutex_);
+		changes.swap(context.group_->changes_);
+	}
+	if (changes.empty())
+	{
+		return;
+	}
+
+	if (!GetFunction(context.glCompileShader_, "glCompileShader")
+	 || !GetFunction(context.glGetShaderiv_, "glGetShaderiv")
+	 || !GetFunction(context.glGetShaderInfoLog_, "glGetShaderInfoLog")
+	 || !GetFunction(context.glGetProgramInfoLog_, "glGetProgramInfoLog")
+	 || !GetFunction(context.glCreateProgram_, "glCreateProgram")
+	 || !GetFunction(context.glAttachShader_, "glAttachShader")
+	 || !GetFunction(context.glDeleteProgram_, "glDeleteProgram")
+	 || !GetFunction(context.glGetProgramiv_, "glGetProgramiv")
+	 || !GetFunction(context.glGetUniformfv_, "glGetUniformfv")
+	 || !GetFunction(context.glGetUniformiv_, "glGetUniformiv")
+	 || !context.glCreateShader_.load(std::memory_order_acquire)
+	 || !context.glDeleteShader_.load(std::memory_order_acquire)
+	 || !context.glShaderSource_.load(std::memory_order_acquire)
+	 || !context.glLinkProgram_.load(std::memory_order_acquire))
+	{
+		LogError("Cannot reload shaders without the functions to compile and link them\n");
+		return;
+	}
+
+	std::vector<GLuint> reloaded;
+	for (const Replacement& replacement : changes)
+	{
+		// shaders named by the replacement which do not have its contents yet
+		const GLSLSource source = Preprocessor::Get().Process(replacement.contents->Data(), replacement.contents->Size());
+		std::vector<GLuint> shaders;
+		context.shader_handle_to_source.ForEach([&](GLuint shader, const ShaderGL& info)
+		{
+			if (info.name == replacement.hash && info.source != source.hash)
+			{
+				shaders.push_back(shader);
+			}
+		});
+
+		for (GLuint shader : shaders)
+		{
+			const GLenum shader_type = context.shader_handle_to_type.Find(shader);
+			if (replacement.suffix == GetShaderExtensionString(shader_type) && ReloadShader(context, shader, *replacement.contents, source))
+			{
+				context.shader_handle_to_source.Insert(shader, ShaderGL { replacement.hash, source.hash, source.text ? source.text->size() : replacement.contents->Size(), true });
+				reloaded.push_back(shader);
+			}
+		}
+	}
+
+	if (reloaded.empty())
+	{
+		return;
+	}
+
+	std::vector<std::pair<GLuint, ProgramGL>> programs;
+	context.program_handle_to_state.ForEach([&](GLuint program, const ProgramGL& state)
+	{
+		for (GLuint shader : state.shaders)
+		{
+			if (std::find(reloaded.begin(), reloaded.end(), shader) != reloaded.end())
+			{
+				programs.emplace_back(program, state);
+				break;
+			}
+		}
+	});
+	for (const auto& program : programs)
+	{
+		RelinkProgram(context, program.first, program.second);
 	}
-	return "<unknown>";
 }
 
-// Replacement OpenGL shader functions
-static GLuint CreateShader(GLenum shader_type)
+static void SwapBuffers(Display* display, GLXDrawable drawable)
 {
+	ProcessGL& process = GetProcess();
 	ContextGL& context = GetContext();
-	std::lock_guard<std::recursive_mutex> lock(context.mutex_);
-	GLuint result = context.glCreateShader_(shader_type);
-	if (result)
+	Store& store = Store::Get();
+
+	// between two frames nothing of the application is in flight on this thread
+	store.Watch();
+	if (store.Changed())
 	{
-		Log("Created % shader \"%\"\n", GetShaderTypeString(shader_type), result);
-		context.shader_handle_to_type.insert({ result, shader_type });
-		return result;
+		ShareChanges(process);
 	}
-	return 0;
+	ApplyChanges(context);
+	SavePrograms(context);
+	if (process.parallel_.enabled_.load(std::memory_order_relaxed))
+	{
+		VerifyParallel(context);
+	}
+	Profile& profile = Profile::Get();
+	if (profile.Enabled() && profile.Requested())
+	{
+		profile.Write();
+	}
+	process.glXSwapBuffers_.load(std::memory_order_acquire)(display, drawable);
 }
 
-static void DeleteShader(GLuint shader)
+// contexts, every one created through deshade gets functions and objects of its own
+// or of the context it shares with
+
+static void AddContext(GLXContext handle, GLXContext share_list)
 {
-	ContextGL& context = GetContext();
-	std::lock_guard<std::recursive_mutex> lock(context.mutex_);
-	auto find = context.shader_handle_to_type.find(shader);
-	if (find != context.shader_handle_to_type.end())
+	if (!handle)
+	{
+		return;
+	}
+
+	ProcessGL& process = GetProcess();
+	std::lock_guard<std::mutex> lock(process.contexts_mutex_);
+	std::shared_ptr<ShareGroupGL> group;
+	if (share_list)
+	{
+		// a context deshade did not see created shares the default's objects
+		auto find = process.contexts_.find(share_list);
+		group = find != process.contexts_.end() ? find->second->group_ : process.default_->group_;
+	}
+	else
+	{
+		group = std::make_shared<ShareGroupGL>();
+	}
+
+	// drivers hand out the same functions for every context most of the time, those
+	// looked up before the context existed are taken until it looks up its own
+	ContextGL* context = new ContextGL(std::move(group));
+	#define X(name, type, replacement, aliased) \
+		context->name##_.store(process.default_->name##_.load(std::memory_order_acquire), std::memory_order_relaxed);
+	GL_HOOKS(X)
+	#undef X
+
+	// a handle of a destroyed context may be handed out again
+	auto insert = process.contexts_.insert({ handle, context });
+	if (!insert.second)
 	{
-		Log("Deleted % shader \"%\"\n", GetShaderTypeString(find->second), shader);
-		context.shader_handle_to_type.erase(find);
+		ContextGL* previous = insert.first->second;
+		if (previous->current_)
+		{
+			previous->destroyed_ = true;
+		}
+		else
+		{
+			delete previous;
+		}
+		insert.first->second = context;
 	}
-	context.glDeleteShader_(shader);
+	Log("Created context % sharing with %\n", (void *)handle, (void *)share_list);
 }
 
-static void ShaderSource(GLuint shader, GLsizei count, const GLchar** string, const GLint* length)
+static void SetCurrent(GLXContext handle)
 {
-	ContextGL& context = GetContext();
-	std::lock_guard<std::recursive_mutex> lock(context.mutex_);
+	ProcessGL& process = GetProcess();
+	std::lock_guard<std::mutex> lock(process.contexts_mutex_);
+	ContextGL* context = nullptr;
+	if (handle)
+	{
+		auto find = process.contexts_.find(handle);
+		context = find != process.contexts_.end() ? find->second : nullptr;
+	}
 
-	GLenum shader_type = 0;
-	auto find = context.shader_handle_to_type.find(shader);
-	if (find != context.shader_handle_to_type.end())
+	ContextGL* previous = t_context;
+	if (context == previous)
 	{
-		shader_type = find->second;
+		return;
+	}
+	if (context)
+	{
+		context->current_++;
+	}
+	if (previous && !--previous->current_ && previous->destroyed_)
+	{
+		delete previous;
+	}
+	t_context = context;
+}
+
+static void RemoveContext(GLXContext handle)
+{
+	ProcessGL& process = GetProcess();
+	std::lock_guard<std::mutex> lock(process.contexts_mutex_);
+	auto find = process.contexts_.find(handle);
+	if (find == process.contexts_.end())
+	{
+		return;
 	}
-	const char* shader_type_string = GetShaderTypeString(shader_type);
 
-	// concatenate all shader source by default, we only ever call glShaderSource with count = 1
-	std::vector<char> source;
-	if (length) for (GLsizei i = 0; i < count; i++)
+	// like GLX, a context current on some thread goes once it is released there
+	ContextGL* context = find->second;
+	process.contexts_.erase(find);
+	if (context->current_)
 	{
-		source.insert(source.end(), string[i], string[i] + length[i]);
+		context->destroyed_ = true;
 	}
-	else for (GLsizei i = 0; i < count; i++)
+	else
 	{
-		source.insert(source.end(), string[i], string[i] + std::strlen(string[i]));
+		delete context;
 	}
+	Log("Destroyed context %\n", (void *)handle);
+}
 
-	// replace all \r in the text
-	source.erase(std::remove_if(source.begin(), source.end(), [](char ch) { return ch == '\r'; }), source.end());
+static GLXContext CreateContext(Display* display, XVisualInfo* visual, GLXContext share_list, Bool direct)
+{
+	GLXContext result = GetProcess().glXCreateContext_.load(std::memory_order_acquire)(display, visual, share_list, direct);
+	AddContext(result, share_list);
+	return result;
+}
 
-	// calculate hash
-	std::string hash = Hash128((const uint8_t *)source.data(), source.size());
+static GLXContext CreateNewContext(Display* display, GLXFBConfig config, int render_type, GLXContext share_list, Bool direct)
+{
+	GLXContext result = GetProcess().glXCreateNewContext_.load(std::memory_order_acquire)(display, config, render_type, share_list, direct);
+	AddContext(result, share_list);
+	return result;
+}
 
-	// construct string from contents
-	std::string contents;
+static GLXContext CreateContextAttribs(Display* display, GLXFBConfig config, GLXContext share_context, Bool direct, const int* attributes)
+{
+	GLXContext result = GetProcess().glXCreateContextAttribsARB_.load(std::memory_order_acquire)(display, config, share_context, direct, attributes);
+	AddContext(result, share_context);
+	return result;
+}
 
-	// check if a shader replacement exists
-	std::string file_name = "shaders/" + hash + GetShaderExtensionString(shader_type);
-	std::ifstream file_contents(file_name);
-	if (file_contents.is_open())
+static Bool MakeCurrent(Display* display, GLXDrawable drawable, GLXContext handle)
+{
+	Bool result = GetProcess().glXMakeCurrent_.load(std::memory_order_acquire)(display, drawable, handle);
+	if (result)
 	{
-		// construct string from replacement contents
-		Log("Replaced % shader \"%\"\n", shader_type_string, hash);
-		contents.assign((std::istreambuf_iterator<char>(file_contents)),
-		                 std::istreambuf_iterator<char>());
+		SetCurrent(handle);
 	}
-	else
+	return result;
+}
+
+static Bool MakeContextCurrent(Display* display, GLXDrawable draw, GLXDrawable read, GLXContext handle)
+{
+	Bool result = GetProcess().glXMakeContextCurrent_.load(std::memory_order_acquire)(display, draw, read, handle);
+	if (result)
 	{
-		// construct string from source contents
-		contents.assign(source.begin(), source.end());
+		SetCurrent(handle);
+	}
+	return result;
+}
+
+// whether handle is the context current on this thread
+static bool IsCurrent(GLXContext handle)
+{
+	ProcessGL& process = GetProcess();
+	std::lock_guard<std::mutex> lock(process.contexts_mutex_);
+	auto find = process.contexts_.find(handle);
+	return t_context && find != process.contexts_.end() && find->second == t_context;
+}
 
-		// write the contents to a file
-		std::ofstream file(file_name);
-		if (file.is_open())
+static void DestroyContext(Display* display, GLXContext handle)
+{
+	// the last chance to ask the driver about what is still to be saved
+	if (IsCurrent(handle))
+	{
+		SavePrograms(*t_context);
+		if (GetProcess().parallel_.enabled_.load(std::memory_order_relaxed))
 		{
-			file << contents;
-			Log("Dumpped % shader \"%\"\n", shader_type_string, hash);
+			VerifyParallel(*t_context);
 		}
 	}
-
-	// place the actual call
-	const GLchar* shader_data = (const GLchar*)contents.c_str();
-	const GLint shader_size = contents.size();
-	context.glShaderSource_(shader, 1, &shader_data, &shader_size);
-	Log("Source % shader \"%\"\n", shader_type_string, hash);
+	GetProcess().glXDestroyContext_.load(std::memory_order_acquire)(display, handle);
+	RemoveContext(handle);
 }
 
-static bool Match(const std::string& name, const char *match)
+// publishes function for the current context and for every other context which has
+// none yet
+template<typename T>
+static void PublishFunction(std::atomic<T> ContextGL::* function, T handle)
 {
-	if (name         == match) return true;
-	if (name + "ARB" == match) return true;
-	if (name + "EXT" == match) return true;
-	return false;
+	ProcessGL& process = GetProcess();
+	(GetContext().*function).store(handle, std::memory_order_release);
+
+	std::lock_guard<std::mutex> lock(process.contexts_mutex_);
+	T expected = nullptr;
+	(process.default_->*function).compare_exchange_strong(expected, handle, std::memory_order_acq_rel);
+	for (const auto& context : process.contexts_)
+	{
+		expected = nullptr;
+		(context.second->*function).compare_exchange_strong(expected, handle, std::memory_order_acq_rel);
+	}
 }
 
+// publishes the driver's function and returns the replacement for name, nullptr
+// when name is not hooked or the driver does not have it
 static void* ApplyReplacements(const char* name, void* handle)
 {
-	ContextGL& context = GetContext();
-	if (Match("glCreateShader", name))
-	{
-		*(void **)&context.glCreateShader_ = handle;
-		return (void *)&CreateShader;
-	}
-	if (Match("glDeleteShader", name))
+	const int index = handle ? k_hook_table.Find(name) : -1;
+	if (index < 0)
 	{
-		*(void **)&context.glDeleteShader_ = handle;
-		return (void *)&DeleteShader;
+		return nullptr;
 	}
-	if (Match("glShaderSource", name))
+
+	ProcessGL& process = GetProcess();
+	switch (k_hook_ids[index])
 	{
-		*(void **)&context.glShaderSource_ = handle;
-		return (void *)&ShaderSource;
+	#define X(name, type, replacement, aliased) \
+	case HookGL::name: \
+		PublishFunction(&ContextGL::name##_, (type)handle); \
+		return (void *)&replacement;
+	GL_HOOKS(X)
+	#undef X
+	#define X(name, type, replacement, aliased) \
+	case HookGL::name: \
+		process.name##_.store((type)handle, std::memory_order_release); \
+		return (void *)&replacement;
+	GLX_HOOKS(X)
+	#undef X
 	}
 	return nullptr;
 }
@@ -244,9 +2126,8 @@ static void* ApplyReplacements(const char* name, void* handle)
 static void* GetProcAddress(const GLubyte* symbol)
 {
 	const char *name = (const char *)symbol;
-	ContextGL& context = GetContext();
-	std::lock_guard<std::recursive_mutex> lock(context.mutex_);
-	void *result = (void *)context.glXGetProcAddress_(symbol);
+	ProcessGL& process = GetProcess();
+	void *result = (void *)process.glXGetProcAddress_.load(std::memory_order_acquire)(symbol);
 	void *replace = ApplyReplacements(name, result);
 	if (replace)
 	{
@@ -259,9 +2140,8 @@ static void* GetProcAddress(const GLubyte* symbol)
 static void* GetProcAddressARB(const GLubyte* symbol)
 {
 	const char *name = (const char *)symbol;
-	ContextGL& context = GetContext();
-	std::lock_guard<std::recursive_mutex> lock(context.mutex_);
-	void *result = (void *)context.glXGetProcAddressARB_(symbol);
+	ProcessGL& process = GetProcess();
+	void *result = (void *)process.glXGetProcAddressARB_.load(std::memory_order_acquire)(symbol);
 	void *replace = ApplyReplacements(name, result);
 	if (replace)
 	{
@@ -274,95 +2154,243 @@ static void* GetProcAddressARB(const GLubyte* symbol)
 // replace __glx_Main as an export
 extern "C" Bool __glx_Main(uint32_t version, const void *exports, void *vendor, void *imports)
 {
-	ContextGL& context = GetContext();
-	std::lock_guard<std::recursive_mutex> lock(context.mutex_);
+	ProcessGL& process = GetProcess();
 
-	Bool result = context.glx_Main_(version, exports, vendor, imports);
+	Bool result = process.glx_Main_.load(std::memory_order_acquire)(version, exports, vendor, imports);
 
 	// __glx_Main import table is not worth changing, we can just fetch the new ones
 	// after we enter here because this will be called from inside libGLX_{vendor}.so only
-	*(void **)&context.glXGetProcAddress_    = context.dlsym_(RTLD_NEXT, "glXGetProcAddress");
-	*(void **)&context.glXGetProcAddressARB_ = context.dlsym_(RTLD_NEXT, "glXGetProcAddressARB");
+	void* get_proc_address     = process.dlsym_(RTLD_NEXT, "glXGetProcAddress");
+	void* get_proc_address_arb = process.dlsym_(RTLD_NEXT, "glXGetProcAddressARB");
+	process.glXGetProcAddress_.store((GLXGETPROCADDRESSPROC)get_proc_address, std::memory_order_release);
+	process.glXGetProcAddressARB_.store((GLXGETPROCADDRESSPROC)get_proc_address_arb, std::memory_order_release);
 
 	Log("Intercepted: \"glXGetProcAddress\" % /* replaced with % */\n",
-		*(void **)&context.glXGetProcAddress_, (void *)&GetProcAddress);
+		get_proc_address, (void *)&GetProcAddress);
 
 	Log("Intercepted: \"glXGetProcAddressARB\" % /* replaced with % */\n",
-		*(void **)&context.glXGetProcAddressARB_, (void *)&GetProcAddressARB);
+		get_proc_address_arb, (void *)&GetProcAddressARB);
 
 	return result;
 }
 
-// replace loader incase the application dlopen's and fetches GL functions this way
-extern "C" void* dlsym(void* handle, const char* symbol)
+// may say yes for a name that only shares a hash, never no for one we intercept
+static bool MaybeIntercepted(const char* symbol)
 {
-	ContextGL& context = GetContext();
-	std::string name = "<unknown>";
-	context.mutex_.lock();
-	auto find = context.object_handle_to_name.find(handle);
-	if (find != context.object_handle_to_name.end())
+	switch (HashName(symbol))
 	{
-		name = find->second;
+	case HashName("__glx_Main"):
+	case HashName("glXGetProcAddress"):
+	case HashName("glXGetProcAddressARB"):
+	case HashName("glXSwapBuffers"):
+	case HashName("glXCreateContext"):
+	case HashName("glXCreateNewContext"):
+	case HashName("glXCreateContextAttribsARB"):
+	case HashName("glXMakeCurrent"):
+	case HashName("glXMakeContextCurrent"):
+	case HashName("glXDestroyContext"):
+		return true;
 	}
-	context.mutex_.unlock();
-	void *result = context.dlsym_(handle, symbol);
-	bool valid_name = true;
-	if (handle == RTLD_NEXT || handle == RTLD_DEFAULT)
+	return false;
+}
+
+// only looked up to be logged
+static std::string GetHandleName(ProcessGL& process, void* handle)
+{
+	if (handle == RTLD_DEFAULT)
+	{
+		return "RTLD_DEFAULT";
+	}
+	if (handle == RTLD_NEXT)
+	{
+		return "RTLD_NEXT";
+	}
+	return process.object_handle_to_name.Find(handle);
+}
+
+// the real dlopen resolves $ORIGIN relative to the object it returns to, which is
+// deshade, so it is expanded for the caller here
+static struct link_map* CallerMap(const void* caller)
+{
+	Dl_info info;
+	struct link_map* map = nullptr;
+	if (!dladdr1(caller, &info, (void**)&map, RTLD_DL_LINKMAP))
+	{
+		return nullptr;
+	}
+	return map;
+}
+
+// name with $ORIGIN and ${ORIGIN} replaced by the directory of the object of caller
+static std::string ExpandOrigin(const void* caller, const char* name)
+{
+	const struct link_map* map = CallerMap(caller);
+	std::string origin;
+	if (map && map->l_name && *map->l_name)
 	{
-		if (handle == RTLD_DEFAULT)
+		origin = map->l_name;
+	}
+	else
+	{
+		// the executable has no name in its map
+		char path[4096];
+		const ssize_t length = readlink("/proc/self/exe", path, sizeof path);
+		origin.assign(path, length > 0 ? length : 0);
+	}
+	const size_t slash = origin.rfind('/');
+	origin.resize(slash == std::string::npos ? 0 : slash);
+
+	std::string expanded;
+	for (const char* p = name; *p; )
+	{
+		if (!strncmp(p, "$ORIGIN", 7))
 		{
-			name = "RTLD_DEFAULT";
+			expanded += origin;
+			p += 7;
 		}
-		else if (handle == RTLD_NEXT)
+		else if (!strncmp(p, "${ORIGIN}", 9))
 		{
-			name = "RTLD_NEXT";
+			expanded += origin;
+			p += 9;
 		}
+		else
+		{
+			expanded += *p++;
+		}
+	}
+	return expanded;
+}
 
-		Log("Forwarding: dlsym(%, \"%\") = %\n", name, symbol, result);
-
-		valid_name = false;
+static void* ForwardOpen(ProcessGL& process, const void* caller, const char* name, int flags)
+{
+	if (name && strstr(name, "ORIGIN"))
+	{
+		return process.dlopen_(ExpandOrigin(caller, name).c_str(), flags);
 	}
+	return process.dlopen_(name, flags);
+}
 
+// symbols deshade replaces and lookups logged with their result, RTLD_NEXT resolves
+// relative to deshade here which finds the definition deshade itself is in front of
+static void* InterceptSymbol(void* handle, const char* symbol)
+{
+	ProcessGL& process = GetProcess();
+	void *result = process.dlsym_(handle, symbol);
+	void *replace = nullptr;
 	if (!strcmp(symbol, "__glx_Main"))
 	{
 		// replace __glx_Main with our own if we're using glvnd
-		std::lock_guard<std::recursive_mutex> lock(context.mutex_);
-		*(void **)&context.glx_Main_ = result;
-		void *replace = (void *)&__glx_Main;
-		Log("Intercepted: dlsym(% /* % */, \"%\") = % /* replaced with % */\n", handle, name, symbol, result, replace);
-		return replace;
+		process.glx_Main_.store((GLXMAINPROC)result, std::memory_order_release);
+		replace = (void *)&__glx_Main;
 	}
 	else if (!strcmp(symbol, "glXGetProcAddress"))
 	{
 		// replace glXGetProcAddress with our wrapper
-		std::lock_guard<std::recursive_mutex> lock(context.mutex_);
-		*(void **)&context.glXGetProcAddress_ = result;
-		void *replace = (void *)&GetProcAddress;
-		Log("Intercepted: dlsym(% /* % */, \"%\") = % /* replaced with % */\n", handle, name, symbol, result, replace);
-		return replace;
+		process.glXGetProcAddress_.store((GLXGETPROCADDRESSPROC)result, std::memory_order_release);
+		replace = (void *)&GetProcAddress;
 	}
 	else if (!strcmp(symbol, "glXGetProcAddressARB"))
 	{
 		// replace glXGetProcAddressARB with our wrapper
-		std::lock_guard<std::recursive_mutex> lock(context.mutex_);
-		*(void **)&context.glXGetProcAddressARB_ = result;
-		void *replace = (void *)&GetProcAddressARB;
-		Log("Intercepted: dlsym(% /* % */, \"%\") = % /* replaced with % */\n", handle, name, symbol, result, replace);
+		process.glXGetProcAddressARB_.store((GLXGETPROCADDRESSPROC)result, std::memory_order_release);
+		replace = (void *)&GetProcAddressARB;
+	}
+	else if (!strncmp(symbol, "glX", 3))
+	{
+		// replace glXSwapBuffers to apply edited shaders between frames and the context
+		// functions to follow which context is current
+		replace = ApplyReplacements(symbol, result);
+	}
+
+	if (replace)
+	{
+		Log("Intercepted: dlsym(% /* % */, \"%\") = % /* replaced with % */\n",
+			handle, GetHandleName(process, handle), symbol, result, replace);
 		return replace;
 	}
 
-	if (valid_name)
+	if (handle == RTLD_NEXT || handle == RTLD_DEFAULT)
 	{
-		Log("Forwarding: dlsym(% /* % */, \"%\") = %\n", handle, name, symbol, result);
+		LogTrace("Forwarding: dlsym(%, \"%\") = %\n", GetHandleName(process, handle), symbol, result);
+	}
+	else
+	{
+		LogTrace("Forwarding: dlsym(% /* % */, \"%\") = %\n", handle, GetHandleName(process, handle), symbol, result);
 	}
 
 	return result;
 }
 
+// the function dlsym jumps to with its arguments untouched, the real dlsym unless the
+// symbol is replaced or logged, so that RTLD_NEXT keeps resolving relative to the
+// object dlsym was called from
+typedef void* (*DLSYMPROC)(void*, const char*);
+extern "C" __attribute__((visibility("hidden"), used)) DLSYMPROC deshade_dlsym_target(void* handle, const char* symbol)
+{
+	ProcessGL& process = GetProcess();
+	if (MaybeIntercepted(symbol))
+	{
+		return &InterceptSymbol;
+	}
+	if (!Logger::Get().Enabled(LogLevel::Trace))
+	{
+		return process.dlsym_;
+	}
+
+	// the result of the caller's RTLD_NEXT is only known to the caller
+	if (handle == RTLD_NEXT)
+	{
+		LogTrace("Forwarding: dlsym(RTLD_NEXT, \"%\")\n", symbol);
+		return process.dlsym_;
+	}
+	return &InterceptSymbol;
+}
+
+// replace loader incase the application dlopen's and fetches GL functions this way,
+// the real dlsym is always reached with a jump so it sees the caller's return address
+#if defined(__x86_64__)
+#if defined(__CET__) && (__CET__ & 1)
+#define DESHADE_ENDBR "	endbr64\n"
+#else
+#define DESHADE_ENDBR
+#endif
+__asm__(
+	"	.text\n"
+	"	.globl dlsym\n"
+	"	.type dlsym, @function\n"
+	"dlsym:\n"
+	DESHADE_ENDBR
+	"	push %rdi\n"
+	"	push %rsi\n"
+	"	sub $8, %rsp\n"
+	"	call deshade_dlsym_target\n"
+	"	add $8, %rsp\n"
+	"	pop %rsi\n"
+	"	pop %rdi\n"
+	"	jmp *%rax\n"
+	"	.size dlsym, .-dlsym\n"
+);
+#undef DESHADE_ENDBR
+#else
+// elsewhere this relies on the compiler turning the call into a jump
+extern "C" void* dlsym(void* handle, const char* symbol)
+{
+	return deshade_dlsym_target(handle, symbol)(handle, symbol);
+}
+#endif
+
 extern "C" void* dlopen(const char* name, int flags)
 {
-	ContextGL& context = GetContext();
-	void *result = context.dlopen_(name, flags);
+	ProcessGL& process = GetProcess();
+	const void* caller = __builtin_return_address(0);
+
+	// handle names only matter to trace logging
+	if (!Logger::Get().Enabled(LogLevel::Trace))
+	{
+		return ForwardOpen(process, caller, name, flags);
+	}
+
+	void *result = ForwardOpen(process, caller, name, flags);
 	const char *safe_name = name;
 	if (name == RTLD_NEXT || name == RTLD_DEFAULT)
 	{
@@ -374,55 +2402,56 @@ extern "C" void* dlopen(const char* name, int flags)
 		{
 			safe_name = "RTLD_NEXT";
 		}
-		Log("Forwarding: dlopen(%, %) = %\n", safe_name, flags, result);
+		LogTrace("Forwarding: dlopen(%, %) = %\n", safe_name, flags, result);
 	}
 	else
 	{
-		Log("Forwarding: dlopen(\"%\", %) = %\n", safe_name, flags, result);
+		LogTrace("Forwarding: dlopen(\"%\", %) = %\n", safe_name, flags, result);
 	}
 	if (result)
 	{
-		context.mutex_.lock();
-		context.object_handle_to_name.insert({ result, safe_name });
-		context.mutex_.unlock();
+		process.object_handle_to_name.Insert(result, safe_name);
 	}
 	return result;
 }
 
 extern "C" int dlclose(void* handle)
 {
-	ContextGL& context = GetContext();
-	context.mutex_.lock();
-	auto find = context.object_handle_to_name.find(handle);
-	std::string name = "<unknown>";
-	if (find != context.object_handle_to_name.end())
+	ProcessGL& process = GetProcess();
+	if (!Logger::Get().Enabled(LogLevel::Trace))
 	{
-		name = find->second;
-		context.object_handle_to_name.erase(handle);
+		return process.dlclose_(handle);
 	}
-	context.mutex_.unlock();
-	int result = context.dlclose_(handle);
-	Log("Forwarding: dlclose(% /* % */) = %\n", handle, name, result);
+
+	std::string name = process.object_handle_to_name.Erase(handle);
+	int result = process.dlclose_(handle);
+	LogTrace("Forwarding: dlclose(% /* % */) = %\n", handle, name, result);
 	return result;
 }
 
 static void ReplaceExport(bool ARB)
 {
-	ContextGL& context = GetContext();
-	context.mutex_.lock();
-	if (!ARB && !context.glXGetProcAddress_)
+	// only the first lookup is published, __glx_Main or dlsym may already have one
+	ProcessGL& process = GetProcess();
+	GLXGETPROCADDRESSPROC expected = nullptr;
+	if (!ARB)
 	{
-		*(void **)&context.glXGetProcAddress_ = context.dlsym_(RTLD_NEXT, "glXGetProcAddress");
-		Log("Intercepted: \"glXGetProcAddress\" % /* replaced with % */ \n",
-			*(void**&)context.glXGetProcAddress_, (void *)&GetProcAddress);
+		void* result = process.dlsym_(RTLD_NEXT, "glXGetProcAddress");
+		if (process.glXGetProcAddress_.compare_exchange_strong(expected, (GLXGETPROCADDRESSPROC)result))
+		{
+			Log("Intercepted: \"glXGetProcAddress\" % /* replaced with % */ \n",
+				result, (void *)&GetProcAddress);
+		}
 	}
-	else if (ARB && !context.glXGetProcAddressARB_)
+	else
 	{
-		*(void **)&context.glXGetProcAddressARB_ = context.dlsym_(RTLD_NEXT, "glXGetProcAddressARB");
-		Log("Intercepted: \"glXGetProcAddressARB\" % /* replaced with % */\n",
-			*(void **)&context.glXGetProcAddressARB_, (void *)&GetProcAddressARB);
+		void* result = process.dlsym_(RTLD_NEXT, "glXGetProcAddressARB");
+		if (process.glXGetProcAddressARB_.compare_exchange_strong(expected, (GLXGETPROCADDRESSPROC)result))
+		{
+			Log("Intercepted: \"glXGetProcAddressARB\" % /* replaced with % */\n",
+				result, (void *)&GetProcAddressARB);
+		}
 	}
-	context.mutex_.unlock();
 }
 
 // replace glXGetProcAddress export with our wrapper
@@ -440,3 +2469,57 @@ extern "C" void (*glXGetProcAddressARB(const GLubyte* symbol))()
 	std::call_once(once, [](){ReplaceExport(true);});
 	return (void (*)())GetProcAddressARB(symbol);
 }
+
+// the driver's function behind one of our exports
+template<typename T>
+static T GetNext(std::atomic<T>& function, const char* name)
+{
+	T result = function.load(std::memory_order_acquire);
+	if (!result)
+	{
+		T expected = nullptr;
+		result = (T)GetProcess().dlsym_(RTLD_NEXT, name);
+		if (!function.compare_exchange_strong(expected, result))
+		{
+			result = expected;
+		}
+	}
+	return result;
+}
+
+// replace the GLX exports for applications linked with libGL
+extern "C" void glXSwapBuffers(Display* display, GLXDrawable drawable)
+{
+	GetNext(GetProcess().glXSwapBuffers_, "glXSwapBuffers");
+	SwapBuffers(display, drawable);
+}
+
+extern "C" GLXContext glXCreateContext(Display* display, XVisualInfo* visual, GLXContext share_list, Bool direct)
+{
+	GetNext(GetProcess().glXCreateContext_, "glXCreateContext");
+	return CreateContext(display, visual, share_list, direct);
+}
+
+extern "C" GLXContext glXCreateNewContext(Display* display, GLXFBConfig config, int render_type, GLXContext share_list, Bool direct)
+{
+	GetNext(GetProcess().glXCreateNewContext_, "glXCreateNewContext");
+	return CreateNewContext(display, config, render_type, share_list, direct);
+}
+
+extern "C" Bool glXMakeCurrent(Display* display, GLXDrawable drawable, GLXContext context)
+{
+	GetNext(GetProcess().glXMakeCurrent_, "glXMakeCurrent");
+	return MakeCurrent(display, drawable, context);
+}
+
+extern "C" Bool glXMakeContextCurrent(Display* display, GLXDrawable draw, GLXDrawable read, GLXContext context)
+{
+	GetNext(GetProcess().glXMakeContextCurrent_, "glXMakeContextCurrent");
+	return MakeContextCurrent(display, draw, read, context);
+}
+
+extern "C" void glXDestroyContext(Display* display, GLXContext context)
+{
+	GetNext(GetProcess().glXDestroyContext_, "glXDestroyContext");
+	DestroyContext(display, context);
+}
@@ -0,0 +1,339 @@
+#include <cstdio> // std::snprintf
+#include <cstdlib> // std::getenv
+#include <cstring> // std::memchr, std::strncmp
+#include <algorithm> // std::find, std::count
+
+extern "C"
+{
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include "glsl.h"
+#include "log.h"
+
+static const char* k_include_directory = "shaders/include/";
+
+// includes nested deeper than this are most likely a cycle through different names
+static const size_t k_include_depth = 32;
+
+// bytes of preprocessed text kept, least recently used results go first
+static const size_t k_results_size = (size_t)32 << 20;
+
+Hash GetCompiledKey(const Hash& source, uint32_t shader_type)
+{
+	Hasher hasher;
+	hasher.Update(&source, sizeof source);
+	hasher.Update(&shader_type, sizeof shader_type);
+	return hasher.Final();
+}
+
+Preprocessor& Preprocessor::Get()
+{
+	// leaks on exit like the store, shaders may still be created while exiting
+	static Preprocessor* preprocessor = new Preprocessor;
+	return *preprocessor;
+}
+
+Preprocessor::Preprocessor()
+	: minify_ { false }
+	, cached_ { 0 }
+{
+	const char* minify = std::getenv("DESHADE_MINIFY");
+	minify_ = minify && *minify == '1';
+}
+
+static bool ReadFile(const std::string& file_name, std::string& contents)
+{
+	const int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat info;
+	bool result = fstat(fd, &info) == 0;
+	if (result)
+	{
+		contents.resize(info.st_size);
+		size_t offset = 0;
+		while (offset < contents.size())
+		{
+			const ssize_t count = read(fd, &contents[offset], contents.size() - offset);
+			if (count <= 0)
+			{
+				break;
+			}
+			offset += count;
+		}
+		contents.resize(offset);
+	}
+
+	close(fd);
+	return result;
+}
+
+std::shared_ptr<const std::string> Preprocessor::Include(const std::string& name)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto find = includes_.find(name);
+		if (find != includes_.end())
+		{
+			return find->second;
+		}
+	}
+
+	// read outside of the lock, whoever inserts first wins
+	std::shared_ptr<const std::string> include;
+	std::string contents;
+	if (ReadFile(k_include_directory + name, contents))
+	{
+		include = std::make_shared<const std::string>(std::move(contents));
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto insert = includes_.insert({ name, include });
+	if (insert.second)
+	{
+		if (include)
+		{
+			Log("Loaded include \"%\" with % bytes\n", name, include->size());
+		}
+		else
+		{
+			LogError("Failed to read include \"%\"\n", k_include_directory + name);
+		}
+	}
+	return insert.first->second;
+}
+
+static bool IsSpace(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
+// name of an #include directive on the line, empty when there is none
+static std::string GetIncludeName(const char* line, const char* end)
+{
+	while (line < end && IsSpace(*line))
+	{
+		line++;
+	}
+	if (line == end || *line++ != '#')
+	{
+		return { };
+	}
+	while (line < end && IsSpace(*line))
+	{
+		line++;
+	}
+	const size_t length = sizeof "include" - 1;
+	if ((size_t)(end - line) < length || std::strncmp(line, "include", length))
+	{
+		return { };
+	}
+	line += length;
+	while (line < end && IsSpace(*line))
+	{
+		line++;
+	}
+	if (line == end || (*line != '"' && *line != '<'))
+	{
+		return { };
+	}
+	const char close = *line++ == '"' ? '"' : '>';
+	const char* name_end = (const char*)std::memchr(line, close, end - line);
+	return name_end ? std::string(line, name_end) : std::string();
+}
+
+// a #line directive which starts a line and ends it
+static std::string LineDirective(size_t line, int source)
+{
+	char directive[64];
+	std::snprintf(directive, sizeof directive, "\n#line %zu %d\n", line, source);
+	return directive;
+}
+
+// appends spans of data with its includes expanded, false when nothing was included,
+// each include is numbered as a source string of its own so that the driver reports
+// errors against the lines of the file they are in
+bool Preprocessor::Expand(const char* data, size_t size, int source, Expansion& expansion)
+{
+	std::vector<Span>& spans = expansion.spans;
+	std::vector<std::string>& stack = expansion.stack;
+
+	bool included = false;
+	const char* end = data + size;
+	const char* copied = data;
+	size_t number = 0;
+	for (const char* line = data; line < end; )
+	{
+		const char* newline = (const char*)std::memchr(line, '\n', end - line);
+		const char* line_end = newline ? newline : end;
+		const char* next = newline ? newline + 1 : end;
+		number++;
+
+		// directives are rare, only lines with a # are looked at
+		const std::string name = std::memchr(line, '#', line_end - line) ? GetIncludeName(line, line_end) : std::string();
+		if (name.empty())
+		{
+			line = next;
+			continue;
+		}
+
+		std::shared_ptr<const std::string> include = Include(name);
+		if (!include)
+		{
+			// left for the driver, it may know the name through ARB_shading_language_include
+			line = next;
+			continue;
+		}
+		if (stack.size() >= k_include_depth || std::find(stack.begin(), stack.end(), name) != stack.end())
+		{
+			LogError("Recursive include \"%\"\n", name);
+			line = next;
+			continue;
+		}
+
+		// the line before the include already ended, the leading newline is skipped
+		const int include_source = ++expansion.sources;
+		LogTrace("Including \"%\" as source string %\n", name, include_source);
+		expansion.lines.push_back(LineDirective(1, include_source));
+		spans.push_back(Span { copied, (size_t)(line - copied) });
+		spans.push_back(Span { expansion.lines.back().data() + 1, expansion.lines.back().size() - 1 });
+		stack.push_back(name);
+		Expand(include->data(), include->size(), include_source, expansion);
+		stack.pop_back();
+		expansion.lines.push_back(LineDirective(number + 1, source));
+		spans.push_back(Span { expansion.lines.back().data(), expansion.lines.back().size() });
+		copied = line = next;
+		included = true;
+	}
+	spans.push_back(Span { copied, (size_t)(end - copied) });
+	return included;
+}
+
+// comments become a single space and runs of whitespace collapse into one, every
+// newline is kept so that directives stay intact and the driver reports the same line
+// numbers, those inside a block comment follow the line the comment ends on
+static std::string Minify(const std::string& source)
+{
+	std::string result;
+	result.reserve(source.size());
+	bool line_start = true;
+	bool space = false;
+	size_t newlines = 0;
+	for (size_t i = 0; i < source.size(); i++)
+	{
+		const char ch = source[i];
+		const char next = i + 1 < source.size() ? source[i + 1] : '\0';
+		if (ch == '/' && next == '/')
+		{
+			const size_t newline = source.find('\n', i);
+			i = (newline == std::string::npos ? source.size() : newline) - 1;
+			continue;
+		}
+		if (ch == '/' && next == '*')
+		{
+			const size_t close = source.find("*/", i + 2);
+			const size_t end = close == std::string::npos ? source.size() : close + 2;
+			newlines += std::count(source.begin() + i, source.begin() + end, '\n');
+			i = end - 1;
+			space = true;
+			continue;
+		}
+		if (IsSpace(ch))
+		{
+			space = true;
+			continue;
+		}
+		if (ch == '\n')
+		{
+			result.append(newlines + 1, '\n');
+			newlines = 0;
+			line_start = true;
+			space = false;
+			continue;
+		}
+		if (space && !line_start)
+		{
+			result += ' ';
+		}
+		space = false;
+		line_start = false;
+		result += ch;
+		// a line continued with a backslash stays continued
+		if (ch == '\\' && next == '\n')
+		{
+			result += '\n';
+			i++;
+		}
+	}
+	result.append(newlines, '\n');
+	return result;
+}
+
+GLSLSource Preprocessor::Process(const void* data, size_t size)
+{
+	Expansion expansion;
+	expansion.sources = 0;
+	const bool included = Expand((const char*)data, size, 0, expansion);
+	const std::vector<Span>& spans = expansion.spans;
+
+	Hasher hasher;
+	for (const Span& span : spans)
+	{
+		hasher.Update(span.data, span.size);
+	}
+	GLSLSource result { hasher.Final(), nullptr };
+	if (!included && !minify_)
+	{
+		return result;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto find = results_.find(result.hash);
+		if (find != results_.end())
+		{
+			lru_.splice(lru_.begin(), lru_, find->second.lru);
+			result.text = find->second.text;
+			return result;
+		}
+	}
+
+	std::string text;
+	for (const Span& span : spans)
+	{
+		text.append(span.data, span.size);
+	}
+	if (minify_)
+	{
+		const size_t expanded = text.size();
+		text = Minify(text);
+		Log("Minified \"%\" from % to % bytes\n", result.hash, expanded, text.size());
+	}
+
+	// processed outside of the lock, whoever inserts first wins
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto insert = results_.insert({ result.hash, Result { std::make_shared<const std::string>(std::move(text)), lru_.end() } });
+	result.text = insert.first->second.text;
+	if (!insert.second)
+	{
+		return result;
+	}
+	insert.first->second.lru = lru_.insert(lru_.begin(), result.hash);
+	cached_ += result.text->size();
+
+	// whoever still holds an evicted result keeps it alive
+	while (cached_ > k_results_size && lru_.size() > 1)
+	{
+		auto find = results_.find(lru_.back());
+		cached_ -= find->second.text->size();
+		results_.erase(find);
+		lru_.pop_back();
+	}
+	return result;
+}
@@ -0,0 +1,78 @@
+#ifndef GLSL_H
+#define GLSL_H
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "hash.h"
+
+// replacement source after preprocessing
+struct GLSLSource
+{
+	// of the file followed by everything it includes in order with the #line
+	// directives around it, the same as Hash128 of the file when it includes nothing
+	Hash hash;
+	// nullptr when the file is forwarded as it is
+	std::shared_ptr<const std::string> text;
+};
+
+// what DESHADE_PARALLEL=1 remembers a compiled shader by, a source which compiles as
+// one type of shader need not compile as another
+Hash GetCompiledKey(const Hash& source, uint32_t shader_type);
+
+// resolves #include "name" and #include <name> in replacement files against the
+// shaders/include directory and strips comments and redundant whitespace when
+// DESHADE_MINIFY=1, every include is read once and the most recent results are
+// kept by hash
+struct Preprocessor
+{
+	static Preprocessor& Get();
+
+	GLSLSource Process(const void* data, size_t size);
+
+private:
+	Preprocessor();
+
+	// a run of source text, either of the file or of an include
+	struct Span
+	{
+		const char* data;
+		size_t size;
+	};
+
+	// state of one Process
+	struct Expansion
+	{
+		std::vector<Span> spans;
+		std::vector<std::string> stack;
+		// #line directives spans point into, a list so that they never move and
+		// nothing is allocated without includes
+		std::list<std::string> lines;
+		// source string numbers handed out to includes, the file itself is 0
+		int sources;
+	};
+
+	struct Result
+	{
+		std::shared_ptr<const std::string> text;
+		std::list<Hash>::iterator lru;
+	};
+
+	std::shared_ptr<const std::string> Include(const std::string& name);
+	bool Expand(const char* data, size_t size, int source, Expansion& expansion);
+
+	bool minify_;
+
+	// includes are never reloaded, nullptr for names which do not exist, protected
+	// by mutex_ like results_
+	std::mutex mutex_;
+	std::unordered_map<std::string, std::shared_ptr<const std::string>> includes_;
+	std::unordered_map<Hash, Result> results_;
+	std::list<Hash> lru_;
+	size_t cached_;
+};
+
+#endif
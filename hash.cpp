@@ -1,31 +1,380 @@
-#include <cstring> // std::memcpy
+#include <cstring> // std::memcpy, std::memcmp
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_X86
+#endif
 
 #include "hash.h"
 
-// 128 bit hash via djbx33ax4 (Daniel Bernstein Times 33 with Addition interleaved 4x for 128 bits)
-static void Hash128(const uint8_t *buffer, size_t size, uint8_t *out)
+static const size_t k_stripe_size = 64;
+static const size_t k_stripes_per_block = 16;
+static const uint32_t k_prime32 = 0x9E3779B1U;
+static const uint64_t k_prime64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t k_prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+
+// stripe n of a block is keyed with the eight words starting at k_secret[n], the
+// last eight words key the scramble at the end of every block so that reordering
+// stripes changes the result
+static const uint64_t k_secret[24] =
+{
+	0x23FA631C20691EEAULL, 0x182082921AAE98D2ULL, 0xAF02206E08429088ULL, 0xFA8987E746C4BAE0ULL,
+	0x76514F31BCA56703ULL, 0x48FCBC5299B2482DULL, 0x82D6898FE529DAAFULL, 0x8D9CABE2A6B712BCULL,
+	0x3242C4A0A4D1FE9AULL, 0x5FA825D019EAA5E3ULL, 0x251DC8DCA19E10ADULL, 0xE90092874DB43251ULL,
+	0x66C0D821FB790532ULL, 0xC26BD105CB9BC2CEULL, 0x813703EBBE65AC59ULL, 0xF7A0C089DE864972ULL,
+	0xBD1EF27DA05C4EA9ULL, 0xF0B52154AECE63ECULL, 0xBADA8BE7EFFBA7B1ULL, 0x82C077251DE5AAAEULL,
+	0xD90DC9B73AEC9D14ULL, 0xC9E2BA2EA276B239ULL, 0x6DBC85B64568B64CULL, 0xD2E5C092B786373CULL,
+};
+
+static const uint64_t* const k_scramble_secret = k_secret + k_stripes_per_block;
+
+static inline uint64_t Read64(const uint8_t* p)
+{
+	uint64_t value;
+	std::memcpy(&value, p, sizeof value);
+	return value;
+}
+
+static inline uint64_t Mix(uint64_t a, uint64_t b)
 {
-	const uint8_t *const end = (const uint8_t *const )buffer + size;
-	uint32_t state[] = { 5381, 5381, 5381, 5381 };
-	size_t s = 0;
-	for (const uint8_t *p = buffer; p < end; p++)
+	const unsigned __int128 product = (unsigned __int128)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t Avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+// every lane adds the 32x32 product of its keyed halves and the raw data of its
+// neighbour, the vector versions below compute exactly the same thing
+static inline void AccumulateScalar(uint64_t* acc, const uint8_t* stripe, const uint64_t* key)
+{
+	for (size_t i = 0; i < 8; i++)
 	{
-		state[s] = state[s] * 33  + *p;
-		s = (s+1) & 0x03;
+		const uint64_t data = Read64(stripe + i * 8);
+		const uint64_t data_key = data ^ key[i];
+		acc[i ^ 1] += data;
+		acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+	}
+}
+
+#if !defined(__SSE2__)
+static inline void ScrambleScalar(uint64_t* acc, const uint64_t* key)
+{
+	for (size_t i = 0; i < 8; i++)
+	{
+		acc[i] ^= acc[i] >> 47;
+		acc[i] ^= key[i];
+		acc[i] *= k_prime32;
+	}
+}
+
+static void ConsumeScalar(uint64_t* acc, const uint8_t* data, size_t stripes, size_t* stripe)
+{
+	size_t s = *stripe;
+	for (; stripes; stripes--, data += k_stripe_size)
+	{
+		AccumulateScalar(acc, data, k_secret + s);
+		if (++s == k_stripes_per_block)
+		{
+			ScrambleScalar(acc, k_scramble_secret);
+			s = 0;
+		}
+	}
+	*stripe = s;
+}
+#endif
+
+#if defined(__SSE2__)
+static void ConsumeSSE2(uint64_t* acc, const uint8_t* data, size_t stripes, size_t* stripe)
+{
+	__m128i* const xacc = (__m128i*)acc;
+	__m128i a[4];
+	for (size_t i = 0; i < 4; i++)
+	{
+		a[i] = _mm_loadu_si128(xacc + i);
 	}
-	std::memcpy(out, state, sizeof state);
+
+	size_t s = *stripe;
+	for (; stripes; stripes--, data += k_stripe_size)
+	{
+		const __m128i* const xdata = (const __m128i*)data;
+		const __m128i* const xkey = (const __m128i*)(k_secret + s);
+		for (size_t i = 0; i < 4; i++)
+		{
+			const __m128i d = _mm_loadu_si128(xdata + i);
+			const __m128i data_key = _mm_xor_si128(d, _mm_loadu_si128(xkey + i));
+			const __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+			const __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+			const __m128i data_swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+			a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, data_swap));
+		}
+
+		if (++s == k_stripes_per_block)
+		{
+			const __m128i* const xscramble = (const __m128i*)k_scramble_secret;
+			const __m128i prime = _mm_set1_epi32((int)k_prime32);
+			for (size_t i = 0; i < 4; i++)
+			{
+				__m128i v = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+				v = _mm_xor_si128(v, _mm_loadu_si128(xscramble + i));
+				const __m128i v_hi = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1));
+				const __m128i product_lo = _mm_mul_epu32(v, prime);
+				const __m128i product_hi = _mm_mul_epu32(v_hi, prime);
+				a[i] = _mm_add_epi64(product_lo, _mm_slli_epi64(product_hi, 32));
+			}
+			s = 0;
+		}
+	}
+
+	for (size_t i = 0; i < 4; i++)
+	{
+		_mm_storeu_si128(xacc + i, a[i]);
+	}
+	*stripe = s;
+}
+#endif
+
+#if defined(HASH_X86)
+__attribute__((target("avx2")))
+static void ConsumeAVX2(uint64_t* acc, const uint8_t* data, size_t stripes, size_t* stripe)
+{
+	__m256i* const xacc = (__m256i*)acc;
+	__m256i a[2];
+	for (size_t i = 0; i < 2; i++)
+	{
+		a[i] = _mm256_loadu_si256(xacc + i);
+	}
+
+	size_t s = *stripe;
+	for (; stripes; stripes--, data += k_stripe_size)
+	{
+		const __m256i* const xdata = (const __m256i*)data;
+		const __m256i* const xkey = (const __m256i*)(k_secret + s);
+		for (size_t i = 0; i < 2; i++)
+		{
+			const __m256i d = _mm256_loadu_si256(xdata + i);
+			const __m256i data_key = _mm256_xor_si256(d, _mm256_loadu_si256(xkey + i));
+			const __m256i data_key_hi = _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+			const __m256i product = _mm256_mul_epu32(data_key, data_key_hi);
+			const __m256i data_swap = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+			a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, data_swap));
+		}
+
+		if (++s == k_stripes_per_block)
+		{
+			const __m256i* const xscramble = (const __m256i*)k_scramble_secret;
+			const __m256i prime = _mm256_set1_epi32((int)k_prime32);
+			for (size_t i = 0; i < 2; i++)
+			{
+				__m256i v = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+				v = _mm256_xor_si256(v, _mm256_loadu_si256(xscramble + i));
+				const __m256i v_hi = _mm256_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1));
+				const __m256i product_lo = _mm256_mul_epu32(v, prime);
+				const __m256i product_hi = _mm256_mul_epu32(v_hi, prime);
+				a[i] = _mm256_add_epi64(product_lo, _mm256_slli_epi64(product_hi, 32));
+			}
+			s = 0;
+		}
+	}
+
+	for (size_t i = 0; i < 2; i++)
+	{
+		_mm256_storeu_si256(xacc + i, a[i]);
+	}
+	*stripe = s;
+}
+#endif
+
+typedef void (*CONSUMEPROC)(uint64_t*, const uint8_t*, size_t, size_t*);
+
+static CONSUMEPROC SelectConsume()
+{
+#if defined(HASH_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return ConsumeAVX2;
+	}
+#endif
+#if defined(__SSE2__)
+	return ConsumeSSE2;
+#else
+	return ConsumeScalar;
+#endif
+}
+
+static void Consume(uint64_t* acc, const uint8_t* data, size_t stripes, size_t* stripe)
+{
+	static const CONSUMEPROC consume = SelectConsume();
+	consume(acc, data, stripes, stripe);
+}
+
+bool Hash::operator==(const Hash& other) const
+{
+	return std::memcmp(bytes, other.bytes, sizeof bytes) == 0;
+}
+
+bool Hash::operator!=(const Hash& other) const
+{
+	return !(*this == other);
+}
+
+bool Hash::operator<(const Hash& other) const
+{
+	return std::memcmp(bytes, other.bytes, sizeof bytes) < 0;
 }
 
-std::string Hash128(const uint8_t *buffer, size_t size)
+void Hash::Format(char* out) const
 {
-	std::string result;
-	uint8_t output[16];
-	Hash128(buffer, size, output);
 	static const char *k_hex = "0123456789ABCDEF";
-	for (size_t i = 0; i < sizeof output; ++i)
+	for (size_t i = 0; i < sizeof bytes; ++i)
+	{
+		*out++ = k_hex[(bytes[i] >> 4) & 0x0F];
+		*out++ = k_hex[bytes[i] & 0x0F];
+	}
+	*out = '\0';
+}
+
+std::string Hash::String() const
+{
+	char hex[sizeof bytes * 2 + 1];
+	Format(hex);
+	return hex;
+}
+
+static int HexValue(char ch)
+{
+	if (ch >= '0' && ch <= '9') return ch - '0';
+	if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+	if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	return -1;
+}
+
+bool ParseHash(const char* hex, Hash& hash)
+{
+	for (size_t i = 0; i < sizeof hash.bytes; i++)
 	{
-		result += k_hex[(output[i] >> 4) & 0x0F];
-		result += k_hex[output[i] & 0x0F];
+		const int hi = HexValue(hex[i*2 + 0]);
+		const int lo = hi < 0 ? -1 : HexValue(hex[i*2 + 1]);
+		if (lo < 0)
+		{
+			return false;
+		}
+		hash.bytes[i] = (uint8_t)((hi << 4) | lo);
 	}
+	return true;
+}
+
+Hasher::Hasher()
+	: acc_      { 0x9E3779B1ULL, k_prime64_1, k_prime64_2, 0x165667B19E3779F9ULL,
+	              0x85EBCA77C2B2AE63ULL, 0x85EBCA77ULL, 0x27D4EB2F165667C5ULL, 0xC2B2AE3DULL }
+	, buffer_   { }
+	, buffered_ { 0 }
+	, stripe_   { 0 }
+	, length_   { 0 }
+{
+}
+
+void Hasher::Update(const void* data, size_t size)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	length_ += size;
+
+	// top up a partial stripe left over from the previous update first
+	if (buffered_)
+	{
+		const size_t fill = size < k_stripe_size - buffered_ ? size : k_stripe_size - buffered_;
+		std::memcpy(buffer_ + buffered_, p, fill);
+		buffered_ += fill;
+		p += fill;
+		size -= fill;
+		if (buffered_ < k_stripe_size)
+		{
+			return;
+		}
+		Consume(acc_, buffer_, 1, &stripe_);
+		buffered_ = 0;
+	}
+
+	// whole stripes are consumed straight from the input
+	const size_t stripes = size / k_stripe_size;
+	if (stripes)
+	{
+		Consume(acc_, p, stripes, &stripe_);
+		p += stripes * k_stripe_size;
+		size -= stripes * k_stripe_size;
+	}
+
+	std::memcpy(buffer_, p, size);
+	buffered_ = size;
+}
+
+Hash Hasher::Final() const
+{
+	uint64_t acc[8];
+	std::memcpy(acc, acc_, sizeof acc);
+
+	// the tail is zero padded to a full stripe, the length below disambiguates it
+	uint8_t tail[k_stripe_size] = { };
+	std::memcpy(tail, buffer_, buffered_);
+	AccumulateScalar(acc, tail, k_secret + 7);
+
+	uint64_t lo = length_ * k_prime64_1;
+	uint64_t hi = ~(length_ * k_prime64_2);
+	for (size_t i = 0; i < 4; i++)
+	{
+		lo += Mix(acc[2*i] ^ k_secret[1 + 2*i], acc[2*i + 1] ^ k_secret[2 + 2*i]);
+		hi += Mix(acc[2*i] ^ k_secret[11 + 2*i], acc[2*i + 1] ^ k_secret[12 + 2*i]);
+	}
+	lo = Avalanche(lo);
+	hi = Avalanche(hi);
+
+	Hash result;
+	std::memcpy(result.bytes, &lo, sizeof lo);
+	std::memcpy(result.bytes + sizeof lo, &hi, sizeof hi);
 	return result;
 }
+
+HasherDJB::HasherDJB()
+	: state_ { 5381, 5381, 5381, 5381 }
+	, index_ { 0 }
+{
+}
+
+void HasherDJB::Update(const void* data, size_t size)
+{
+	const uint8_t *const end = (const uint8_t *)data + size;
+	size_t s = index_;
+	for (const uint8_t *p = (const uint8_t *)data; p < end; p++)
+	{
+		state_[s] = state_[s] * 33 + *p;
+		s = (s+1) & 0x03;
+	}
+	index_ = s;
+}
+
+Hash HasherDJB::Final() const
+{
+	Hash result;
+	std::memcpy(result.bytes, state_, sizeof state_);
+	return result;
+}
+
+Hash Hash128(const void* buffer, size_t size)
+{
+	Hasher hasher;
+	hasher.Update(buffer, size);
+	return hasher.Final();
+}
+
+Hash Hash128DJB(const void* buffer, size_t size)
+{
+	HasherDJB hasher;
+	hasher.Update(buffer, size);
+	return hasher.Final();
+}
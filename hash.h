@@ -2,7 +2,75 @@
 #define HASH_H
 #include <string>
 
-// 128 bit hash via djbx33ax4 (Daniel Bernstein Times 33 with Addition interleaved 4x for 128 bits)
-std::string Hash128(const uint8_t *buffer, size_t size);
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// 128 bit binary hash key, hexadecimal is only produced when a file name is needed
+struct Hash
+{
+	uint8_t bytes[16];
+
+	bool operator==(const Hash& other) const;
+	bool operator!=(const Hash& other) const;
+	bool operator<(const Hash& other) const;
+
+	// write 32 uppercase hexadecimal characters and a nul terminator
+	void Format(char* out) const;
+	std::string String() const;
+};
+
+// incremental 128 bit hash, consumes 64 byte stripes into eight 64-bit accumulators
+// with SSE2 or AVX2 when available, splitting the input across Update calls in any way
+// gives the same result as hashing it in one piece
+struct Hasher
+{
+	Hasher();
+
+	void Update(const void* data, size_t size);
+	Hash Final() const;
+
+private:
+	uint64_t acc_[8];
+	uint8_t buffer_[64];
+	size_t buffered_;
+	size_t stripe_;
+	uint64_t length_;
+};
+
+// legacy 128 bit hash via djbx33ax4 (Daniel Bernstein Times 33 with Addition interleaved 4x for 128 bits)
+// this is what older versions of deshade used to name files in shaders/
+struct HasherDJB
+{
+	HasherDJB();
+
+	void Update(const void* data, size_t size);
+	Hash Final() const;
+
+private:
+	uint32_t state_[4];
+	size_t index_;
+};
+
+namespace std
+{
+	// the hash is already uniformly distributed, any word of it will do
+	template<>
+	struct hash<Hash>
+	{
+		size_t operator()(const Hash& key) const
+		{
+			size_t value;
+			std::memcpy(&value, key.bytes, sizeof value);
+			return value;
+		}
+	};
+}
+
+// parse 32 hexadecimal characters as written by Hash::Format
+bool ParseHash(const char* hex, Hash& hash);
+
+Hash Hash128(const void* buffer, size_t size);
+Hash Hash128DJB(const void* buffer, size_t size);
 
 #endif
@@ -1,40 +1,503 @@
+#include <algorithm> // std::stable_sort
+#include <charconv> // std::to_chars
+#include <chrono>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib> // std::getenv
+
+extern "C"
+{
+	#include <fcntl.h>
+	#include <time.h>
+	#include <unistd.h>
+}
+
 #include "log.h"
+#include "hash.h"
 
-Logger::Logger()
-	: log_ { "deshade.txt" }
+// record layout, every field is copied unaligned
+//
+//   uint32_t size     whole record rounded up to 8 bytes, 0 marks a wrap to the start
+//   uint8_t  level
+//   uint8_t  count    number of arguments
+//   uint64_t time     CLOCK_MONOTONIC nanoseconds, orders records across threads
+//   uint64_t format   address of the LogFormat parsed while compiling
+//   arguments         uint8_t type followed by the value
+static const size_t k_header_size = 24;
+
+enum : uint8_t
+{
+	k_type_signed,
+	k_type_unsigned,
+	k_type_double,
+	k_type_pointer,
+	k_type_string, // uint32_t length followed by the characters
+	k_type_hash
+};
+
+// per thread, only the owning thread moves head_ and only the drain thread moves tail_
+static const size_t k_ring_size = 64 << 10;
+
+struct LogRing
 {
+	LogRing()
+		: head_     { 0 }
+		, tail_     { 0 }
+		, orphaned_ { false }
+		, next_     { nullptr }
+	{
+	}
+
+	std::atomic<uint64_t> head_;
+	std::atomic<uint64_t> tail_;
+	std::atomic<bool> orphaned_; // owning thread exited
+	LogRing* next_;
+	uint8_t data_[k_ring_size];
+};
+
+// ring of the calling thread, handed over to the drain thread when the thread exits
+struct ThreadRing
+{
+	~ThreadRing();
+	LogRing* ring_ = nullptr;
+};
+
+static thread_local ThreadRing t_ring;
+static thread_local bool t_exited = false;
+
+ThreadRing::~ThreadRing()
+{
+	// the drain thread may free the ring from here on, later logging from thread local
+	// destructors of this thread is formatted inline
+	if (ring_)
+	{
+		ring_->orphaned_.store(true, std::memory_order_release);
+		ring_ = nullptr;
+	}
+	t_exited = true;
 }
 
-void Logger::Flush()
+static uint64_t Now()
 {
-	log_.flush();
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return uint64_t(now.tv_sec) * 1000000000u + now.tv_nsec;
 }
 
-Logger& Logger::Get()
+template<typename T>
+static T Load(const uint8_t* data)
 {
-	static Logger logger_;
-	return logger_;
+	T value;
+	std::memcpy(&value, data, sizeof value);
+	return value;
 }
 
-void Log(const char *string)
+void Logger::Write(const std::string& text)
 {
-	Logger& log = Logger::Get();
-	for (; *string; log << *string++)
+	const char* data = text.data();
+	size_t size = text.size();
+	while (size && fd_ != -1)
 	{
-		if (*string != '%')
+		const ssize_t count = write(fd_, data, size);
+		if (count < 0 && errno == EINTR)
 		{
 			continue;
 		}
+		if (count <= 0)
+		{
+			break;
+		}
+		data += count;
+		size -= count;
+	}
+}
 
-		if (*(string + 1) == '%')
+// literal runs are appended whole, arguments are converted on the stack
+static void Format(const uint8_t* record, std::string& out)
+{
+	const LogFormat& format = *(const LogFormat*)Load<uintptr_t>(record + 16);
+	const uint8_t* argument = record + k_header_size;
+	size_t count = record[5];
+	for (size_t i = 0; i < format.count; i++)
+	{
+		const LogSegment& segment = format.segments[i];
+		out.append(format.string + segment.offset, segment.length);
+		if (!segment.argument || !count--)
 		{
-			++string;
+			continue;
 		}
-		else
+
+		char buffer[64];
+		char* end = buffer;
+		const uint8_t type = *argument++;
+		switch (type)
+		{
+		case k_type_signed:
+			end = std::to_chars(buffer, buffer + sizeof buffer, Load<int64_t>(argument)).ptr;
+			argument += 8;
+			break;
+		case k_type_unsigned:
+			end = std::to_chars(buffer, buffer + sizeof buffer, Load<uint64_t>(argument)).ptr;
+			argument += 8;
+			break;
+		case k_type_double:
+			end = std::to_chars(buffer, buffer + sizeof buffer, Load<double>(argument)).ptr;
+			argument += 8;
+			break;
+		case k_type_pointer:
+			if (const uint64_t pointer = Load<uint64_t>(argument))
+			{
+				buffer[0] = '0';
+				buffer[1] = 'x';
+				end = std::to_chars(buffer + 2, buffer + sizeof buffer, pointer, 16).ptr;
+			}
+			else
+			{
+				*end++ = '0';
+			}
+			argument += 8;
+			break;
+		case k_type_string:
+		{
+			const uint32_t length = Load<uint32_t>(argument);
+			out.append((const char*)argument + 4, length);
+			argument += 4 + length;
+			break;
+		}
+		case k_type_hash:
 		{
+			Hash hash;
+			std::memcpy(hash.bytes, argument, sizeof hash.bytes);
+			hash.Format(buffer);
+			end = buffer + sizeof hash.bytes * 2;
+			argument += sizeof hash.bytes;
 			break;
 		}
+		}
+		out.append(buffer, end - buffer);
+	}
+}
+
+// format everything in every ring in timestamp order, caller holds drain_mutex_
+void Logger::Drain()
+{
+	struct Pending
+	{
+		uint64_t time;
+		const uint8_t* record;
+	};
+	struct Consumed
+	{
+		LogRing* ring;
+		uint64_t tail;
+	};
+
+	std::vector<Pending> pending;
+	std::vector<Consumed> consumed;
+	std::string out;
+
+	for (LogRing* ring = rings_.load(std::memory_order_acquire); ring; ring = ring->next_)
+	{
+		uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+		const uint64_t head = ring->head_.load(std::memory_order_acquire);
+		if (tail == head)
+		{
+			continue;
+		}
+		while (tail != head)
+		{
+			const size_t offset = tail % k_ring_size;
+			const uint32_t size = Load<uint32_t>(ring->data_ + offset);
+			if (size == 0)
+			{
+				tail += k_ring_size - offset;
+				continue;
+			}
+			pending.push_back({ Load<uint64_t>(ring->data_ + offset + 8), ring->data_ + offset });
+			tail += size;
+		}
+		consumed.push_back({ ring, tail });
+	}
+
+	// every ring is already in order, only the interleaving between threads is sorted
+	std::stable_sort(pending.begin(), pending.end(),
+		[](const Pending& lhs, const Pending& rhs) { return lhs.time < rhs.time; });
+	for (const Pending& record : pending)
+	{
+		Format(record.record, out);
+	}
+	Write(out);
+
+	// hand the space back to the threads only once their records have been formatted
+	for (const Consumed& ring : consumed)
+	{
+		ring.ring->tail_.store(ring.tail, std::memory_order_release);
+	}
+
+	// free rings of exited threads once empty, the list head is left for later as
+	// new rings are only ever pushed in front of it
+	LogRing* previous = rings_.load(std::memory_order_acquire);
+	for (LogRing* ring = previous ? previous->next_ : nullptr; ring; )
+	{
+		LogRing* next = ring->next_;
+		if (ring->orphaned_.load(std::memory_order_acquire)
+		 && ring->tail_.load(std::memory_order_relaxed) == ring->head_.load(std::memory_order_acquire))
+		{
+			previous->next_ = next;
+			delete ring;
+		}
+		else
+		{
+			previous = ring;
+		}
+		ring = next;
+	}
+}
+
+LogRecord::LogRecord(LogLevel level, const LogFormat* format)
+	: size_ { k_header_size }
+{
+	const uint32_t size = 0;
+	const uint64_t time = Now();
+	const uintptr_t address = (uintptr_t)format;
+	std::memcpy(data_, &size, sizeof size);
+	data_[4] = (uint8_t)level;
+	data_[5] = 0;
+	data_[6] = 0;
+	data_[7] = 0;
+	std::memcpy(data_ + 8, &time, sizeof time);
+	std::memcpy(data_ + 16, &address, sizeof address);
+	std::memset(data_ + 16 + sizeof address, 0, 8 - sizeof address);
+}
+
+bool LogRecord::Reserve(uint8_t type, size_t size)
+{
+	if (size_ + 1 + size > k_capacity)
+	{
+		return false;
+	}
+	data_[size_++] = type;
+	data_[5]++;
+	return true;
+}
+
+void LogRecord::AddSigned(int64_t value)
+{
+	if (Reserve(k_type_signed, sizeof value))
+	{
+		std::memcpy(data_ + size_, &value, sizeof value);
+		size_ += sizeof value;
+	}
+}
+
+void LogRecord::AddUnsigned(uint64_t value)
+{
+	if (Reserve(k_type_unsigned, sizeof value))
+	{
+		std::memcpy(data_ + size_, &value, sizeof value);
+		size_ += sizeof value;
+	}
+}
+
+void LogRecord::AddDouble(double value)
+{
+	if (Reserve(k_type_double, sizeof value))
+	{
+		std::memcpy(data_ + size_, &value, sizeof value);
+		size_ += sizeof value;
+	}
+}
+
+void LogRecord::AddPointer(const void* value)
+{
+	const uint64_t address = (uintptr_t)value;
+	if (Reserve(k_type_pointer, sizeof address))
+	{
+		std::memcpy(data_ + size_, &address, sizeof address);
+		size_ += sizeof address;
+	}
+}
+
+void LogRecord::AddString(const char* value, size_t length)
+{
+	// strings are copied, long ones are cut to what fits in the record
+	const size_t space = k_capacity - std::min(k_capacity, size_ + 1 + sizeof(uint32_t));
+	const uint32_t count = std::min(length, space);
+	if (Reserve(k_type_string, sizeof count + count))
+	{
+		std::memcpy(data_ + size_, &count, sizeof count);
+		std::memcpy(data_ + size_ + sizeof count, value, count);
+		size_ += sizeof count + count;
+	}
+}
+
+void LogRecord::AddHash(const Hash& value)
+{
+	if (Reserve(k_type_hash, sizeof value.bytes))
+	{
+		std::memcpy(data_ + size_, value.bytes, sizeof value.bytes);
+		size_ += sizeof value.bytes;
+	}
+}
+
+const uint8_t* LogRecord::Data() const
+{
+	return data_;
+}
+
+size_t LogRecord::Size() const
+{
+	return size_;
+}
+
+void LogArgument(LogRecord& record, const Hash& value)
+{
+	record.AddHash(value);
+}
+
+Logger::Logger()
+	: level_    { (uint8_t)LogLevel::Info + 1 }
+	, fd_       { -1 }
+	, rings_    { nullptr }
+	, stopping_ { false }
+	, stopped_  { false }
+{
+	if (const char* level = std::getenv("DESHADE_LOG"))
+	{
+		if (!std::strcmp(level, "none") || !std::strcmp(level, "off"))
+		{
+			level_ = 0;
+		}
+		else if (!std::strcmp(level, "error"))
+		{
+			level_ = (uint8_t)LogLevel::Error + 1;
+		}
+		else if (!std::strcmp(level, "trace"))
+		{
+			level_ = (uint8_t)LogLevel::Trace + 1;
+		}
+	}
+
+	if (level_)
+	{
+		fd_ = open("deshade.txt", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		thread_ = std::thread(&Logger::Run, this);
+	}
+}
+
+Logger& Logger::Get()
+{
+	// leaks on exit, dumps written out while exiting may still log
+	static Logger* logger_ = new Logger;
+	return *logger_;
+}
+
+void Logger::Submit(const LogRecord& record)
+{
+	const uint8_t* data = record.Data();
+	const uint32_t size = (record.Size() + 7) & ~7u;
+
+	LogRing* ring = t_ring.ring_;
+	if (!ring && !t_exited && !stopped_.load(std::memory_order_acquire))
+	{
+		ring = new LogRing;
+		t_ring.ring_ = ring;
+		ring->next_ = rings_.load(std::memory_order_relaxed);
+		while (!rings_.compare_exchange_weak(ring->next_, ring,
+			std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	// after the drain thread stopped or while this thread is exiting, format inline
+	if (!ring || stopped_.load(std::memory_order_acquire))
+	{
+		std::lock_guard<std::mutex> lock(drain_mutex_);
+		Drain();
+		std::string out;
+		Format(data, out);
+		Write(out);
+		return;
 	}
 
-	log.Flush();
+	for (;;)
+	{
+		uint64_t head = ring->head_.load(std::memory_order_relaxed);
+		const uint64_t tail = ring->tail_.load(std::memory_order_acquire);
+		size_t offset = head % k_ring_size;
+		const size_t contiguous = k_ring_size - offset;
+		const size_t needed = contiguous < size ? contiguous + size : size;
+		if (k_ring_size - (head - tail) < needed)
+		{
+			// full, the drain thread frees space for us
+			wake_.notify_one();
+			std::this_thread::yield();
+			continue;
+		}
+
+		if (contiguous < size)
+		{
+			const uint32_t wrap = 0;
+			std::memcpy(ring->data_ + offset, &wrap, sizeof wrap);
+			head += contiguous;
+			offset = 0;
+		}
+
+		std::memcpy(ring->data_ + offset, data, record.Size());
+		std::memcpy(ring->data_ + offset, &size, sizeof size);
+		ring->head_.store(head + size, std::memory_order_release);
+		break;
+	}
+
+	if ((LogLevel)data[4] == LogLevel::Error)
+	{
+		wake_.notify_one();
+	}
+}
+
+void Logger::Flush()
+{
+	std::lock_guard<std::mutex> lock(drain_mutex_);
+	Drain();
+}
+
+void Logger::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex_);
+		if (stopping_)
+		{
+			return;
+		}
+		stopping_ = true;
+	}
+	wake_.notify_one();
+	if (thread_.joinable())
+	{
+		thread_.join();
+	}
+
+	std::lock_guard<std::mutex> lock(drain_mutex_);
+	stopped_.store(true, std::memory_order_release);
+	Drain();
+}
+
+void Logger::Run()
+{
+	std::unique_lock<std::mutex> lock(wake_mutex_);
+	while (!stopping_)
+	{
+		wake_.wait_for(lock, std::chrono::milliseconds(10));
+		lock.unlock();
+		Flush();
+		lock.lock();
+	}
+}
+
+// runs after every other destructor so whatever they log still makes it out
+__attribute__((destructor(101)))
+static void StopLogger()
+{
+	Logger::Get().Stop();
 }
@@ -1,47 +1,267 @@
 #ifndef LOG_H
 #define LOG_H
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
 
-#include <fstream>
+#include <cstdint>
+#include <cstring>
+
+struct Hash;
+struct LogRing;
+struct LogFormat;
+
+// selected with DESHADE_LOG=none|error|info|trace, defaults to info
+enum class LogLevel : uint8_t
+{
+	Error,
+	Info,
+	Trace
+};
+
+// one message encoded on the stack of the calling thread as a binary record of
+// timestamp, level, parsed format and tagged arguments, it becomes text later on
+// the thread that drains every thread's ring buffer into deshade.txt
+struct LogRecord
+{
+	LogRecord(LogLevel level, const LogFormat* format);
+
+	void AddSigned(int64_t value);
+	void AddUnsigned(uint64_t value);
+	void AddDouble(double value);
+	void AddPointer(const void* value);
+	void AddString(const char* value, size_t length);
+	void AddHash(const Hash& value);
+
+	const uint8_t* Data() const;
+	size_t Size() const;
+
+	static const size_t k_capacity = 1024;
+
+private:
+	bool Reserve(uint8_t type, size_t size);
+
+	uint8_t data_[k_capacity];
+	size_t size_;
+};
 
 struct Logger
 {
 	static Logger& Get();
 
-	template<typename T>
-	void operator<<(const T& value)
-	{
-		log_ << value;
-	}
+	bool Enabled(LogLevel level) const;
+
+	// copy a record into the ring buffer of the calling thread
+	void Submit(const LogRecord& record);
 
+	// format everything submitted so far into deshade.txt
 	void Flush();
 
+	// drain and stop the background thread, records are formatted inline afterwards
+	void Stop();
+
 private:
 	Logger();
-	std::ofstream log_;
+	void Run();
+	void Drain();
+	void Write(const std::string& text);
+
+	uint8_t level_;
+	int fd_;
+
+	// every thread that logged pushes its ring in front, only Drain removes them
+	std::atomic<LogRing*> rings_;
+
+	// held while formatting and writing
+	std::mutex drain_mutex_;
+
+	std::mutex wake_mutex_;
+	std::condition_variable wake_;
+	bool stopping_; // protected by wake_mutex_
+	std::atomic<bool> stopped_;
+	std::thread thread_;
 };
 
-void Log(const char *string);
+inline bool Logger::Enabled(LogLevel level) const
+{
+	return (uint8_t)level < level_;
+}
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+LogArgument(LogRecord& record, T value)
+{
+	record.AddSigned(value);
+}
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type
+LogArgument(LogRecord& record, T value)
+{
+	record.AddUnsigned(value);
+}
+
+template<typename T>
+typename std::enable_if<std::is_enum<T>::value>::type
+LogArgument(LogRecord& record, T value)
+{
+	record.AddSigned((int64_t)value);
+}
+
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+LogArgument(LogRecord& record, T value)
+{
+	record.AddDouble(value);
+}
+
+template<typename T>
+typename std::enable_if<std::is_pointer<T>::value>::type
+LogArgument(LogRecord& record, T value)
+{
+	record.AddPointer((const void*)value);
+}
+
+inline void LogArgument(LogRecord& record, char value)
+{
+	record.AddString(&value, 1);
+}
+
+inline void LogArgument(LogRecord& record, const char* value)
+{
+	if (value)
+	{
+		record.AddString(value, std::strlen(value));
+	}
+	else
+	{
+		record.AddString("(null)", 6);
+	}
+}
+
+inline void LogArgument(LogRecord& record, char* value)
+{
+	LogArgument(record, (const char*)value);
+}
+
+inline void LogArgument(LogRecord& record, const std::string& value)
+{
+	record.AddString(value.data(), value.size());
+}
+
+// hashes are written as hexadecimal without building a string
+void LogArgument(LogRecord& record, const Hash& value);
+
+inline void LogArguments(LogRecord&)
+{
+}
 
 template<typename T, typename... Ts>
-void Log(const char *string, T value, Ts&&... args)
+void LogArguments(LogRecord& record, const T& value, const Ts&... args)
 {
-	for (Logger& log = Logger::Get(); *string; log << *string++)
+	LogArgument(record, value);
+	LogArguments(record, args...);
+}
+
+// a format string split at compile time into literal runs, each optionally
+// followed by an argument, every % is replaced by the next argument and %% is a
+// literal %
+struct LogSegment
+{
+	uint16_t offset;
+	uint16_t length;
+	bool argument;
+};
+
+struct LogFormat
+{
+	const char* string;
+	const LogSegment* segments;
+	size_t count;
+};
+
+constexpr size_t LogCountSegments(const char* string)
+{
+	size_t count = 1;
+	for (; *string; string++)
 	{
-		if (*string != '%')
+		if (*string == '%')
 		{
-			continue;
+			count++;
+			string += string[1] == '%';
 		}
+	}
+	return count;
+}
 
-		if (*(string + 1) == '%')
+constexpr size_t LogCountArguments(const char* string)
+{
+	size_t count = 0;
+	for (; *string; string++)
+	{
+		if (*string == '%')
 		{
-			++string;
+			count += string[1] != '%';
+			string += string[1] == '%';
 		}
-		else
+	}
+	return count;
+}
+
+template<size_t N>
+struct LogSegments
+{
+	constexpr LogSegments(const char* string)
+		: segments {}
+	{
+		size_t count = 0;
+		size_t start = 0;
+		size_t i = 0;
+		for (; string[i]; i++)
 		{
-			log << value;
-			return Log(string + 1, std::forward<Ts>(args)...);
+			if (string[i] != '%')
+			{
+				continue;
+			}
+			// an escaped % ends its run and is kept in it
+			const bool escape = string[i + 1] == '%';
+			segments[count++] = { uint16_t(start), uint16_t(i - start + escape), !escape };
+			i += escape;
+			start = i + 1;
 		}
+		segments[count] = { uint16_t(start), uint16_t(i - start), false };
 	}
+
+	LogSegment segments[N];
+};
+
+template<size_t N, typename... Ts>
+void LogAt(LogLevel level, const LogFormat& format, const Ts&... args)
+{
+	static_assert(sizeof...(Ts) == N, "number of arguments does not match the number of % in the format");
+	LogRecord record(level, &format);
+	LogArguments(record, args...);
+	Logger::Get().Submit(record);
 }
 
+// format has to be a string literal, it is parsed while compiling, arguments are
+// only evaluated when the level is enabled
+#define LOG_AT(level, format, ...) \
+	do \
+	{ \
+		if (Logger::Get().Enabled(level)) \
+		{ \
+			static constexpr LogSegments<LogCountSegments(format)> k_segments { format }; \
+			static constexpr LogFormat k_format { format, k_segments.segments, LogCountSegments(format) }; \
+			LogAt<LogCountArguments(format)>(level, k_format, ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define LogError(...) LOG_AT(LogLevel::Error, __VA_ARGS__)
+#define Log(...) LOG_AT(LogLevel::Info, __VA_ARGS__)
+#define LogTrace(...) LOG_AT(LogLevel::Trace, __VA_ARGS__)
+
 #endif
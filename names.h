@@ -0,0 +1,77 @@
+#ifndef NAMES_H
+#define NAMES_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// FNV-1a, names deshade looks for are hashed while compiling
+constexpr uint32_t HashName(const char* name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name; name++)
+	{
+		hash = (hash ^ (uint8_t)*name) * 16777619u;
+	}
+	return hash;
+}
+
+// perfect hash over a fixed set of names, a seed is searched for while compiling so
+// that no two names share a slot, Find is then one hash and one string compare
+template<size_t N>
+struct NameTable
+{
+	static constexpr uint32_t Bits()
+	{
+		uint32_t bits = 1;
+		while ((size_t(1) << bits) < N * 8)
+		{
+			bits++;
+		}
+		return bits;
+	}
+
+	static constexpr uint32_t k_bits = Bits();
+
+	static_assert(N < 65536, "slots only hold 65535 names");
+
+	constexpr NameTable(const char* const (&names)[N])
+		: names_ { names }
+		, seed_  { 0 }
+		, slots_ { }
+	{
+		for (bool placed = false; !placed; )
+		{
+			seed_++;
+			for (auto& slot : slots_)
+			{
+				slot = 0;
+			}
+			placed = true;
+			for (size_t i = 0; i < N && placed; i++)
+			{
+				uint16_t& slot = slots_[Slot(HashName(names[i]))];
+				placed = slot == 0;
+				slot = i + 1;
+			}
+		}
+	}
+
+	// index into names or -1
+	int Find(const char* name) const
+	{
+		const uint16_t slot = slots_[Slot(HashName(name))];
+		return slot && !std::strcmp(names_[slot - 1], name) ? slot - 1 : -1;
+	}
+
+private:
+	constexpr uint32_t Slot(uint32_t hash) const
+	{
+		return ((hash ^ seed_) * 0x9e3779b1u) >> (32 - k_bits);
+	}
+
+	const char* const* names_;
+	uint32_t seed_;
+	uint16_t slots_[size_t(1) << k_bits]; // index into names plus one, 0 is empty
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include <algorithm> // std::sort
+#include <csignal>
+#include <cstdio> // std::fopen, std::fprintf
+#include <cstdlib> // std::getenv
+#include <cstring> // std::strcmp
+#include <vector>
+
+#include "profile.h"
+#include "log.h"
+
+static Profile* profile_;
+static std::atomic<bool> requested_ { false };
+
+static void RequestProfile(int)
+{
+	requested_.store(true, std::memory_order_relaxed);
+}
+
+Profile& Profile::Get()
+{
+	// leaks on exit like the store, the report is written by the destructor below
+	static std::once_flag once;
+	std::call_once(once, [](){ profile_ = new Profile; });
+	return *profile_;
+}
+
+// runs on dlclose and at exit
+__attribute__((destructor)) static void WriteProfile()
+{
+	if (profile_ && profile_->Enabled())
+	{
+		profile_->Write();
+	}
+}
+
+Profile::Profile()
+	: format_ { Format::Disabled }
+{
+	const char* format = std::getenv("DESHADE_PROFILE");
+	if (!format || !*format || !std::strcmp(format, "0"))
+	{
+		return;
+	}
+	format_ = std::strcmp(format, "json") ? Format::CSV : Format::JSON;
+
+	// only taken over when the application does not handle it, the default is to exit
+	struct sigaction action;
+	if (sigaction(SIGUSR1, nullptr, &action) == 0 && action.sa_handler == SIG_DFL)
+	{
+		action = { };
+		action.sa_handler = RequestProfile;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &action, nullptr);
+	}
+}
+
+bool Profile::Enabled() const
+{
+	return format_ != Format::Disabled;
+}
+
+Profile::Entry& Profile::Find(const Hash& hash, const char* type, size_t size, bool replaced)
+{
+	Entry& entry = entries_.insert({ hash, Entry { type, size, 0, replaced, 0, 0 } }).first->second;
+	entry.count++;
+	entry.replaced = replaced;
+	return entry;
+}
+
+void Profile::Compiled(const Hash& hash, const char* type, size_t size, bool replaced, uint64_t nanoseconds)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Find(hash, type, size, replaced).compile_nanoseconds += nanoseconds;
+}
+
+void Profile::Linked(const Hash& hash, size_t size, bool replaced, uint64_t nanoseconds)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Find(hash, "program", size, replaced).link_nanoseconds += nanoseconds;
+}
+
+void Profile::Waited(const Hash& hash, uint64_t nanoseconds)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto find = entries_.find(hash);
+	if (find == entries_.end())
+	{
+		return;
+	}
+	Entry& entry = find->second;
+	(std::strcmp(entry.type, "program") ? entry.compile_nanoseconds : entry.link_nanoseconds) += nanoseconds;
+}
+
+bool Profile::Requested()
+{
+	return requested_.load(std::memory_order_relaxed) && requested_.exchange(false, std::memory_order_relaxed);
+}
+
+void Profile::Write()
+{
+	std::vector<std::pair<Hash, Entry>> entries;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		entries.assign(entries_.begin(), entries_.end());
+	}
+	std::sort(entries.begin(), entries.end(), [](const std::pair<Hash, Entry>& lhs, const std::pair<Hash, Entry>& rhs)
+	{
+		return lhs.second.compile_nanoseconds + lhs.second.link_nanoseconds
+		     > rhs.second.compile_nanoseconds + rhs.second.link_nanoseconds;
+	});
+
+	const char* file_name = format_ == Format::JSON ? "deshade-profile.json" : "deshade-profile.csv";
+	std::FILE* file = std::fopen(file_name, "w");
+	if (!file)
+	{
+		LogError("Failed to write profile \"%\"\n", file_name);
+		return;
+	}
+
+	if (format_ == Format::CSV)
+	{
+		std::fprintf(file, "hash,type,size,count,compile_ms,link_ms,replaced\n");
+	}
+	else
+	{
+		std::fprintf(file, "[");
+	}
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		char hex[sizeof entries[i].first.bytes * 2 + 1];
+		entries[i].first.Format(hex);
+		const Entry& entry = entries[i].second;
+		const double compile_ms = entry.compile_nanoseconds / 1e6;
+		const double link_ms = entry.link_nanoseconds / 1e6;
+		if (format_ == Format::CSV)
+		{
+			std::fprintf(file, "%s,%s,%zu,%u,%.3f,%.3f,%d\n",
+				hex, entry.type, entry.size, entry.count, compile_ms, link_ms, entry.replaced);
+		}
+		else
+		{
+			std::fprintf(file, "%s\n\t{ \"hash\": \"%s\", \"type\": \"%s\", \"size\": %zu, \"count\": %u, \"compile_ms\": %.3f, \"link_ms\": %.3f, \"replaced\": %s }",
+				i ? "," : "", hex, entry.type, entry.size, entry.count, compile_ms, link_ms, entry.replaced ? "true" : "false");
+		}
+	}
+	if (format_ == Format::JSON)
+	{
+		std::fprintf(file, "\n]\n");
+	}
+	std::fclose(file);
+	Log("Wrote profile of % shaders and programs to \"%\"\n", entries.size(), file_name);
+}
@@ -0,0 +1,63 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "hash.h"
+
+// compile and link times of every shader and program by hash, enabled with
+// DESHADE_PROFILE=csv or DESHADE_PROFILE=json and written to deshade-profile.csv or
+// deshade-profile.json when the process exits, or at the next frame after SIGUSR1
+//
+// drivers may compile in the background until the status is asked for, so the first
+// status query after a compile or link counts towards it too
+struct Profile
+{
+	static Profile& Get();
+
+	bool Enabled() const;
+
+	void Compiled(const Hash& hash, const char* type, size_t size, bool replaced, uint64_t nanoseconds);
+	void Linked(const Hash& hash, size_t size, bool replaced, uint64_t nanoseconds);
+
+	// time spent waiting for the compile or link of hash to complete
+	void Waited(const Hash& hash, uint64_t nanoseconds);
+
+	// true once after SIGUSR1 was received
+	bool Requested();
+
+	// sorted by total time, slowest first
+	void Write();
+
+private:
+	Profile();
+
+	enum class Format : uint8_t
+	{
+		Disabled,
+		CSV,
+		JSON
+	};
+
+	struct Entry
+	{
+		const char* type;
+		size_t size;
+		uint32_t count;
+		bool replaced;
+		uint64_t compile_nanoseconds;
+		uint64_t link_nanoseconds;
+	};
+
+	Entry& Find(const Hash& hash, const char* type, size_t size, bool replaced);
+
+	Format format_;
+
+	// protected by mutex_, only ever taken around a compile or link
+	std::mutex mutex_;
+	std::unordered_map<Hash, Entry> entries_;
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include <algorithm> // std::min, std::max
+#include <cstring> // std::strnlen, std::strlen, std::strncmp
+#include <unordered_set>
+
+#include "spirv.h"
+
+static const uint32_t k_magic = 0x07230203;
+static const size_t k_header_words = 5;
+
+// instructions are walked a block at a time right after the block is hashed, while
+// it is still in cache
+static const size_t k_block_words = 1024;
+
+enum : uint16_t
+{
+	OpSourceContinued = 2,
+	OpSource = 3,
+	OpSourceExtension = 4,
+	OpName = 5,
+	OpMemberName = 6,
+	OpString = 7,
+	OpLine = 8,
+	OpExtension = 10,
+	OpExtInstImport = 11,
+	OpExtInst = 12,
+	OpMemoryModel = 14,
+	OpEntryPoint = 15,
+	OpExecutionMode = 16,
+	OpCapability = 17,
+	OpFunction = 54,
+	OpDecorate = 71,
+	OpMemberDecorate = 72,
+	OpDecorationGroup = 73,
+	OpGroupDecorate = 74,
+	OpGroupMemberDecorate = 75,
+	OpNoLine = 317,
+	OpModuleProcessed = 330,
+	OpExecutionModeId = 331,
+	OpDecorateId = 332,
+	OpDecorateString = 5632,
+	OpMemberDecorateString = 5633
+};
+
+const SpirvRange& SpirvModule::Section(SpirvSection section) const
+{
+	return sections[(size_t)section];
+}
+
+static SpirvSection GetSection(uint16_t opcode, SpirvSection current)
+{
+	SpirvSection section = SpirvSection::Globals;
+	switch (opcode)
+	{
+	case OpCapability:
+		section = SpirvSection::Capabilities;
+		break;
+	case OpExtension:
+		section = SpirvSection::Extensions;
+		break;
+	case OpExtInstImport:
+		section = SpirvSection::Imports;
+		break;
+	case OpMemoryModel:
+		section = SpirvSection::MemoryModel;
+		break;
+	case OpEntryPoint:
+		section = SpirvSection::EntryPoints;
+		break;
+	case OpExecutionMode:
+	case OpExecutionModeId:
+		section = SpirvSection::ExecutionModes;
+		break;
+	case OpSourceContinued:
+	case OpSource:
+	case OpSourceExtension:
+	case OpName:
+	case OpMemberName:
+	case OpString:
+	case OpModuleProcessed:
+		section = SpirvSection::Debug;
+		break;
+	case OpDecorate:
+	case OpMemberDecorate:
+	case OpDecorationGroup:
+	case OpGroupDecorate:
+	case OpGroupMemberDecorate:
+	case OpDecorateId:
+	case OpDecorateString:
+	case OpMemberDecorateString:
+		section = SpirvSection::Annotations;
+		break;
+	case OpFunction:
+		section = SpirvSection::Functions;
+		break;
+	}
+	// sections only ever move forward, everything after the first function is in it
+	return std::max(section, current);
+}
+
+// literal string operand, nul terminated and padded to a word
+static bool StartsWith(const uint32_t* operand, uint32_t words, const char* prefix)
+{
+	const size_t length = std::strlen(prefix);
+	return words * sizeof(uint32_t) > length && !std::strncmp((const char*)operand, prefix, length);
+}
+
+static bool IsNonSemantic(const uint32_t* operand, uint32_t words)
+{
+	return StartsWith(operand, words, "NonSemantic.");
+}
+
+static void IndexInstruction(SpirvModule& module, SpirvSection& section, const uint32_t* instruction, uint32_t offset)
+{
+	const uint16_t opcode = instruction[0] & 0xFFFF;
+	const uint16_t length = instruction[0] >> 16;
+	module.instructions++;
+
+	if (opcode == OpLine || opcode == OpNoLine)
+	{
+		module.line_words += length;
+		return;
+	}
+
+	section = GetSection(opcode, section);
+	SpirvRange& range = module.sections[(size_t)section];
+	if (!range.words)
+	{
+		range.offset = offset;
+	}
+	range.words += length;
+
+	switch (opcode)
+	{
+	case OpExtInstImport:
+		if (length >= 3 && IsNonSemantic(instruction + 2, length - 2))
+		{
+			module.non_semantic.push_back(instruction[1]);
+		}
+		break;
+	case OpCapability:
+		if (length >= 2)
+		{
+			module.capabilities.push_back(instruction[1]);
+		}
+		break;
+	case OpEntryPoint:
+		if (length >= 4)
+		{
+			const char* name = (const char*)(instruction + 3);
+			module.entry_points.push_back(SpirvEntryPoint {
+				instruction[1],
+				instruction[2],
+				std::string(name, strnlen(name, (length - 3) * sizeof(uint32_t))),
+				{ }
+			});
+		}
+		break;
+	case OpExecutionMode:
+	case OpExecutionModeId:
+		// entry points always come before their modes
+		for (SpirvEntryPoint& entry_point : module.entry_points)
+		{
+			if (length >= 3 && entry_point.id == instruction[1])
+			{
+				entry_point.modes.push_back(instruction[2]);
+			}
+		}
+		break;
+	}
+}
+
+SpirvModule IndexSpirv(const void* code, size_t size)
+{
+	SpirvModule module = { };
+	const uint32_t* words = (const uint32_t*)code;
+	const size_t count = size / sizeof(uint32_t);
+
+	bool parsing = count >= k_header_words && words[0] == k_magic;
+	if (parsing)
+	{
+		module.version = words[1];
+		module.generator = words[2];
+		module.bound = words[3];
+	}
+
+	Hasher hasher;
+	size_t hashed = 0;
+	size_t word = k_header_words;
+	SpirvSection section = SpirvSection::Capabilities;
+	while (hashed < count)
+	{
+		const size_t block_end = std::min(hashed + k_block_words, count);
+		hasher.Update(words + hashed, (block_end - hashed) * sizeof(uint32_t));
+		hashed = block_end;
+
+		// an instruction starting in this block may end in the next one
+		while (parsing && word < hashed)
+		{
+			const uint32_t length = words[word] >> 16;
+			if (!length || word + length > count)
+			{
+				parsing = false;
+				break;
+			}
+			IndexInstruction(module, section, words + word, word);
+			word += length;
+		}
+	}
+
+	// a size which is not a multiple of four is not SPIR-V, it is hashed all the same
+	hasher.Update((const uint8_t*)code + count * sizeof(uint32_t), size % sizeof(uint32_t));
+	module.hash = hasher.Final();
+	module.valid = parsing && word == count && size % sizeof(uint32_t) == 0;
+	module.words = (uint32_t)count;
+	return module;
+}
+
+static bool IsDebug(uint16_t opcode)
+{
+	switch (opcode)
+	{
+	case OpSourceContinued:
+	case OpSource:
+	case OpSourceExtension:
+	case OpName:
+	case OpMemberName:
+	case OpString:
+	case OpLine:
+	case OpNoLine:
+	case OpModuleProcessed:
+		return true;
+	}
+	return false;
+}
+
+std::vector<uint32_t> StripSpirv(const void* code, const SpirvModule& module)
+{
+	std::vector<uint32_t> stripped;
+	if (!module.valid || (!module.Section(SpirvSection::Debug).words && !module.line_words && module.non_semantic.empty()))
+	{
+		return stripped;
+	}
+
+	const uint32_t* words = (const uint32_t*)code;
+	const std::unordered_set<uint32_t> non_semantic(module.non_semantic.begin(), module.non_semantic.end());
+	std::unordered_set<uint32_t> removed;
+
+	stripped.reserve(module.words);
+	stripped.insert(stripped.end(), words, words + k_header_words);
+	for (uint32_t word = k_header_words; word < module.words; )
+	{
+		const uint32_t* instruction = words + word;
+		const uint16_t opcode = instruction[0] & 0xFFFF;
+		const uint16_t length = instruction[0] >> 16;
+		word += length;
+
+		// non-semantic results are only ever used by other non-semantic instructions
+		bool strip = IsDebug(opcode);
+		uint32_t result = opcode == OpString ? instruction[1] : 0;
+		if (opcode == OpExtInstImport && non_semantic.count(instruction[1]))
+		{
+			strip = true;
+			result = instruction[1];
+		}
+		else if (opcode == OpExtInst && length >= 4 && non_semantic.count(instruction[3]))
+		{
+			strip = true;
+			result = instruction[2];
+		}
+		else if (opcode == OpExtension && !non_semantic.empty() && length >= 2
+		      && StartsWith(instruction + 1, length - 1, "SPV_KHR_non_semantic_info"))
+		{
+			strip = true;
+		}
+
+		if (!strip)
+		{
+			stripped.insert(stripped.end(), instruction, instruction + length);
+		}
+		else if (result)
+		{
+			removed.insert(result);
+		}
+	}
+
+	// ids cannot be renumbered without knowing which operands of every opcode are
+	// ids, the bound only drops past ids nothing left in the module defines
+	uint32_t& bound = stripped[3];
+	while (bound > 1 && removed.count(bound - 1))
+	{
+		bound--;
+	}
+	return stripped;
+}
@@ -0,0 +1,74 @@
+#ifndef SPIRV_H
+#define SPIRV_H
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+// logical layout of a module, every section is a contiguous run of instructions in
+// this order, sections a module does not have are empty
+enum class SpirvSection : uint8_t
+{
+	Capabilities,
+	Extensions,
+	Imports,
+	MemoryModel,
+	EntryPoints,
+	ExecutionModes,
+	Debug,
+	Annotations,
+	Globals,
+	Functions,
+	Count
+};
+
+struct SpirvRange
+{
+	uint32_t offset; // in words from the start of the module
+	uint32_t words;
+};
+
+struct SpirvEntryPoint
+{
+	uint32_t model; // SPIR-V execution model, 5 is GLCompute and 6 is Kernel
+	uint32_t id;
+	std::string name;
+	std::vector<uint32_t> modes;
+};
+
+// everything the layer needs to know about a module, gathered in the same pass
+// that hashes it
+struct SpirvModule
+{
+	// false when the module is not SPIR-V or an instruction runs past its end, the
+	// hash is still of the whole module then
+	bool valid;
+	Hash hash;
+
+	uint32_t version;
+	uint32_t generator;
+	uint32_t bound;
+
+	std::vector<uint32_t> capabilities;
+	std::vector<SpirvEntryPoint> entry_points;
+	// result ids of NonSemantic.* instruction set imports
+	std::vector<uint32_t> non_semantic;
+
+	SpirvRange sections[(size_t)SpirvSection::Count];
+	uint32_t instructions;
+	// of the whole module, header included
+	uint32_t words;
+	// OpLine and OpNoLine, found among globals and functions rather than in a section
+	uint32_t line_words;
+
+	const SpirvRange& Section(SpirvSection section) const;
+};
+
+// walks the module once, the hash is the same as Hash128 of the module
+SpirvModule IndexSpirv(const void* code, size_t size);
+
+// module without debug and non-semantic instructions, the bound is lowered past ids
+// only stripped instructions defined, empty when there is nothing to strip
+std::vector<uint32_t> StripSpirv(const void* code, const SpirvModule& module);
+
+#endif
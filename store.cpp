@@ -0,0 +1,448 @@
+#include <cstdlib> // std::getenv, std::strtoull
+
+extern "C"
+{
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include "store.h"
+#include "log.h"
+
+static const char* k_shader_directory = "shaders";
+
+// dumps waiting for the writer thread before the application has to wait too
+static const size_t k_dump_queue_limit = (size_t)64 << 20;
+
+static Store* store_ = nullptr;
+
+Mapping::Mapping(const void* data, size_t size, bool owned)
+	: data_  { data }
+	, size_  { size }
+	, owned_ { owned }
+{
+}
+
+Mapping::~Mapping()
+{
+	if (data_ && owned_)
+	{
+		munmap((void*)data_, size_);
+	}
+}
+
+const void* Mapping::Data() const
+{
+	// empty files cannot be mapped, hand out an empty string for those
+	return data_ ? data_ : "";
+}
+
+size_t Mapping::Size() const
+{
+	return size_;
+}
+
+static std::shared_ptr<const Mapping> MapFile(const std::string& file_name)
+{
+	const int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return nullptr;
+	}
+
+	std::shared_ptr<const Mapping> result;
+	struct stat info;
+	if (fstat(fd, &info) == 0)
+	{
+		const size_t size = info.st_size;
+		void* data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+		if (data != MAP_FAILED)
+		{
+			result = std::make_shared<const Mapping>(data, size, true);
+		}
+	}
+
+	close(fd);
+	return result;
+}
+
+// reconstructs a delta into memory of its own, page aligned like a mapped file
+static std::shared_ptr<const Mapping> ReadRecord(const Archive& archive, const ArchiveEntry& record)
+{
+	const size_t size = record.size;
+	void* data = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : nullptr;
+	if (data == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	if (!archive.Read(record, data))
+	{
+		if (data)
+		{
+			munmap(data, size);
+		}
+		return nullptr;
+	}
+	if (data)
+	{
+		mprotect(data, size, PROT_READ);
+	}
+	return std::make_shared<const Mapping>(data, size, true);
+}
+
+Store::Store()
+	: enabled_     { false }
+	, dumping_     { true }
+	, legacy_hash_ { false }
+	, budget_      { (size_t)256 << 20 }
+	, writer_      { k_shader_directory, k_dump_queue_limit }
+	, use_archive_ { false }
+	, watching_    { false }
+	, cached_      { 0 }
+{
+	const char* legacy_hash = std::getenv("DESHADE_LEGACY_HASH");
+	legacy_hash_ = legacy_hash && *legacy_hash == '1';
+
+	const char* budget = std::getenv("DESHADE_CACHE_MB");
+	if (budget)
+	{
+		budget_ = (size_t)std::strtoull(budget, nullptr, 10) << 20;
+	}
+
+	const char* delta = std::getenv("DESHADE_DELTA");
+	const char* archive = std::getenv("DESHADE_ARCHIVE");
+	if (archive && *archive)
+	{
+		OpenArchive(archive, delta && *delta == '1');
+	}
+	else
+	{
+		if (delta && *delta == '1')
+		{
+			LogError("DESHADE_DELTA=1 needs DESHADE_ARCHIVE, shaders are dumped whole\n");
+		}
+		ScanDirectory();
+	}
+}
+
+void Store::OpenArchive(const char* file_name, bool delta)
+{
+	// the writer creates the archive when it does not exist yet so it has to go first,
+	// when another process writes it already this one only replaces
+	dumping_ = writer_.OpenArchive(file_name, delta);
+	if (!archive_.Open(file_name))
+	{
+		LogError("Failed to open archive \"%\", shaders will not be dumped or replaced\n", file_name);
+		return;
+	}
+	if (!dumping_)
+	{
+		LogError("Archive \"%\" is written by another process, shaders will not be dumped\n", file_name);
+	}
+
+	size_t deltas = 0;
+	for (const ArchiveEntry& entry : archive_)
+	{
+		deltas += entry.base != 0;
+	}
+
+	enabled_ = true;
+	use_archive_ = true;
+	Log("Opened archive \"%\" with % shaders, % of them deltas\n", file_name, archive_.end() - archive_.begin(), deltas);
+}
+
+void Store::ScanDirectory()
+{
+	DIR* directory = opendir(k_shader_directory);
+	if (!directory)
+	{
+		Log("No \"%\" directory, shaders will not be dumped or replaced\n", k_shader_directory);
+		return;
+	}
+
+	enabled_ = true;
+	size_t shaders = 0;
+	while (struct dirent* entry = readdir(directory))
+	{
+		if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+		{
+			continue;
+		}
+		// <32 hexadecimal digits><suffix>
+		Hash hash;
+		if (ParseHash(entry->d_name, hash))
+		{
+			const char* suffix = entry->d_name + sizeof hash.bytes * 2;
+			ShardOf(hash).index.insert({ hash, Entry { suffix, false, nullptr, lru_.end() } });
+			shaders += *suffix != '.';
+		}
+	}
+	closedir(directory);
+
+	Log("Indexed % shaders in \"%\"\n", shaders, k_shader_directory);
+}
+
+Store& Store::Get()
+{
+	// leaks on exit like the contexts, shaders can still be created while exiting
+	static std::once_flag once;
+	std::call_once(once, [](){ store_ = new Store; });
+	return *store_;
+}
+
+// runs on dlclose and at exit, after static destructors and the destructors which
+// still dump to the store but before the logger stops
+__attribute__((destructor(102))) static void ShutdownStore()
+{
+	if (store_)
+	{
+		store_->Shutdown();
+	}
+}
+
+bool Store::Enabled() const
+{
+	return enabled_;
+}
+
+bool Store::LegacyHash() const
+{
+	return legacy_hash_;
+}
+
+Store::Shard& Store::ShardOf(const Hash& hash)
+{
+	// the unordered map buckets by the leading bytes, pick shards by the last one
+	return shards_[hash.bytes[sizeof hash.bytes - 1] % k_shards];
+}
+
+Store::Entry* Store::Lookup(Shard& shard, const Hash& hash, const char* suffix)
+{
+	auto range = shard.index.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (it->second.suffix == suffix)
+		{
+			return &it->second;
+		}
+	}
+	return nullptr;
+}
+
+void Store::Evict(const Entry* keep)
+{
+	while (cached_ > budget_ && !lru_.empty() && lru_.back() != keep)
+	{
+		Entry* entry = lru_.back();
+		lru_.pop_back();
+		cached_ -= entry->mapping->Size();
+		entry->mapping.reset();
+		entry->lru = lru_.end();
+	}
+}
+
+std::shared_ptr<const Mapping> Store::Find(const Hash& hash, const char* suffix)
+{
+	if (!enabled_)
+	{
+		return nullptr;
+	}
+
+	// the archive is mapped as a whole for as long as deshade is loaded, only deltas
+	// have to be reconstructed and are cached like mapped files
+	const ArchiveEntry* record = nullptr;
+	if (use_archive_)
+	{
+		record = archive_.Find(hash, suffix);
+		if (!record)
+		{
+			return nullptr;
+		}
+		if (!record->base)
+		{
+			return std::make_shared<const Mapping>(archive_.Data(*record), record->size, false);
+		}
+	}
+
+	Entry* entry = nullptr;
+	{
+		Shard& shard = ShardOf(hash);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		entry = Lookup(shard, hash, suffix);
+		if (!entry && record)
+		{
+			entry = &shard.index.insert({ hash, Entry { suffix, false, nullptr, lru_.end() } })->second;
+		}
+		if (!entry || entry->dumped)
+		{
+			return nullptr;
+		}
+	}
+
+	// entries are never removed from the index so entry stays valid without the
+	// shard lock
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex_);
+		if (entry->mapping)
+		{
+			lru_.splice(lru_.begin(), lru_, entry->lru);
+			return entry->mapping;
+		}
+	}
+
+	// map or reconstruct outside of the lock
+	std::shared_ptr<const Mapping> mapping = record ? ReadRecord(archive_, *record) : MapFile(Path(hash, suffix));
+	if (!mapping && record)
+	{
+		LogError("Failed to reconstruct \"%\" (%) from the archive\n", hash, suffix);
+		return nullptr;
+	}
+	if (!mapping)
+	{
+		LogError("Failed to map replacement \"%\"\n", Path(hash, suffix));
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(cache_mutex_);
+	if (!entry->mapping)
+	{
+		entry->mapping = mapping;
+		lru_.push_front(entry);
+		entry->lru = lru_.begin();
+		cached_ += mapping->Size();
+		Evict(entry);
+	}
+	return entry->mapping;
+}
+
+bool Store::Insert(const Hash& hash, const char* suffix)
+{
+	if (!enabled_ || !dumping_)
+	{
+		return false;
+	}
+
+	Shard& shard = ShardOf(hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (Lookup(shard, hash, suffix) || (use_archive_ && archive_.Find(hash, suffix)))
+	{
+		return false;
+	}
+	shard.index.insert({ hash, Entry { suffix, true, nullptr, lru_.end() } });
+	return true;
+}
+
+void Store::Dump(const Hash& hash, const char* suffix, std::vector<char>&& contents)
+{
+	if (!dumping_)
+	{
+		return;
+	}
+	writer_.Enqueue(hash, suffix, std::move(contents));
+}
+
+void Store::Watch()
+{
+	if (!enabled_ || use_archive_ || watching_.exchange(true))
+	{
+		return;
+	}
+
+	const char* hot_reload = std::getenv("DESHADE_HOT_RELOAD");
+	if (hot_reload && *hot_reload == '1')
+	{
+		watcher_.Start(k_shader_directory);
+	}
+}
+
+bool Store::Changed() const
+{
+	return watcher_.Pending();
+}
+
+std::vector<Replacement> Store::Changes()
+{
+	std::vector<Replacement> changes;
+	for (const std::string& name : watcher_.Take())
+	{
+		// <32 hexadecimal digits><suffix>, caches and the writer's temporary files
+		// are not replacements
+		Hash hash;
+		const char* suffix = name.c_str() + sizeof hash.bytes * 2;
+		const size_t length = name.size();
+		if (!ParseHash(name.c_str(), hash) || *suffix == '.'
+		 || (length > 4 && !name.compare(length - 4, 4, ".tmp")))
+		{
+			continue;
+		}
+
+		std::shared_ptr<const Mapping> mapping = MapFile(Path(hash, suffix));
+		if (!mapping)
+		{
+			LogError("Failed to map replacement \"%\"\n", Path(hash, suffix));
+			continue;
+		}
+
+		// the writer renaming a dump into place is not an edit, a dump becomes a
+		// replacement like any other once its contents differ from the original
+		bool dumped = false;
+		{
+			Shard& shard = ShardOf(hash);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			const Entry* entry = Lookup(shard, hash, suffix);
+			dumped = entry && entry->dumped;
+		}
+		if (dumped && Hash128(mapping->Data(), mapping->Size()) == hash)
+		{
+			continue;
+		}
+
+		Entry* entry = nullptr;
+		{
+			Shard& shard = ShardOf(hash);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			entry = Lookup(shard, hash, suffix);
+			if (!entry)
+			{
+				entry = &shard.index.insert({ hash, Entry { suffix, false, nullptr, lru_.end() } })->second;
+			}
+			entry->dumped = false;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(cache_mutex_);
+			if (entry->mapping)
+			{
+				cached_ -= entry->mapping->Size();
+				lru_.splice(lru_.begin(), lru_, entry->lru);
+			}
+			else
+			{
+				lru_.push_front(entry);
+				entry->lru = lru_.begin();
+			}
+			entry->mapping = mapping;
+			cached_ += mapping->Size();
+			Evict(entry);
+		}
+
+		changes.push_back(Replacement { hash, suffix, mapping });
+	}
+	return changes;
+}
+
+void Store::Shutdown()
+{
+	watcher_.Stop();
+	writer_.Stop();
+}
+
+std::string Store::Path(const Hash& hash, const char* suffix) const
+{
+	char hex[sizeof hash.bytes * 2 + 1];
+	hash.Format(hex);
+	return std::string(k_shader_directory) + "/" + hex + suffix;
+}
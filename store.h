@@ -0,0 +1,136 @@
+#ifndef STORE_H
+#define STORE_H
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "hash.h"
+#include "writer.h"
+#include "archive.h"
+#include "watcher.h"
+
+// read only view of a replacement file mapped into memory, the view stays valid for
+// as long as a reference to it is held, even after the store has evicted it
+struct Mapping
+{
+	// owned mappings are unmapped on destruction, views into the archive are not
+	Mapping(const void* data, size_t size, bool owned);
+	~Mapping();
+
+	const void* Data() const;
+	size_t Size() const;
+
+private:
+	Mapping(const Mapping&) = delete;
+	Mapping& operator=(const Mapping&) = delete;
+
+	const void* data_;
+	size_t size_;
+	bool owned_;
+};
+
+// a replacement edited while the application runs
+struct Replacement
+{
+	Hash hash;
+	std::string suffix;
+	std::shared_ptr<const Mapping> contents;
+};
+
+// index of the shaders/ directory, built once with a single directory scan so that
+// a lookup never touches the file system unless a replacement actually exists, or
+// the archive named by DESHADE_ARCHIVE used in place of the directory, which stores
+// shaders as deltas against similar ones with DESHADE_DELTA=1
+//
+// shaders use suffixes starting with an underscore, suffixes starting with a dot are
+// caches deshade builds for itself which are stored the same way
+struct Store
+{
+	static Store& Get();
+
+	// false when there is no shaders/ directory, nothing is replaced or dumped then
+	bool Enabled() const;
+
+	// also look for replacements named with the djbx33ax4 hash of older versions
+	bool LegacyHash() const;
+
+	// replacement contents for hash and suffix, nullptr when there is no replacement
+	std::shared_ptr<const Mapping> Find(const Hash& hash, const char* suffix);
+
+	// claim a dump for hash and suffix, false when a file for it exists already or
+	// another caller claimed it before
+	bool Insert(const Hash& hash, const char* suffix);
+
+	// hand contents claimed with Insert to the writer thread, caches are written
+	// through here without a claim and replace what was there before, nothing is
+	// claimed or written while another process writes the archive
+	void Dump(const Hash& hash, const char* suffix, std::vector<char>&& contents);
+
+	// watch the shaders/ directory for replacements edited while the application
+	// runs, only the first call does anything and archives are never watched
+	void Watch();
+
+	// true when replacements were edited since the last call to Changes
+	bool Changed() const;
+
+	// replacements edited since the last call, lookups see the new contents too
+	std::vector<Replacement> Changes();
+
+	// write out every pending dump and stop the writer thread, this happens
+	// automatically when deshade is unloaded or the process exits
+	void Shutdown();
+
+	// shaders/<hash><suffix>
+	std::string Path(const Hash& hash, const char* suffix) const;
+
+private:
+	Store();
+
+	struct Entry
+	{
+		std::string suffix;
+		// written by this process, the contents are the same as the original
+		bool dumped;
+		std::shared_ptr<const Mapping> mapping;
+		std::list<Entry*>::iterator lru;
+	};
+
+	// the index is split by hash so that shaders created from many threads at once
+	// only contend when their hashes land in the same shard
+	struct alignas(64) Shard
+	{
+		std::mutex mutex;
+		std::unordered_multimap<Hash, Entry> index;
+	};
+
+	static const size_t k_shards = 16;
+
+	Shard& ShardOf(const Hash& hash);
+	static Entry* Lookup(Shard& shard, const Hash& hash, const char* suffix);
+	void Evict(const Entry* keep);
+	void OpenArchive(const char* file_name, bool delta);
+	void ScanDirectory();
+
+	bool enabled_;
+	bool dumping_;
+	bool legacy_hash_;
+	size_t budget_;
+	Writer writer_;
+	Archive archive_;
+	bool use_archive_;
+	Watcher watcher_;
+	std::atomic<bool> watching_;
+
+	Shard shards_[k_shards];
+
+	// mappings of entries and everything below protected by cache_mutex_, only
+	// taken when a replacement exists
+	std::mutex cache_mutex_;
+	std::list<Entry*> lru_;
+	size_t cached_;
+};
+
+#endif
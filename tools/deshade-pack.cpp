@@ -0,0 +1,228 @@
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+extern "C"
+{
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include "../archive.h"
+#include "../hash.h"
+
+// converts between the shaders/ directory layout and a single archive file, with -d
+// shaders are packed as deltas against similar ones
+
+static bool ReadFile(const std::string& file_name, std::vector<char>& contents)
+{
+	const int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	contents.clear();
+	char buffer[65536];
+	for (;;)
+	{
+		const ssize_t count = read(fd, buffer, sizeof buffer);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			close(fd);
+			return count == 0;
+		}
+		contents.insert(contents.end(), buffer, buffer + count);
+	}
+}
+
+static bool WriteFile(const std::string& file_name, const void* data, size_t size)
+{
+	const int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	const char* p = (const char*)data;
+	while (size)
+	{
+		const ssize_t count = write(fd, p, size);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			break;
+		}
+		p += count;
+		size -= count;
+	}
+	close(fd);
+	return size == 0;
+}
+
+static int Pack(const char* directory_name, const char* archive_name, bool delta)
+{
+	DIR* directory = opendir(directory_name);
+	if (!directory)
+	{
+		std::fprintf(stderr, "could not open directory \"%s\"\n", directory_name);
+		return 1;
+	}
+
+	ArchiveWriter archive;
+	if (!archive.Open(archive_name))
+	{
+		std::fprintf(stderr, "could not open archive \"%s\"\n", archive_name);
+		closedir(directory);
+		return 1;
+	}
+	if (delta)
+	{
+		archive.EnableDelta();
+	}
+
+	size_t packed = 0;
+	uint64_t packed_bytes = 0;
+	std::vector<char> contents;
+	while (struct dirent* entry = readdir(directory))
+	{
+		// <32 hexadecimal digits><suffix>, leftovers of interrupted dumps are skipped
+		Hash hash;
+		const char* suffix = entry->d_name + sizeof hash.bytes * 2;
+		const size_t length = std::strlen(entry->d_name);
+		if (!ParseHash(entry->d_name, hash) || (length > 4 && !std::strcmp(entry->d_name + length - 4, ".tmp")))
+		{
+			continue;
+		}
+
+		const std::string file_name = std::string(directory_name) + "/" + entry->d_name;
+		if (!ReadFile(file_name, contents))
+		{
+			std::fprintf(stderr, "could not read \"%s\"\n", file_name.c_str());
+			continue;
+		}
+		if (!archive.Append(hash, suffix, contents.data(), contents.size()))
+		{
+			std::fprintf(stderr, "could not append \"%s\"\n", file_name.c_str());
+			continue;
+		}
+		packed++;
+		packed_bytes += contents.size();
+	}
+	closedir(directory);
+
+	if (!archive.Commit())
+	{
+		std::fprintf(stderr, "could not write the index of \"%s\"\n", archive_name);
+		return 1;
+	}
+
+	struct stat info;
+	const unsigned long long archive_bytes = stat(archive_name, &info) == 0 ? info.st_size : 0;
+	std::printf("packed %zu shaders of %llu bytes into \"%s\" of %llu bytes\n",
+		packed, (unsigned long long)packed_bytes, archive_name, archive_bytes);
+	return 0;
+}
+
+static int Unpack(const char* archive_name, const char* directory_name)
+{
+	Archive archive;
+	if (!archive.Open(archive_name))
+	{
+		std::fprintf(stderr, "could not open archive \"%s\"\n", archive_name);
+		return 1;
+	}
+
+	if (mkdir(directory_name, 0755) != 0 && errno != EEXIST)
+	{
+		std::fprintf(stderr, "could not create directory \"%s\"\n", directory_name);
+		return 1;
+	}
+
+	size_t unpacked = 0;
+	std::vector<char> contents;
+	for (const ArchiveEntry& entry : archive)
+	{
+		char hex[sizeof entry.hash.bytes * 2 + 1];
+		entry.hash.Format(hex);
+		const std::string file_name = std::string(directory_name) + "/" + hex + entry.suffix;
+		contents.resize(entry.size);
+		if (!archive.Read(entry, contents.data()))
+		{
+			std::fprintf(stderr, "could not reconstruct \"%s%s\"\n", hex, entry.suffix);
+			continue;
+		}
+		if (!WriteFile(file_name, contents.data(), contents.size()))
+		{
+			std::fprintf(stderr, "could not write \"%s\"\n", file_name.c_str());
+			continue;
+		}
+		unpacked++;
+	}
+
+	std::printf("unpacked %zu shaders into \"%s\"\n", unpacked, directory_name);
+	return 0;
+}
+
+static int List(const char* archive_name)
+{
+	Archive archive;
+	if (!archive.Open(archive_name))
+	{
+		std::fprintf(stderr, "could not open archive \"%s\"\n", archive_name);
+		return 1;
+	}
+
+	for (const ArchiveEntry& entry : archive)
+	{
+		char hex[sizeof entry.hash.bytes * 2 + 1];
+		entry.hash.Format(hex);
+		// deltas also list what they take in the archive
+		if (entry.base)
+		{
+			std::printf("%s%s %llu %llu\n", hex, entry.suffix, (unsigned long long)entry.size, (unsigned long long)entry.stored);
+		}
+		else
+		{
+			std::printf("%s%s %llu\n", hex, entry.suffix, (unsigned long long)entry.size);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc == 4 && !std::strcmp(argv[1], "pack"))
+	{
+		return Pack(argv[2], argv[3], false);
+	}
+	else if (argc == 5 && !std::strcmp(argv[1], "pack") && !std::strcmp(argv[2], "-d"))
+	{
+		return Pack(argv[3], argv[4], true);
+	}
+	else if (argc == 4 && !std::strcmp(argv[1], "unpack"))
+	{
+		return Unpack(argv[2], argv[3]);
+	}
+	else if (argc == 3 && !std::strcmp(argv[1], "list"))
+	{
+		return List(argv[2]);
+	}
+
+	std::fprintf(stderr,
+		"usage: %s pack [-d] <directory> <archive>\n"
+		"       %s unpack <archive> <directory>\n"
+		"       %s list <archive>\n", argv[0], argv[0], argv[0]);
+	return 1;
+}
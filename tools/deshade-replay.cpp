@@ -0,0 +1,676 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib> // std::atoi, setenv
+#include <cstring>
+
+extern "C"
+{
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../archive.h"
+#include "../hash.h"
+#include "../glsl.h"
+#include "../spirv.h"
+
+// compiles every shader of a shaders/ directory or archive through headless OpenGL
+// contexts, which Mesa's llvmpipe provides on machines without a GPU, and reports
+// how long each one took and which ones failed
+//
+//   deshade-replay [-j threads] [-c] [-w] [shaders directory or archive]
+//
+// -c replays with a compatibility profile context instead of a core profile one
+// -w writes the caches deshade loads at startup for this driver
+//
+// includes are resolved against shaders/include like deshade does, so this runs in
+// the directory the application runs in
+typedef const GLubyte* (*GLGETSTRINGPROC)(GLenum);
+
+#define REPLAY_FUNCTIONS(X) \
+	X(glGetString, GLGETSTRINGPROC) \
+	X(glCreateShader, PFNGLCREATESHADERPROC) \
+	X(glShaderSource, PFNGLSHADERSOURCEPROC) \
+	X(glCompileShader, PFNGLCOMPILESHADERPROC) \
+	X(glGetShaderiv, PFNGLGETSHADERIVPROC) \
+	X(glGetShaderInfoLog, PFNGLGETSHADERINFOLOGPROC) \
+	X(glDeleteShader, PFNGLDELETESHADERPROC) \
+	X(glCreateProgram, PFNGLCREATEPROGRAMPROC) \
+	X(glProgramParameteri, PFNGLPROGRAMPARAMETERIPROC) \
+	X(glAttachShader, PFNGLATTACHSHADERPROC) \
+	X(glLinkProgram, PFNGLLINKPROGRAMPROC) \
+	X(glGetProgramiv, PFNGLGETPROGRAMIVPROC) \
+	X(glGetProgramInfoLog, PFNGLGETPROGRAMINFOLOGPROC) \
+	X(glDeleteProgram, PFNGLDELETEPROGRAMPROC)
+
+struct FunctionsGL
+{
+	#define X(name, type) type name;
+	REPLAY_FUNCTIONS(X)
+	#undef X
+};
+
+// the suffixes deshade names GLSL shaders with
+static const struct
+{
+	const char* suffix;
+	GLenum type;
+	const char* name;
+} k_stages[] =
+{
+	{ "_vs.glsl", GL_VERTEX_SHADER, "vertex" },
+	{ "_fs.glsl", GL_FRAGMENT_SHADER, "fragment" },
+	{ "_cs.glsl", GL_COMPUTE_SHADER, "compute" },
+	{ "_gs.glsl", GL_GEOMETRY_SHADER, "geometry" },
+	{ "_tcs.glsl", GL_TESS_CONTROL_SHADER, "tessellation control" },
+	{ "_tes.glsl", GL_TESS_EVALUATION_SHADER, "tessellation evaluation" },
+};
+
+// the caches written with -w, the same deshade reads
+static const char* k_compiled_suffix = ".glcompiled";
+static const char* k_stripped_suffix = ".stripped";
+
+struct ShaderFile
+{
+	Hash hash;
+	std::string suffix;
+	std::vector<char> contents;
+};
+
+struct Result
+{
+	const ShaderFile* file;
+	const char* type;
+	// of the source the driver was given, includes resolved
+	Hash source;
+	// of the source and the shader type as DESHADE_PARALLEL=1 knows it by
+	Hash compiled;
+	uint64_t compile_nanoseconds;
+	uint64_t link_nanoseconds;
+	// "ok", "compile", "link", "invalid" or "skipped" when no thread got a context
+	const char* status;
+	std::string log;
+};
+
+static bool ReadFile(const std::string& file_name, std::vector<char>& contents)
+{
+	const int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	contents.clear();
+	char buffer[65536];
+	for (;;)
+	{
+		const ssize_t count = read(fd, buffer, sizeof buffer);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			close(fd);
+			return count == 0;
+		}
+		contents.insert(contents.end(), buffer, buffer + count);
+	}
+}
+
+static bool WriteFile(const std::string& file_name, const void* data, size_t size)
+{
+	const int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	const char* p = (const char*)data;
+	while (size)
+	{
+		const ssize_t count = write(fd, p, size);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			break;
+		}
+		p += count;
+		size -= count;
+	}
+	close(fd);
+	return size == 0;
+}
+
+static bool HasSuffix(const std::string& name, const char* suffix)
+{
+	const size_t length = std::strlen(suffix);
+	return name.size() >= length && !name.compare(name.size() - length, length, suffix);
+}
+
+// every shader of a directory or an archive, caches deshade builds for itself are
+// left out
+static bool ReadCorpus(const char* path, bool is_archive, std::vector<ShaderFile>& files)
+{
+	if (is_archive)
+	{
+		Archive archive;
+		if (!archive.Open(path))
+		{
+			return false;
+		}
+		for (const ArchiveEntry& entry : archive)
+		{
+			if (entry.suffix[0] != '_')
+			{
+				continue;
+			}
+			// deltas are reconstructed
+			std::vector<char> contents(entry.size);
+			if (!archive.Read(entry, contents.data()))
+			{
+				std::fprintf(stderr, "could not read %s%s from the archive\n", entry.hash.String().c_str(), entry.suffix);
+				continue;
+			}
+			files.push_back(ShaderFile { entry.hash, entry.suffix, std::move(contents) });
+		}
+		return true;
+	}
+
+	DIR* directory = opendir(path);
+	if (!directory)
+	{
+		return false;
+	}
+	while (struct dirent* entry = readdir(directory))
+	{
+		// <32 hexadecimal digits><suffix>, leftovers of interrupted dumps are skipped
+		ShaderFile file;
+		file.suffix = entry->d_name + std::min(std::strlen(entry->d_name), sizeof file.hash.bytes * 2);
+		if (!ParseHash(entry->d_name, file.hash) || file.suffix[0] != '_' || HasSuffix(file.suffix, ".tmp"))
+		{
+			continue;
+		}
+		const std::string file_name = std::string(path) + "/" + entry->d_name;
+		if (!ReadFile(file_name, file.contents))
+		{
+			std::fprintf(stderr, "could not read \"%s\"\n", file_name.c_str());
+			continue;
+		}
+		files.push_back(std::move(file));
+	}
+	closedir(directory);
+	return true;
+}
+
+static uint64_t Elapsed(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static EGLDisplay OpenDisplay()
+{
+	// surfaceless needs neither a GPU nor a window system
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT_ =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (eglGetPlatformDisplayEXT_)
+	{
+		display = eglGetPlatformDisplayEXT_(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	}
+	if (display == EGL_NO_DISPLAY)
+	{
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+	EGLint major = 0;
+	EGLint minor = 0;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+	{
+		return EGL_NO_DISPLAY;
+	}
+	return display;
+}
+
+// made current on the calling thread without a surface, EGL_NO_CONTEXT on failure
+static EGLContext CreateContext(EGLDisplay display, bool compatibility)
+{
+	// the API is bound per thread
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		return EGL_NO_CONTEXT;
+	}
+
+	EGLConfig config = (EGLConfig)0;
+	const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+	if (!extensions || !std::strstr(extensions, "EGL_KHR_no_config_context"))
+	{
+		const EGLint config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		EGLint count = 0;
+		if (!eglChooseConfig(display, config_attributes, &config, 1, &count) || count < 1)
+		{
+			return EGL_NO_CONTEXT;
+		}
+	}
+
+	// a core profile context reports the highest version the driver has, the same
+	// an application asking for any core profile gets
+	const EGLint core_attributes[] =
+	{
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 2,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	const EGLint compatibility_attributes[] = { EGL_NONE };
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT,
+		compatibility ? compatibility_attributes : core_attributes);
+	if (context == EGL_NO_CONTEXT)
+	{
+		return EGL_NO_CONTEXT;
+	}
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		eglDestroyContext(display, context);
+		return EGL_NO_CONTEXT;
+	}
+	return context;
+}
+
+static bool LoadFunctions(FunctionsGL& gl)
+{
+	bool result = true;
+	#define X(name, type) \
+		gl.name = (type)eglGetProcAddress(#name); \
+		result = result && gl.name;
+	REPLAY_FUNCTIONS(X)
+	#undef X
+	return result;
+}
+
+static std::string GetShaderInfoLog(const FunctionsGL& gl, GLuint shader)
+{
+	GLint length = 0;
+	gl.glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+	std::string log(length > 0 ? length : 0, '\0');
+	if (length > 0)
+	{
+		gl.glGetShaderInfoLog(shader, length, &length, &log[0]);
+		log.resize(length);
+	}
+	return log;
+}
+
+static std::string GetProgramInfoLog(const FunctionsGL& gl, GLuint program)
+{
+	GLint length = 0;
+	gl.glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+	std::string log(length > 0 ? length : 0, '\0');
+	if (length > 0)
+	{
+		gl.glGetProgramInfoLog(program, length, &length, &log[0]);
+		log.resize(length);
+	}
+	return log;
+}
+
+static void Replay(const FunctionsGL& gl, GLenum type, Result& result)
+{
+	const ShaderFile& file = *result.file;
+	const GLSLSource source = Preprocessor::Get().Process(file.contents.data(), file.contents.size());
+	const GLchar* shader_data = source.text ? source.text->data() : file.contents.data();
+	const GLint shader_size = source.text ? source.text->size() : file.contents.size();
+	result.source = source.hash;
+	result.compiled = GetCompiledKey(source.hash, type);
+
+	// the status is asked for right away so the time includes a driver compiling in
+	// the background
+	auto start = std::chrono::steady_clock::now();
+	const GLuint shader = gl.glCreateShader(type);
+	gl.glShaderSource(shader, 1, &shader_data, &shader_size);
+	gl.glCompileShader(shader);
+	GLint status = GL_FALSE;
+	gl.glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	result.compile_nanoseconds = Elapsed(start);
+	if (status != GL_TRUE)
+	{
+		result.status = "compile";
+		result.log = GetShaderInfoLog(gl, shader);
+		gl.glDeleteShader(shader);
+		return;
+	}
+
+	// linked on its own as a separable program, drivers may only generate code then
+	start = std::chrono::steady_clock::now();
+	const GLuint program = gl.glCreateProgram();
+	gl.glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+	gl.glAttachShader(program, shader);
+	gl.glLinkProgram(program);
+	gl.glGetProgramiv(program, GL_LINK_STATUS, &status);
+	result.link_nanoseconds = Elapsed(start);
+	result.status = status == GL_TRUE ? "ok" : "link";
+	if (status != GL_TRUE)
+	{
+		result.log = GetProgramInfoLog(gl, program);
+	}
+	gl.glDeleteProgram(program);
+	gl.glDeleteShader(shader);
+}
+
+// every thread compiles with a context of its own, the first count results are handed
+// out in order
+static void ReplayThread(EGLDisplay display, bool compatibility, const FunctionsGL& gl, std::vector<Result>& results, size_t count, std::atomic<size_t>& next)
+{
+	EGLContext context = CreateContext(display, compatibility);
+	if (context == EGL_NO_CONTEXT)
+	{
+		std::fprintf(stderr, "could not create a context on a replay thread\n");
+		return;
+	}
+	for (size_t i = next++; i < count; i = next++)
+	{
+		for (const auto& stage : k_stages)
+		{
+			if (results[i].file->suffix == stage.suffix)
+			{
+				Replay(gl, stage.type, results[i]);
+				break;
+			}
+		}
+	}
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+}
+
+// SPIR-V is only checked for being well formed, compiling it needs the pipeline state
+// of the application
+static void Check(Result& result)
+{
+	const ShaderFile& file = *result.file;
+	const SpirvModule module = IndexSpirv(file.contents.data(), file.contents.size());
+	result.source = module.hash;
+	result.status = module.valid && !module.entry_points.empty() ? "ok" : "invalid";
+	if (!module.valid)
+	{
+		result.log = "not a SPIR-V module or truncated";
+	}
+	else if (module.entry_points.empty())
+	{
+		result.log = "no entry points";
+	}
+}
+
+// caches are written to the directory or appended to the archive the shaders came from
+struct CacheWriter
+{
+	CacheWriter(const char* path, bool is_archive)
+		: path_       { path }
+		, is_archive_ { is_archive }
+	{
+		// appending writes over the index, what is there is read before
+		Archive archive;
+		if (is_archive_ && archive.Open(path))
+		{
+			for (const ArchiveEntry& entry : archive)
+			{
+				std::vector<char> contents(entry.size);
+				if (entry.suffix[0] == '.' && archive.Read(entry, contents.data()))
+				{
+					caches_.insert({ Name(entry.hash, entry.suffix), std::move(contents) });
+				}
+			}
+		}
+	}
+
+	// existing contents of a cache, empty when there is none
+	std::vector<char> Read(const Hash& hash, const char* suffix)
+	{
+		std::vector<char> contents;
+		if (!is_archive_)
+		{
+			ReadFile(path_ + "/" + Name(hash, suffix), contents);
+			return contents;
+		}
+		auto find = caches_.find(Name(hash, suffix));
+		if (find != caches_.end())
+		{
+			contents = find->second;
+		}
+		return contents;
+	}
+
+	bool Write(const Hash& hash, const char* suffix, const void* data, size_t size)
+	{
+		if (!is_archive_)
+		{
+			return WriteFile(path_ + "/" + Name(hash, suffix), data, size);
+		}
+		if (!archive_open_ && !(archive_open_ = archive_.Open(path_.c_str())))
+		{
+			return false;
+		}
+		return archive_.Append(hash, suffix, data, size);
+	}
+
+	bool Commit()
+	{
+		return !archive_open_ || archive_.Commit();
+	}
+
+private:
+	static std::string Name(const Hash& hash, const char* suffix)
+	{
+		char hex[sizeof hash.bytes * 2 + 1];
+		hash.Format(hex);
+		return hex + std::string(suffix);
+	}
+
+	std::string path_;
+	bool is_archive_;
+	std::unordered_map<std::string, std::vector<char>> caches_;
+	ArchiveWriter archive_;
+	bool archive_open_ = false;
+};
+
+// sources which compiled are merged into what deshade learnt with DESHADE_PARALLEL=1
+// before, under the same key of the driver's vendor, renderer and version
+static size_t WriteCompiled(CacheWriter& writer, const FunctionsGL& gl, const std::vector<Result>& results)
+{
+	Hasher hasher;
+	for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+	{
+		const char* string = (const char*)gl.glGetString(name);
+		hasher.Update(string ? string : "", string ? std::strlen(string) + 1 : 1);
+	}
+	const Hash key = hasher.Final();
+
+	const std::vector<char> existing = writer.Read(key, k_compiled_suffix);
+	const Hash* hashes = (const Hash*)existing.data();
+	std::unordered_set<Hash> compiled(hashes, hashes + existing.size() / sizeof(Hash));
+	for (const Result& result : results)
+	{
+		if (std::strcmp(result.type, "spirv") && (!std::strcmp(result.status, "ok") || !std::strcmp(result.status, "link")))
+		{
+			compiled.insert(result.compiled);
+		}
+	}
+
+	std::vector<Hash> sorted(compiled.begin(), compiled.end());
+	std::sort(sorted.begin(), sorted.end());
+	if (!writer.Write(key, k_compiled_suffix, sorted.data(), sorted.size() * sizeof(Hash)))
+	{
+		std::fprintf(stderr, "could not write the compiled sources of \"%s\"\n", key.String().c_str());
+		return 0;
+	}
+	return sorted.size();
+}
+
+// SPIR-V without debug information for DESHADE_STRIP=1, keyed by the module
+static size_t WriteStripped(CacheWriter& writer, const std::vector<Result>& results)
+{
+	size_t written = 0;
+	for (const Result& result : results)
+	{
+		if (std::strcmp(result.type, "spirv") || std::strcmp(result.status, "ok")
+		 || !writer.Read(result.source, k_stripped_suffix).empty())
+		{
+			continue;
+		}
+		const std::vector<char>& contents = result.file->contents;
+		const std::vector<uint32_t> stripped = StripSpirv(contents.data(), IndexSpirv(contents.data(), contents.size()));
+		if (!stripped.empty() && writer.Write(result.source, k_stripped_suffix, stripped.data(), stripped.size() * sizeof(uint32_t)))
+		{
+			written++;
+		}
+	}
+	return written;
+}
+
+int main(int argc, char** argv)
+{
+	// the preprocessor logs through deshade's logger, which writes deshade.txt
+	setenv("DESHADE_LOG", "none", 0);
+
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	bool compatibility = false;
+	bool warm = false;
+	const char* path = "shaders";
+	int option;
+	while ((option = getopt(argc, argv, "j:cw")) != -1)
+	{
+		switch (option)
+		{
+		case 'j':
+			threads = std::max(1, std::atoi(optarg));
+			break;
+		case 'c':
+			compatibility = true;
+			break;
+		case 'w':
+			warm = true;
+			break;
+		default:
+			std::fprintf(stderr, "usage: %s [-j threads] [-c] [-w] [shaders directory or archive]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+	{
+		path = argv[optind];
+	}
+
+	struct stat info;
+	const bool is_archive = stat(path, &info) == 0 && S_ISREG(info.st_mode);
+	std::vector<ShaderFile> files;
+	if (!ReadCorpus(path, is_archive, files))
+	{
+		std::fprintf(stderr, "could not open \"%s\"\n", path);
+		return 1;
+	}
+
+	std::vector<Result> results;
+	for (const ShaderFile& file : files)
+	{
+		for (const auto& stage : k_stages)
+		{
+			if (file.suffix == stage.suffix)
+			{
+				results.push_back(Result { &file, stage.name, { }, { }, 0, 0, "skipped", { } });
+			}
+		}
+	}
+	const size_t glsl = results.size();
+	for (const ShaderFile& file : files)
+	{
+		if (HasSuffix(file.suffix, ".bin"))
+		{
+			results.push_back(Result { &file, "spirv", { }, { }, 0, 0, "invalid", { } });
+			Check(results.back());
+		}
+	}
+
+	// the first context only loads functions and names the driver
+	EGLDisplay display = OpenDisplay();
+	EGLContext context = display != EGL_NO_DISPLAY ? CreateContext(display, compatibility) : EGL_NO_CONTEXT;
+	FunctionsGL gl;
+	if (context == EGL_NO_CONTEXT || !LoadFunctions(gl))
+	{
+		std::fprintf(stderr, "could not create a headless OpenGL %s context\n", compatibility ? "compatibility" : "core");
+		return 1;
+	}
+	threads = std::min(threads, std::max<size_t>(glsl, 1));
+	const char* renderer = (const char*)gl.glGetString(GL_RENDERER);
+	const char* version = (const char*)gl.glGetString(GL_VERSION);
+	std::fprintf(stderr, "replaying %zu shaders on %zu threads with %s, %s\n",
+		results.size(), threads, renderer ? renderer : "<unknown>", version ? version : "<unknown>");
+
+	std::atomic<size_t> next { 0 };
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < threads; i++)
+	{
+		workers.emplace_back(ReplayThread, display, compatibility, std::cref(gl), std::ref(results), glsl, std::ref(next));
+	}
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	const double seconds = Elapsed(start) / 1e9;
+
+	// slowest first like deshade's profile
+	std::sort(results.begin(), results.end(), [](const Result& lhs, const Result& rhs)
+	{
+		return lhs.compile_nanoseconds + lhs.link_nanoseconds > rhs.compile_nanoseconds + rhs.link_nanoseconds;
+	});
+	size_t failed = 0;
+	std::printf("hash,suffix,type,size,compile_ms,link_ms,status\n");
+	for (const Result& result : results)
+	{
+		char hex[sizeof result.file->hash.bytes * 2 + 1];
+		result.file->hash.Format(hex);
+		std::printf("%s,%s,%s,%zu,%.3f,%.3f,%s\n", hex, result.file->suffix.c_str(), result.type,
+			result.file->contents.size(), result.compile_nanoseconds / 1e6, result.link_nanoseconds / 1e6, result.status);
+		if (std::strcmp(result.status, "ok"))
+		{
+			std::fprintf(stderr, "%s%s failed (%s)\n%s\n", hex, result.file->suffix.c_str(), result.status, result.log.c_str());
+			failed++;
+		}
+	}
+	std::fprintf(stderr, "replayed %zu shaders in %.3f seconds, %zu failed\n", results.size(), seconds, failed);
+
+	if (warm)
+	{
+		CacheWriter writer(path, is_archive);
+		const size_t compiled = WriteCompiled(writer, gl, results);
+		const size_t stripped = WriteStripped(writer, results);
+		if (!writer.Commit())
+		{
+			std::fprintf(stderr, "could not write the index of \"%s\"\n", path);
+			return 1;
+		}
+		std::fprintf(stderr, "wrote %zu compiled sources and %zu stripped modules to \"%s\"\n", compiled, stripped, path);
+	}
+
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+	eglTerminate(display);
+	return failed ? 1 : 0;
+}
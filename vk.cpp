@@ -1,13 +1,19 @@
+#include <atomic>
 #include <mutex>
 #include <vector>
+#include <shared_mutex>
 #include <unordered_map>
 #include <cstring>
 #include <cstdio>
+#include <cstdlib> // std::getenv
 
 #include <vulkan/vk_layer.h>
 
 #include "log.h"
 #include "hash.h"
+#include "names.h"
+#include "store.h"
+#include "spirv.h"
 
 template<typename T>
 void* DispatchKey(T instance)
@@ -15,19 +21,210 @@ void* DispatchKey(T instance)
 	return *(void **)instance;
 }
 
+// dispatch tables by the loader's dispatch pointer, open addressed over atomic slots
+// so that lookups never lock, an object is only looked up between its create and
+// destroy which the application already orders against each other, so a table can
+// be freed as soon as its object is destroyed
+template<typename T>
+struct DispatchMap
+{
+	// false when full, the caller still owns table then and has to fail the create as
+	// nothing can be forwarded for an object which is not found
+	bool Insert(void* key, T* table);
+	T* Find(void* key) const;
+	T* Erase(void* key);
+
+private:
+	static const size_t k_capacity = 256;
+
+	struct Slot
+	{
+		// nullptr when never used, Erased() once its object was destroyed, a lookup
+		// stops at the first unused slot
+		std::atomic<void*> key_ { nullptr };
+		std::atomic<T*> table_ { nullptr };
+	};
+
+	static void* Erased()
+	{
+		return (void *)uintptr_t(1);
+	}
+
+	static size_t Start(void* key)
+	{
+		return (((uintptr_t)key >> 4) * 0x9e3779b97f4a7c15u) >> 56;
+	}
+
+	Slot slots_[k_capacity];
+};
+
+template<typename T>
+bool DispatchMap<T>::Insert(void* key, T* table)
+{
+	for (size_t i = 0, slot = Start(key); i < k_capacity; i++, slot = (slot + 1) % k_capacity)
+	{
+		void* current = slots_[slot].key_.load(std::memory_order_relaxed);
+		if ((current == nullptr || current == Erased())
+		 && slots_[slot].key_.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+		{
+			slots_[slot].table_.store(table, std::memory_order_release);
+			return true;
+		}
+	}
+	return false;
+}
+
+template<typename T>
+T* DispatchMap<T>::Find(void* key) const
+{
+	for (size_t i = 0, slot = Start(key); i < k_capacity; i++, slot = (slot + 1) % k_capacity)
+	{
+		void* current = slots_[slot].key_.load(std::memory_order_acquire);
+		if (current == key)
+		{
+			return slots_[slot].table_.load(std::memory_order_acquire);
+		}
+		if (!current)
+		{
+			break;
+		}
+	}
+	return nullptr;
+}
+
+// the caller frees the table
+template<typename T>
+T* DispatchMap<T>::Erase(void* key)
+{
+	for (size_t i = 0, slot = Start(key); i < k_capacity; i++, slot = (slot + 1) % k_capacity)
+	{
+		void* current = slots_[slot].key_.load(std::memory_order_acquire);
+		if (current == key)
+		{
+			T* table = slots_[slot].table_.exchange(nullptr, std::memory_order_acq_rel);
+			slots_[slot].key_.store(Erased(), std::memory_order_release);
+			return table;
+		}
+		if (!current)
+		{
+			break;
+		}
+	}
+	return nullptr;
+}
+
+// pipelines built from replaced shaders miss whatever pipeline cache the application
+// ships, so every device gets a pipeline cache of its own which is stored with the
+// shaders and keyed by the driver
+//
+//   header    PipelineCacheHeader
+//   replaced  ReplacedShader[count]
+//   data      what vkGetPipelineCacheData returned
+static const char* k_pipeline_cache_suffix = ".vkpipelines";
+
+struct PipelineCacheHeader
+{
+	char magic[8];
+	uint64_t count;
+};
+
+static const char k_pipeline_cache_magic[8] = { 'D', 'E', 'S', 'H', 'A', 'D', 'E', 'P' };
+
+// a replacement whose contents differ from the module the application created, the
+// cache is only loaded while every replacement it was built with is unchanged
+struct ReplacedShader
+{
+	Hash hash; // and suffix the replacement was found under
+	char suffix[16];
+	Hash contents;
+};
+
+struct DeviceVK
+{
+	VkLayerDispatchTable dispatch_;
+
+	// VK_NULL_HANDLE when nothing is dumped or replaced
+	VkPipelineCache pipeline_cache_;
+	Hash pipeline_cache_key_;
+
+	// shared while pipelines are created with pipeline_cache_, exclusive while
+	// another cache is merged into it
+	std::shared_mutex pipeline_cache_mutex_;
+
+	// by hash, only tracked while there is a pipeline cache
+	std::mutex replaced_mutex_;
+	std::unordered_map<Hash, ReplacedShader> replaced_;
+};
+
+// shader modules forwarded without debug information when DESHADE_STRIP=1, the
+// stripped module is stored by the hash of the original one
+static const char* k_stripped_suffix = ".stripped";
+
 struct ContextVK
 {
-	std::mutex mutex_;
-	std::unordered_map<void*, VkLayerInstanceDispatchTable> instance_dispatch_;
-	std::unordered_map<void*, VkLayerDispatchTable> device_dispatch_;
+	ContextVK();
+
+	DispatchMap<VkLayerInstanceDispatchTable> instance_dispatch_;
+	DispatchMap<DeviceVK> device_dispatch_;
+	bool strip_;
 };
 
+ContextVK::ContextVK()
+	: strip_ { false }
+{
+	const char* strip = std::getenv("DESHADE_STRIP");
+	strip_ = strip && *strip == '1';
+}
+
 static ContextVK& GetContext()
 {
-	static ContextVK context_;
-	return context_;
+	// leaks on exit like the GL context, a loader may still call in while exiting
+	static ContextVK* context_ = new ContextVK;
+	return *context_;
 }
 
+// every function the layer intercepts as X(name, device), device functions are
+// also handed out through vkGetDeviceProcAddr
+#define VK_HOOKS(X) \
+	X(vkGetInstanceProcAddr, false) \
+	X(vkEnumerateInstanceLayerProperties, false) \
+	X(vkEnumerateInstanceExtensionProperties, false) \
+	X(vkCreateInstance, false) \
+	X(vkDestroyInstance, false) \
+	X(vkGetDeviceProcAddr, true) \
+	X(vkEnumerateDeviceLayerProperties, true) \
+	X(vkEnumerateDeviceExtensionProperties, true) \
+	X(vkCreateDevice, true) \
+	X(vkDestroyDevice, true) \
+	X(vkCreateShaderModule, true) \
+	X(vkCreatePipelineCache, true) \
+	X(vkDestroyPipelineCache, true) \
+	X(vkCreateGraphicsPipelines, true) \
+	X(vkCreateComputePipelines, true)
+
+enum class HookVK : uint8_t
+{
+	#define X(name, device) name,
+	VK_HOOKS(X)
+	#undef X
+};
+
+static constexpr const char* k_hook_names[] =
+{
+	#define X(name, device) #name,
+	VK_HOOKS(X)
+	#undef X
+};
+
+static constexpr bool k_hook_device[] =
+{
+	#define X(name, device) device,
+	VK_HOOKS(X)
+	#undef X
+};
+
+static constexpr NameTable<sizeof k_hook_names / sizeof *k_hook_names> k_hook_table { k_hook_names };
+
 // utilities to figure out shader type from SPIR-V bytecode
 enum class ExecutionModel
 {
@@ -41,47 +238,23 @@ enum class ExecutionModel
 	Kernel
 };
 
-static ExecutionModel GetExecutionModel(const uint32_t* code, const uint32_t *end)
+static ExecutionModel GetExecutionModel(const SpirvModule& module)
 {
-	// search for OpEntryPoint=15
-	// OpEntryPoint+1 is ExecutionModel
-	if (code[0] == 0x07230203)
+	// the first entry point decides, modules with several are named after it
+	if (module.entry_points.empty())
 	{
-		code++; // skip magic
-		code++; // skip version #
-		code++; // skip generators magic #
-		code++; // skip bound
-		code++; // skip reserved
-
-		while (code < end)
-		{
-			uint32_t token = *code;
-			uint16_t opcode = token & 0x0000FFFF;
-			uint16_t length = (uint16_t)((token & 0xFFFF0000)) >> 16;
-
-			if (length == 0)
-			{
-				length = 1;
-			}
-
-			if (opcode == 15)
-			{
-				// next word is the execution model
-				switch (code[1])
-				{
-				case 0: return ExecutionModel::Vertex;
-				case 1: return ExecutionModel::TessellationControl;
-				case 2: return ExecutionModel::TessellationEvaluation;
-				case 3: return ExecutionModel::Geometry;
-				case 4: return ExecutionModel::Fragment;
-				case 5: return ExecutionModel::Kernel;
-				}
-			}
-
-			code += length;
-		}
+		return ExecutionModel::Unknown;
+	}
+	switch (module.entry_points.front().model)
+	{
+	case 0: return ExecutionModel::Vertex;
+	case 1: return ExecutionModel::TessellationControl;
+	case 2: return ExecutionModel::TessellationEvaluation;
+	case 3: return ExecutionModel::Geometry;
+	case 4: return ExecutionModel::Fragment;
+	case 5: return ExecutionModel::Compute;
+	case 6: return ExecutionModel::Kernel;
 	}
-
 	return ExecutionModel::Unknown;
 }
 
@@ -141,6 +314,144 @@ static std::string GetShaderExtensionString(ExecutionModel model)
 	return result;
 }
 
+// replacements stored with a pipeline cache, false when the cache is not valid or
+// one of them changed since, offset is where the data of the driver starts
+static bool LoadReplaced(const Mapping& cache, DeviceVK& context, size_t& offset)
+{
+	PipelineCacheHeader header;
+	if (cache.Size() < sizeof header)
+	{
+		return false;
+	}
+	std::memcpy(&header, cache.Data(), sizeof header);
+	if (std::memcmp(header.magic, k_pipeline_cache_magic, sizeof header.magic)
+	 || header.count > (cache.Size() - sizeof header) / sizeof(ReplacedShader))
+	{
+		return false;
+	}
+
+	Store& store = Store::Get();
+	const char* data = (const char*)cache.Data() + sizeof header;
+	for (uint64_t i = 0; i < header.count; i++)
+	{
+		ReplacedShader shader;
+		std::memcpy(&shader, data + i * sizeof shader, sizeof shader);
+		shader.suffix[sizeof shader.suffix - 1] = '\0';
+		std::shared_ptr<const Mapping> replacement = store.Find(shader.hash, shader.suffix);
+		if (!replacement || Hash128(replacement->Data(), replacement->Size()) != shader.contents)
+		{
+			context.replaced_.clear();
+			return false;
+		}
+		context.replaced_[shader.hash] = shader;
+	}
+
+	offset = sizeof header + header.count * sizeof(ReplacedShader);
+	return true;
+}
+
+static void CreatePipelineCache(VkPhysicalDevice physical_device, VkDevice device, DeviceVK& context)
+{
+	context.pipeline_cache_ = VK_NULL_HANDLE;
+
+	Store& store = Store::Get();
+	VkLayerInstanceDispatchTable* dispatch = GetContext().instance_dispatch_.Find(DispatchKey(physical_device));
+	if (!store.Enabled() || !dispatch || !dispatch->GetPhysicalDeviceProperties)
+	{
+		return;
+	}
+
+	// a driver rejects data from another driver or version on its own, the key keeps
+	// caches for different drivers from replacing each other. new dumps leave the key
+	// alone, a driver finds pipelines by the shaders they were built from anyway
+	VkPhysicalDeviceProperties properties;
+	dispatch->GetPhysicalDeviceProperties(physical_device, &properties);
+	Hasher hasher;
+	hasher.Update(&properties.vendorID, sizeof properties.vendorID);
+	hasher.Update(&properties.deviceID, sizeof properties.deviceID);
+	hasher.Update(&properties.driverVersion, sizeof properties.driverVersion);
+	hasher.Update(properties.pipelineCacheUUID, sizeof properties.pipelineCacheUUID);
+	context.pipeline_cache_key_ = hasher.Final();
+
+	std::shared_ptr<const Mapping> data = store.Find(context.pipeline_cache_key_, k_pipeline_cache_suffix);
+	size_t offset = 0;
+	if (data && !LoadReplaced(*data, context, offset))
+	{
+		// pipelines of edited replacements would only pile up in it
+		Log("Discarded pipeline cache \"%\", a replacement it was built with changed\n", context.pipeline_cache_key_);
+		data = nullptr;
+	}
+
+	VkPipelineCacheCreateInfo create_info = { };
+	create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	create_info.initialDataSize = data ? data->Size() - offset : 0;
+	create_info.pInitialData = data ? (const char*)data->Data() + offset : nullptr;
+	if (context.dispatch_.CreatePipelineCache(device, &create_info, nullptr, &context.pipeline_cache_) != VK_SUCCESS)
+	{
+		LogError("Failed to create pipeline cache \"%\"\n", context.pipeline_cache_key_);
+		context.pipeline_cache_ = VK_NULL_HANDLE;
+		return;
+	}
+
+	if (data)
+	{
+		Log("Loaded pipeline cache \"%\" with % bytes\n", context.pipeline_cache_key_, create_info.initialDataSize);
+	}
+}
+
+static void SavePipelineCache(VkDevice device, DeviceVK& context)
+{
+	if (context.pipeline_cache_ == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	size_t size = 0;
+	std::vector<char> data;
+	if (context.dispatch_.GetPipelineCacheData(device, context.pipeline_cache_, &size, nullptr) == VK_SUCCESS)
+	{
+		data.resize(size);
+		if (context.dispatch_.GetPipelineCacheData(device, context.pipeline_cache_, &size, data.data()) != VK_SUCCESS)
+		{
+			size = 0;
+		}
+	}
+
+	if (!size)
+	{
+		LogError("Failed to read pipeline cache \"%\"\n", context.pipeline_cache_key_);
+		return;
+	}
+
+	std::vector<char> contents;
+	{
+		std::lock_guard<std::mutex> lock(context.replaced_mutex_);
+		PipelineCacheHeader header;
+		std::memcpy(header.magic, k_pipeline_cache_magic, sizeof header.magic);
+		header.count = context.replaced_.size();
+		contents.resize(sizeof header + header.count * sizeof(ReplacedShader) + size);
+		std::memcpy(contents.data(), &header, sizeof header);
+		char* replaced = contents.data() + sizeof header;
+		for (const auto& shader : context.replaced_)
+		{
+			std::memcpy(replaced, &shader.second, sizeof shader.second);
+			replaced += sizeof shader.second;
+		}
+		std::memcpy(replaced, data.data(), size);
+	}
+	Store::Get().Dump(context.pipeline_cache_key_, k_pipeline_cache_suffix, std::move(contents));
+	Log("Saved pipeline cache \"%\" with % bytes\n", context.pipeline_cache_key_, size);
+}
+
+static void DestroyPipelineCache(VkDevice device, DeviceVK& context)
+{
+	if (context.pipeline_cache_ != VK_NULL_HANDLE)
+	{
+		context.dispatch_.DestroyPipelineCache(device, context.pipeline_cache_, nullptr);
+		context.pipeline_cache_ = VK_NULL_HANDLE;
+	}
+}
+
 extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateInstance(
 	const VkInstanceCreateInfo* pCreateInfo,
 	const VkAllocationCallbacks* pAllocator,
@@ -189,10 +500,17 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateInstance(
 	dispatch_table.EnumerateDeviceExtensionProperties = (PFN_vkEnumerateDeviceExtensionProperties)
 		pvkGetInstanceProcAddr(*pInstance, "vkEnumerateDeviceExtensionProperties");
 
+	dispatch_table.GetPhysicalDeviceProperties = (PFN_vkGetPhysicalDeviceProperties)
+		pvkGetInstanceProcAddr(*pInstance, "vkGetPhysicalDeviceProperties");
+
+	VkLayerInstanceDispatchTable* dispatch = new VkLayerInstanceDispatchTable(dispatch_table);
+	if (!GetContext().instance_dispatch_.Insert(DispatchKey(*pInstance), dispatch))
 	{
-		ContextVK& context = GetContext();
-		std::lock_guard<std::mutex> lock(context.mutex_);
-		context.instance_dispatch_.insert({ DispatchKey(*pInstance), dispatch_table });
+		LogError("Failed to track instance %, too many instances\n", (void *)*pInstance);
+		dispatch->DestroyInstance(*pInstance, pAllocator);
+		delete dispatch;
+		*pInstance = VK_NULL_HANDLE;
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
 	}
 
 	return VK_SUCCESS;
@@ -200,11 +518,18 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateInstance(
 
 extern "C" VK_LAYER_EXPORT void VKAPI_CALL deshade_vkDestroyInstance(
 	VkInstance instance,
-	const VkAllocationCallbacks*)
+	const VkAllocationCallbacks* pAllocator)
 {
-	ContextVK& context = GetContext();
-	std::lock_guard<std::mutex> lock(context.mutex_);
-	context.instance_dispatch_.erase(DispatchKey(instance));
+	if (!instance)
+	{
+		return;
+	}
+	VkLayerInstanceDispatchTable* dispatch = GetContext().instance_dispatch_.Erase(DispatchKey(instance));
+	if (dispatch)
+	{
+		dispatch->DestroyInstance(instance, pAllocator);
+		delete dispatch;
+	}
 }
 
 extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateDevice(
@@ -249,7 +574,8 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateDevice(
 	}
 
 	// fetch our own dispatch table for the functions we need, into the next layer
-	VkLayerDispatchTable dispatch_table;
+	DeviceVK* context = new DeviceVK;
+	VkLayerDispatchTable& dispatch_table = context->dispatch_;
 
 	dispatch_table.GetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)
 		pvkGetDeviceProcAddr(*pDevice, "vkGetDeviceProcAddr");
@@ -260,10 +586,34 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateDevice(
 	dispatch_table.CreateShaderModule = (PFN_vkCreateShaderModule)
 		pvkGetDeviceProcAddr(*pDevice, "vkCreateShaderModule");
 
+	dispatch_table.CreatePipelineCache = (PFN_vkCreatePipelineCache)
+		pvkGetDeviceProcAddr(*pDevice, "vkCreatePipelineCache");
+
+	dispatch_table.DestroyPipelineCache = (PFN_vkDestroyPipelineCache)
+		pvkGetDeviceProcAddr(*pDevice, "vkDestroyPipelineCache");
+
+	dispatch_table.GetPipelineCacheData = (PFN_vkGetPipelineCacheData)
+		pvkGetDeviceProcAddr(*pDevice, "vkGetPipelineCacheData");
+
+	dispatch_table.MergePipelineCaches = (PFN_vkMergePipelineCaches)
+		pvkGetDeviceProcAddr(*pDevice, "vkMergePipelineCaches");
+
+	dispatch_table.CreateGraphicsPipelines = (PFN_vkCreateGraphicsPipelines)
+		pvkGetDeviceProcAddr(*pDevice, "vkCreateGraphicsPipelines");
+
+	dispatch_table.CreateComputePipelines = (PFN_vkCreateComputePipelines)
+		pvkGetDeviceProcAddr(*pDevice, "vkCreateComputePipelines");
+
+	CreatePipelineCache(physicalDevice, *pDevice, *context);
+
+	if (!GetContext().device_dispatch_.Insert(DispatchKey(*pDevice), context))
 	{
-		ContextVK& context = GetContext();
-		std::lock_guard<std::mutex> lock(context.mutex_);
-		context.device_dispatch_.insert({ DispatchKey(*pDevice), dispatch_table });
+		LogError("Failed to track device %, too many devices\n", (void *)*pDevice);
+		DestroyPipelineCache(*pDevice, *context);
+		dispatch_table.DestroyDevice(*pDevice, pAllocator);
+		delete context;
+		*pDevice = VK_NULL_HANDLE;
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
 	}
 
 	return VK_SUCCESS;
@@ -271,11 +621,20 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateDevice(
 
 extern "C" VK_LAYER_EXPORT void VKAPI_CALL deshade_vkDestroyDevice(
 	VkDevice device,
-	const VkAllocationCallbacks*)
+	const VkAllocationCallbacks* pAllocator)
 {
-	ContextVK& context = GetContext();
-	std::lock_guard<std::mutex> lock(context.mutex_);
-	context.device_dispatch_.erase(DispatchKey(device));
+	if (!device)
+	{
+		return;
+	}
+	DeviceVK* context = GetContext().device_dispatch_.Erase(DispatchKey(device));
+	if (context)
+	{
+		SavePipelineCache(device, *context);
+		DestroyPipelineCache(device, *context);
+		context->dispatch_.DestroyDevice(device, pAllocator);
+		delete context;
+	}
 }
 
 extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkEnumerateInstanceLayerProperties(
@@ -339,14 +698,12 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkEnumerateDeviceExtensio
 			return VK_SUCCESS;
 		}
 
-		ContextVK& context = GetContext();
-		std::lock_guard<std::mutex> lock(context.mutex_);
-		auto find = context.instance_dispatch_.find(DispatchKey(physicalDevice));
-		if (find == context.instance_dispatch_.end())
+		VkLayerInstanceDispatchTable* dispatch = GetContext().instance_dispatch_.Find(DispatchKey(physicalDevice));
+		if (!dispatch)
 		{
 			return VK_ERROR_DEVICE_LOST;
 		}
-		return find->second.EnumerateDeviceExtensionProperties(physicalDevice, pLayerName, pPropertyCount, pProperties);
+		return dispatch->EnumerateDeviceExtensionProperties(physicalDevice, pLayerName, pPropertyCount, pProperties);
 	}
 
 	// don't expose any extensions
@@ -358,6 +715,48 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkEnumerateDeviceExtensio
 	return VK_SUCCESS;
 }
 
+static VkResult CreateStrippedShaderModule(
+	VkDevice device,
+	const VkLayerDispatchTable& dispatch,
+	const SpirvModule& module,
+	const VkShaderModuleCreateInfo* pCreateInfo,
+	const VkAllocationCallbacks* pAllocator,
+	VkShaderModule* pShaderModule)
+{
+	Store& store = Store::Get();
+	VkShaderModuleCreateInfo create_info = *pCreateInfo;
+
+	std::shared_ptr<const Mapping> cached = store.Find(module.hash, k_stripped_suffix);
+	std::vector<uint32_t> stripped;
+	if (cached)
+	{
+		create_info.codeSize = cached->Size();
+		create_info.pCode = (const uint32_t*)cached->Data();
+	}
+	else
+	{
+		stripped = StripSpirv(pCreateInfo->pCode, module);
+		if (stripped.empty())
+		{
+			return dispatch.CreateShaderModule(device, pCreateInfo, pAllocator, pShaderModule);
+		}
+		create_info.codeSize = stripped.size() * sizeof(uint32_t);
+		create_info.pCode = stripped.data();
+		if (store.Insert(module.hash, k_stripped_suffix))
+		{
+			const char* code = (const char *)stripped.data();
+			store.Dump(module.hash, k_stripped_suffix, std::vector<char>(code, code + create_info.codeSize));
+		}
+	}
+
+	Log("Stripped % of % bytes from \"%\"%\n",
+		pCreateInfo->codeSize - create_info.codeSize,
+		pCreateInfo->codeSize,
+		module.hash,
+		cached ? " (cached)" : "");
+	return dispatch.CreateShaderModule(device, &create_info, pAllocator, pShaderModule);
+}
+
 extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateShaderModule(
 	VkDevice device,
 	const VkShaderModuleCreateInfo* pCreateInfo,
@@ -365,155 +764,239 @@ extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateShaderModule(
 	VkShaderModule* pShaderModule
 )
 {
-	ContextVK& context = GetContext();
-	std::lock_guard<std::mutex> lock(context.mutex_);
-	auto find = context.device_dispatch_.find(DispatchKey(device));
-	if (find != context.device_dispatch_.end())
+	DeviceVK* context = GetContext().device_dispatch_.Find(DispatchKey(device));
+	if (context)
 	{
+		const VkLayerDispatchTable* dispatch = &context->dispatch_;
 		const uint32_t* pCode = pCreateInfo->pCode;
-		const ExecutionModel model = GetExecutionModel(pCode, (const uint32_t *)((const uint8_t *)pCode) + pCreateInfo->codeSize);
 
-		// calculate hash
-		std::string hash = Hash128((const uint8_t*)pCode, pCreateInfo->codeSize);
+		// hash and index in one pass over the code
+		const SpirvModule module = IndexSpirv(pCode, pCreateInfo->codeSize);
+		const ExecutionModel model = GetExecutionModel(module);
+		const Hash hash = module.hash;
+		const std::string suffix = GetShaderExtensionString(model);
+		Store& store = Store::Get();
 
-		std::vector<char> contents;
 		// check if a shader replacement exists
-		std::string file_name = "shaders/" + hash + GetShaderExtensionString(model);
-		std::ifstream file_contents(file_name, std::ios::binary);
-		if (file_contents.is_open())
+		Hash found_hash = hash;
+		std::string found_suffix = suffix;
+		std::shared_ptr<const Mapping> replacement = store.Find(hash, suffix.c_str());
+		if (!replacement && model == ExecutionModel::Compute)
 		{
-			// construct string from replacement contents
-			Log("Replaced % shader \"%\"\n", GetShaderTypeString(model), hash);
-			contents.assign((std::istreambuf_iterator<char>(file_contents)),
-			                 std::istreambuf_iterator<char>());
+			// compute shaders used to be dumped as kernels
+			found_suffix = GetShaderExtensionString(ExecutionModel::Kernel);
+			replacement = store.Find(hash, found_suffix.c_str());
+			if (replacement)
+			{
+				Log("Found compute shader \"%\" dumped as a kernel\n", hash);
+			}
 		}
-		else
+		if (!replacement && store.LegacyHash())
 		{
-			// construct from source contents
-			contents.assign((const uint8_t*)pCode, (const uint8_t*)pCode + pCreateInfo->codeSize);
+			found_hash = Hash128DJB(pCode, pCreateInfo->codeSize);
+			found_suffix = suffix;
+			replacement = store.Find(found_hash, found_suffix.c_str());
+			if (replacement)
+			{
+				Log("Found legacy % shader \"%\" for \"%\"\n", GetShaderTypeString(model), found_hash, hash);
+			}
+		}
 
-			// write the contents to a file
-			std::ofstream file(file_name, std::ios::binary);
-			if (file.is_open())
+		if (replacement)
+		{
+			Log("Replaced % shader \"%\"\n", GetShaderTypeString(model), hash);
+
+			// replace the contents on call, mappings are page aligned
+			VkShaderModuleCreateInfo create_info = *pCreateInfo;
+			create_info.codeSize = replacement->Size();
+			create_info.pCode = (const uint32_t*)replacement->Data();
+			SpirvModule replaced;
+			if (GetContext().strip_)
+			{
+				replaced = IndexSpirv(create_info.pCode, create_info.codeSize);
+			}
+			if (context->pipeline_cache_ != VK_NULL_HANDLE)
+			{
+				const Hash contents = GetContext().strip_ ? replaced.hash : Hash128(create_info.pCode, create_info.codeSize);
+				if (contents != hash)
+				{
+					ReplacedShader shader;
+					shader.hash = found_hash;
+					std::memset(shader.suffix, 0, sizeof shader.suffix);
+					found_suffix.copy(shader.suffix, sizeof shader.suffix - 1);
+					shader.contents = contents;
+					std::lock_guard<std::mutex> lock(context->replaced_mutex_);
+					context->replaced_[found_hash] = shader;
+				}
+			}
+			if (GetContext().strip_)
 			{
-				file.write((const char *)contents.data(), contents.size());
-				Log("Dumpped % shader \"%\"\n", GetShaderTypeString(model), hash);
+				// an unedited dump has the hash of the original and shares its stripped module
+				return CreateStrippedShaderModule(device, *dispatch, replaced, &create_info, pAllocator, pShaderModule);
 			}
+			return dispatch->CreateShaderModule(device, &create_info, pAllocator, pShaderModule);
 		}
 
-		// replace the contents on call
-		VkShaderModuleCreateInfo create_info = *pCreateInfo;
-		create_info.codeSize = contents.size();
-		create_info.pCode = (const uint32_t*)contents.data();
-		return find->second.CreateShaderModule(device, &create_info, pAllocator, pShaderModule);
+		// the application owns pCode, the writer thread gets a copy
+		if (store.Insert(hash, suffix.c_str()))
+		{
+			const char* code = (const char *)pCode;
+			store.Dump(hash, suffix.c_str(), std::vector<char>(code, code + pCreateInfo->codeSize));
+			Log("Dumpped % shader \"%\"\n", GetShaderTypeString(model), hash);
+		}
+
+		if (GetContext().strip_)
+		{
+			return CreateStrippedShaderModule(device, *dispatch, module, pCreateInfo, pAllocator, pShaderModule);
+		}
+
+		// nothing replaced, forward the original create info untouched
+		return dispatch->CreateShaderModule(device, pCreateInfo, pAllocator, pShaderModule);
 	}
 
 	return VK_ERROR_DEVICE_LOST;
 }
 
-extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL deshade_vkGetDeviceProcAddr(
+extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreatePipelineCache(
 	VkDevice device,
-	const char* pName)
+	const VkPipelineCacheCreateInfo* pCreateInfo,
+	const VkAllocationCallbacks* pAllocator,
+	VkPipelineCache* pPipelineCache)
 {
-	if (!std::strcmp(pName, "vkGetDeviceProcAddr"))
-	{
-		return (PFN_vkVoidFunction)&deshade_vkGetDeviceProcAddr;
-	}
-	else if (!std::strcmp(pName, "vkEnumerateDeviceLayerProperties"))
-	{
-		return (PFN_vkVoidFunction)&deshade_vkEnumerateDeviceLayerProperties;
-	}
-	else if (!std::strcmp(pName, "vkEnumerateDeviceExtensionProperties"))
+	DeviceVK* context = GetContext().device_dispatch_.Find(DispatchKey(device));
+	if (!context)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkEnumerateDeviceExtensionProperties;
+		return VK_ERROR_DEVICE_LOST;
 	}
-	else if (!std::strcmp(pName, "vkCreateDevice"))
+
+	const VkResult result = context->dispatch_.CreatePipelineCache(device, pCreateInfo, pAllocator, pPipelineCache);
+	if (result != VK_SUCCESS || context->pipeline_cache_ == VK_NULL_HANDLE)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkCreateDevice;
+		return result;
 	}
-	else if (!std::strcmp(pName, "vkDestroyDevice"))
+
+	// the application sees pipelines of earlier launches in its own cache too
+	std::shared_lock<std::shared_mutex> lock(context->pipeline_cache_mutex_);
+	if (context->dispatch_.MergePipelineCaches(device, *pPipelineCache, 1, &context->pipeline_cache_) != VK_SUCCESS)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkDestroyDevice;
+		LogError("Failed to merge pipeline cache \"%\" into %\n", context->pipeline_cache_key_, (void *)*pPipelineCache);
 	}
-	else if (!std::strcmp(pName, "vkCreateShaderModule"))
+	return VK_SUCCESS;
+}
+
+extern "C" VK_LAYER_EXPORT void VKAPI_CALL deshade_vkDestroyPipelineCache(
+	VkDevice device,
+	VkPipelineCache pipelineCache,
+	const VkAllocationCallbacks* pAllocator)
+{
+	DeviceVK* context = GetContext().device_dispatch_.Find(DispatchKey(device));
+	if (!context)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkCreateShaderModule;
+		return;
 	}
 
+	// keep what the application built with its own cache before it is gone
+	if (pipelineCache != VK_NULL_HANDLE && context->pipeline_cache_ != VK_NULL_HANDLE)
 	{
-		ContextVK& context = GetContext();
-		std::lock_guard<std::mutex> lock(context.mutex_);
-		auto find = context.device_dispatch_.find(DispatchKey(device));
-		if (find != context.device_dispatch_.end())
+		std::unique_lock<std::shared_mutex> lock(context->pipeline_cache_mutex_);
+		if (context->dispatch_.MergePipelineCaches(device, context->pipeline_cache_, 1, &pipelineCache) != VK_SUCCESS)
 		{
-			return find->second.GetDeviceProcAddr(device, pName);
+			LogError("Failed to merge % into pipeline cache \"%\"\n", (void *)pipelineCache, context->pipeline_cache_key_);
 		}
 	}
 
-	return VK_NULL_HANDLE;
+	context->dispatch_.DestroyPipelineCache(device, pipelineCache, pAllocator);
 }
 
-extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL deshade_vkGetInstanceProcAddr(
-	VkInstance instance,
-	const char* pName)
+extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateGraphicsPipelines(
+	VkDevice device,
+	VkPipelineCache pipelineCache,
+	uint32_t createInfoCount,
+	const VkGraphicsPipelineCreateInfo* pCreateInfos,
+	const VkAllocationCallbacks* pAllocator,
+	VkPipeline* pPipelines)
 {
-	// instance chain functions that we intercept
-	if (!std::strcmp(pName, "vkGetInstanceProcAddr"))
-	{
-		return (PFN_vkVoidFunction)&deshade_vkGetInstanceProcAddr;
-	}
-	else if (!std::strcmp(pName, "vkEnumerateInstanceLayerProperties"))
-	{
-		return (PFN_vkVoidFunction)&deshade_vkEnumerateInstanceLayerProperties;
-	}
-	else if (!std::strcmp(pName, "vkEnumerateInstanceExtensionProperties"))
-	{
-		return (PFN_vkVoidFunction)&deshade_vkEnumerateInstanceExtensionProperties;
-	}
-	else if (!std::strcmp(pName, "vkCreateInstance"))
+	DeviceVK* context = GetContext().device_dispatch_.Find(DispatchKey(device));
+	if (!context)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkCreateInstance;
-	}
-	else if (!std::strcmp(pName, "vkDestroyInstance"))
-	{
-		return (PFN_vkVoidFunction)&deshade_vkDestroyInstance;
+		return VK_ERROR_DEVICE_LOST;
 	}
 
-	// device chain functions that we intercept
-	if (!std::strcmp(pName, "vkGetDeviceProcAddr"))
-	{
-		return (PFN_vkVoidFunction)&deshade_vkGetDeviceProcAddr;
-	}
-	else if (!std::strcmp(pName, "vkEnumerateDeviceLayerProperties"))
+	// pipelines created without a cache go into ours
+	if (pipelineCache == VK_NULL_HANDLE && context->pipeline_cache_ != VK_NULL_HANDLE)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkEnumerateDeviceLayerProperties;
+		std::shared_lock<std::shared_mutex> lock(context->pipeline_cache_mutex_);
+		return context->dispatch_.CreateGraphicsPipelines(device, context->pipeline_cache_, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 	}
-	else if (!std::strcmp(pName, "vkEnumerateDeviceExtensionProperties"))
+
+	return context->dispatch_.CreateGraphicsPipelines(device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+}
+
+extern "C" VK_LAYER_EXPORT VkResult VKAPI_CALL deshade_vkCreateComputePipelines(
+	VkDevice device,
+	VkPipelineCache pipelineCache,
+	uint32_t createInfoCount,
+	const VkComputePipelineCreateInfo* pCreateInfos,
+	const VkAllocationCallbacks* pAllocator,
+	VkPipeline* pPipelines)
+{
+	DeviceVK* context = GetContext().device_dispatch_.Find(DispatchKey(device));
+	if (!context)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkEnumerateDeviceExtensionProperties;
+		return VK_ERROR_DEVICE_LOST;
 	}
-	else if (!std::strcmp(pName, "vkCreateDevice"))
+
+	// pipelines created without a cache go into ours
+	if (pipelineCache == VK_NULL_HANDLE && context->pipeline_cache_ != VK_NULL_HANDLE)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkCreateDevice;
+		std::shared_lock<std::shared_mutex> lock(context->pipeline_cache_mutex_);
+		return context->dispatch_.CreateComputePipelines(device, context->pipeline_cache_, createInfoCount, pCreateInfos, pAllocator, pPipelines);
 	}
-	else if (!std::strcmp(pName, "vkDestroyDevice"))
+
+	return context->dispatch_.CreateComputePipelines(device, pipelineCache, createInfoCount, pCreateInfos, pAllocator, pPipelines);
+}
+
+extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL deshade_vkGetDeviceProcAddr(VkDevice, const char*);
+extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL deshade_vkGetInstanceProcAddr(VkInstance, const char*);
+
+static PFN_vkVoidFunction GetHook(int index)
+{
+	switch ((HookVK)index)
 	{
-		return (PFN_vkVoidFunction)&deshade_vkDestroyDevice;
+	#define X(name, device) \
+	case HookVK::name: \
+		return (PFN_vkVoidFunction)&deshade_##name;
+	VK_HOOKS(X)
+	#undef X
 	}
-	else if (!std::strcmp(pName, "vkCreateShaderModule"))
+	return nullptr;
+}
+
+extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL deshade_vkGetDeviceProcAddr(
+	VkDevice device,
+	const char* pName)
+{
+	const int index = k_hook_table.Find(pName);
+	if (index >= 0 && k_hook_device[index])
 	{
-		return (PFN_vkVoidFunction)&deshade_vkCreateShaderModule;
+		return GetHook(index);
 	}
 
+	DeviceVK* context = GetContext().device_dispatch_.Find(DispatchKey(device));
+	return context ? context->dispatch_.GetDeviceProcAddr(device, pName) : VK_NULL_HANDLE;
+}
+
+extern "C" VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL deshade_vkGetInstanceProcAddr(
+	VkInstance instance,
+	const char* pName)
+{
+	// instance and device chain functions that we intercept
+	const int index = k_hook_table.Find(pName);
+	if (index >= 0)
 	{
-		ContextVK& context = GetContext();
-		std::lock_guard<std::mutex> lock(context.mutex_);
-		auto find = context.instance_dispatch_.find(DispatchKey(instance));
-		if (find != context.instance_dispatch_.end())
-		{
-			return find->second.GetInstanceProcAddr(instance, pName);
-		}
+		return GetHook(index);
 	}
 
-	return VK_NULL_HANDLE;
+	VkLayerInstanceDispatchTable* dispatch = GetContext().instance_dispatch_.Find(DispatchKey(instance));
+	return dispatch ? dispatch->GetInstanceProcAddr(instance, pName) : VK_NULL_HANDLE;
 }
@@ -0,0 +1,112 @@
+#include <algorithm> // std::find
+#include <cerrno>
+
+extern "C"
+{
+	#include <poll.h>
+	#include <sys/eventfd.h>
+	#include <sys/inotify.h>
+	#include <unistd.h>
+}
+
+#include "watcher.h"
+#include "log.h"
+
+Watcher::Watcher()
+	: inotify_ { -1 }
+	, wake_    { -1 }
+	, pending_ { false }
+{
+}
+
+bool Watcher::Start(const char* directory)
+{
+	inotify_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	wake_ = eventfd(0, EFD_CLOEXEC);
+	// editors either write the file in place or move a new one over it
+	if (inotify_ == -1 || wake_ == -1 || inotify_add_watch(inotify_, directory, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+	{
+		LogError("Failed to watch \"%\" for changes\n", directory);
+		Stop();
+		return false;
+	}
+
+	thread_ = std::thread(&Watcher::Run, this);
+	Log("Watching \"%\" for changes\n", directory);
+	return true;
+}
+
+void Watcher::Stop()
+{
+	if (thread_.joinable())
+	{
+		const uint64_t one = 1;
+		while (write(wake_, &one, sizeof one) < 0 && errno == EINTR);
+		thread_.join();
+	}
+	if (inotify_ != -1)
+	{
+		close(inotify_);
+		inotify_ = -1;
+	}
+	if (wake_ != -1)
+	{
+		close(wake_);
+		wake_ = -1;
+	}
+}
+
+bool Watcher::Pending() const
+{
+	return pending_.load(std::memory_order_relaxed);
+}
+
+std::vector<std::string> Watcher::Take()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	pending_.store(false, std::memory_order_relaxed);
+	std::vector<std::string> names;
+	names.swap(names_);
+	return names;
+}
+
+void Watcher::Run()
+{
+	alignas(struct inotify_event) char buffer[4096];
+	for (;;)
+	{
+		pollfd fds[2] = { { inotify_, POLLIN, 0 }, { wake_, POLLIN, 0 } };
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			LogError("Stopped watching for changes\n");
+			return;
+		}
+		if (fds[1].revents)
+		{
+			return;
+		}
+
+		const ssize_t size = read(inotify_, buffer, sizeof buffer);
+		if (size <= 0)
+		{
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (const char* event = buffer; event < buffer + size; )
+		{
+			const inotify_event* info = (const inotify_event*)event;
+			if (info->len && !(info->mask & IN_ISDIR)
+			 && std::find(names_.begin(), names_.end(), info->name) == names_.end())
+			{
+				names_.push_back(info->name);
+			}
+			event += sizeof *info + info->len;
+		}
+		pending_.store(!names_.empty(), std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// watches a directory with inotify on a dedicated thread and collects the names of
+// files written or moved into it until they are taken
+struct Watcher
+{
+	Watcher();
+
+	// false when the directory cannot be watched
+	bool Start(const char* directory);
+
+	// stop the thread, nothing is collected afterwards
+	void Stop();
+
+	// a single load, cheap enough to check every frame
+	bool Pending() const;
+
+	// names changed since the last call, each only once
+	std::vector<std::string> Take();
+
+private:
+	void Run();
+
+	int inotify_;
+	int wake_;
+	std::thread thread_;
+	std::atomic<bool> pending_;
+
+	// protected by mutex_
+	std::mutex mutex_;
+	std::vector<std::string> names_;
+};
+
+#endif
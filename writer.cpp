@@ -0,0 +1,244 @@
+#include <cerrno>
+
+extern "C"
+{
+	#include <fcntl.h>
+	#include <stdio.h>
+	#include <unistd.h>
+}
+
+#include "writer.h"
+#include "log.h"
+
+// every job in a batch holds a file open until the batch is synced
+static const size_t k_batch_size = 64;
+
+Writer::Writer(const char* directory, size_t limit)
+	: directory_   { directory }
+	, limit_       { limit }
+	, use_archive_ { false }
+	, pending_     { 0 }
+	, enqueued_    { 0 }
+	, written_     { 0 }
+	, running_     { false }
+	, stopped_     { false }
+{
+}
+
+bool Writer::OpenArchive(const char* file_name, bool delta)
+{
+	std::lock_guard<std::mutex> lock(archive_mutex_);
+	use_archive_ = archive_.Open(file_name);
+	if (delta)
+	{
+		archive_.EnableDelta();
+	}
+	return use_archive_;
+}
+
+void Writer::Enqueue(const Hash& hash, const char* suffix, std::vector<char>&& contents)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	// back-pressure, a single dump larger than the limit is still let through
+	space_.wait(lock, [&] { return stopped_ || pending_ == 0 || pending_ + contents.size() <= limit_; });
+
+	if (stopped_)
+	{
+		// the thread is gone when exiting, write inline rather than lose the dump and
+		// commit it since nothing else will
+		lock.unlock();
+		std::vector<Job> batch;
+		batch.push_back(Job { hash, suffix, std::move(contents) });
+		WriteBatch(batch);
+		std::lock_guard<std::mutex> archive_lock(archive_mutex_);
+		if (use_archive_)
+		{
+			archive_.Commit();
+		}
+		return;
+	}
+
+	if (!running_)
+	{
+		running_ = true;
+		thread_ = std::thread(&Writer::Run, this);
+	}
+
+	pending_ += contents.size();
+	queue_.push_back(Job { hash, suffix, std::move(contents) });
+	enqueued_++;
+	ready_.notify_one();
+}
+
+void Writer::Flush()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		const uint64_t target = enqueued_;
+		done_.wait(lock, [&] { return written_ >= target; });
+	}
+
+	std::lock_guard<std::mutex> lock(archive_mutex_);
+	if (use_archive_)
+	{
+		archive_.Commit();
+	}
+}
+
+void Writer::Stop()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (stopped_)
+	{
+		return;
+	}
+	stopped_ = true;
+	ready_.notify_one();
+	space_.notify_all();
+	lock.unlock();
+
+	// the thread drains the queue before it leaves
+	if (thread_.joinable())
+	{
+		thread_.join();
+	}
+
+	std::lock_guard<std::mutex> archive_lock(archive_mutex_);
+	if (use_archive_)
+	{
+		archive_.Commit();
+	}
+}
+
+void Writer::Run()
+{
+	std::vector<Job> batch;
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;)
+	{
+		ready_.wait(lock, [&] { return stopped_ || !queue_.empty(); });
+		if (queue_.empty())
+		{
+			break;
+		}
+
+		while (!queue_.empty() && batch.size() < k_batch_size)
+		{
+			batch.push_back(std::move(queue_.front()));
+			queue_.pop_front();
+		}
+
+		lock.unlock();
+		WriteBatch(batch);
+		size_t size = 0;
+		for (const Job& job : batch)
+		{
+			size += job.contents.size();
+		}
+		const size_t count = batch.size();
+		batch.clear();
+		lock.lock();
+
+		pending_ -= size;
+		written_ += count;
+		space_.notify_all();
+		done_.notify_all();
+	}
+}
+
+void Writer::WriteBatch(std::vector<Job>& batch)
+{
+	std::unique_lock<std::mutex> lock(archive_mutex_);
+	if (!use_archive_)
+	{
+		lock.unlock();
+		WriteFiles(batch);
+		return;
+	}
+
+	for (const Job& job : batch)
+	{
+		if (!archive_.Append(job.hash, job.suffix.c_str(), job.contents.data(), job.contents.size()))
+		{
+			LogError("Failed to append \"%\" (%) to the archive\n", job.hash, job.suffix);
+		}
+	}
+}
+
+void Writer::WriteFiles(std::vector<Job>& batch)
+{
+	// everything is written to a temporary file first so that a crash never leaves a
+	// partial dump behind which would be picked up as a replacement on the next launch
+	std::vector<std::string> file_names(batch.size());
+	std::vector<std::string> temporaries(batch.size());
+	std::vector<int> files(batch.size(), -1);
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		// caches are dumped again whenever they change, only the last one in a batch
+		// is written as they would share a temporary file
+		bool replaced = false;
+		for (size_t j = i + 1; j < batch.size() && !replaced; j++)
+		{
+			replaced = batch[j].hash == batch[i].hash && batch[j].suffix == batch[i].suffix;
+		}
+		if (replaced)
+		{
+			continue;
+		}
+
+		char hex[sizeof batch[i].hash.bytes * 2 + 1];
+		batch[i].hash.Format(hex);
+		file_names[i] = directory_ + "/" + hex + batch[i].suffix;
+		temporaries[i] = file_names[i] + ".tmp";
+		const int fd = open(temporaries[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1)
+		{
+			LogError("Failed to dump \"%\"\n", file_names[i]);
+			continue;
+		}
+
+		const char* data = batch[i].contents.data();
+		size_t size = batch[i].contents.size();
+		while (size)
+		{
+			const ssize_t count = write(fd, data, size);
+			if (count < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (count <= 0)
+			{
+				break;
+			}
+			data += count;
+			size -= count;
+		}
+
+		if (size)
+		{
+			LogError("Failed to dump \"%\"\n", file_names[i]);
+			close(fd);
+			unlink(temporaries[i].c_str());
+			continue;
+		}
+
+		files[i] = fd;
+	}
+
+	// one round of syncs for the whole batch, then move the files in place
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		if (files[i] == -1)
+		{
+			continue;
+		}
+		fdatasync(files[i]);
+		close(files[i]);
+		if (rename(temporaries[i].c_str(), file_names[i].c_str()) != 0)
+		{
+			LogError("Failed to dump \"%\"\n", file_names[i]);
+			unlink(temporaries[i].c_str());
+		}
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef WRITER_H
+#define WRITER_H
+#include <mutex>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "hash.h"
+#include "archive.h"
+
+// writes dumps on a dedicated thread so the application never waits on the file
+// system, Enqueue only blocks when more than the pending limit is waiting to be written
+struct Writer
+{
+	Writer(const char* directory, size_t limit);
+
+	// append dumps to this archive instead of writing <hash><suffix> files into
+	// the directory, the archive index is written when flushing or stopping, with
+	// delta shaders are stored as deltas against similar ones where that pays off
+	bool OpenArchive(const char* file_name, bool delta);
+
+	// takes ownership of contents, they are written out later
+	void Enqueue(const Hash& hash, const char* suffix, std::vector<char>&& contents);
+
+	// wait until everything enqueued so far is on disk
+	void Flush();
+
+	// flush and stop the thread, anything enqueued afterwards is written inline
+	void Stop();
+
+private:
+	struct Job
+	{
+		Hash hash;
+		std::string suffix;
+		std::vector<char> contents;
+	};
+
+	void Run();
+	void WriteBatch(std::vector<Job>& batch);
+	void WriteFiles(std::vector<Job>& batch);
+
+	const std::string directory_;
+	const size_t limit_;
+
+	// only touched by whoever writes a batch
+	std::mutex archive_mutex_;
+	ArchiveWriter archive_;
+	bool use_archive_;
+
+	// everything below protected by mutex_
+	std::mutex mutex_;
+	std::condition_variable ready_;
+	std::condition_variable space_;
+	std::condition_variable done_;
+	std::deque<Job> queue_;
+	size_t pending_;
+	uint64_t enqueued_;
+	uint64_t written_;
+	bool running_;
+	bool stopped_;
+	std::thread thread_;
+};
+
+#endif